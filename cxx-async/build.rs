@@ -36,11 +36,28 @@ fn main() {
     println!("cargo:rustc-cfg=built_with_cargo");
 
     let no_bridges: Vec<PathBuf> = vec![];
-    cxx_build::bridges(no_bridges)
+    let mut build = cxx_build::bridges(no_bridges);
+    build
         .warnings(false)
         .cargo_warnings(false)
         .files(&vec!["src/cxx_async.cpp"])
         .flag_if_supported("-std=c++20")
-        .include("include")
-        .compile("cxx-async");
+        .include("include");
+
+    // Tracing changes the layout of the wakers in `cxx_async.h`, so everything that includes it
+    // has to agree on `CXXASYNC_TRACING`. Dependent build scripts see this as
+    // `DEP_CXX_ASYNC_TRACING`.
+    if env::var_os("CARGO_FEATURE_TRACING").is_some() {
+        build.define("CXXASYNC_TRACING", None);
+        println!("cargo:tracing=1");
+    }
+
+    // Latency histograms don't change any layouts, but C++ code that reads them needs the
+    // declarations. Dependent build scripts see this as `DEP_CXX_ASYNC_LATENCY_HISTOGRAMS`.
+    if env::var_os("CARGO_FEATURE_LATENCY_HISTOGRAMS").is_some() {
+        build.define("CXXASYNC_LATENCY_HISTOGRAMS", None);
+        println!("cargo:latency_histograms=1");
+    }
+
+    build.compile("cxx-async");
 }
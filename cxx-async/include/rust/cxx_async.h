@@ -24,13 +24,15 @@
 #include <cstdint>
 #include <cstring>
 #include <exception>
-#include <functional>
 #include <memory>
 #include <mutex>
 #include <new>
+#include <optional>
 #include <stdexcept>
 #include <type_traits>
 #include <utility>
+#include <variant>
+#include <vector>
 #include "rust/cxx.h"
 
 // Warning! Preprocessor abuse follows!
@@ -132,8 +134,10 @@
       Vtable<CXXASYNC_STRIP_NAMESPACE(__VA_ARGS__)>* CXXASYNC_CONCAT_3(     \
           cxxasync_, CXXASYNC_JOIN_DOLLAR(__VA_ARGS__), _vtable)();         \
   struct CXXASYNC_STRIP_NAMESPACE(__VA_ARGS__)                              \
-      : public ::rust::async::RustFuture<CXXASYNC_STRIP_NAMESPACE(          \
-            __VA_ARGS__)> {                                                 \
+      : public ::rust::async::RustFutureOrStream<                           \
+            CXXASYNC_STRIP_NAMESPACE(__VA_ARGS__),                          \
+            type,                                                           \
+            final_result_type> {                                            \
     typedef type YieldResult;                                               \
     typedef final_result_type FinalResult;                                  \
     static const auto vtable() {                                            \
@@ -148,8 +152,10 @@
    public:                                                                  \
     CXXASYNC_STRIP_NAMESPACE(__VA_ARGS__)                                   \
     (CXXASYNC_STRIP_NAMESPACE(__VA_ARGS__) && other) noexcept               \
-        : ::rust::async::RustFuture<CXXASYNC_STRIP_NAMESPACE(__VA_ARGS__)>( \
-              std::move(other)) {}                                          \
+        : ::rust::async::RustFutureOrStream<                                \
+              CXXASYNC_STRIP_NAMESPACE(__VA_ARGS__),                        \
+              type,                                                         \
+              final_result_type>(std::move(other)) {}                       \
   };                                                                        \
   CXXASYNC_CLOSE_NAMESPACE(__VA_ARGS__)                                     \
   template <typename... Args>                                               \
@@ -185,12 +191,17 @@ template <typename Future, bool YieldResultIsVoid, bool FinalResultIsVoid>
 class RustPromise;
 template <typename Future>
 class RustAwaiter;
+template <typename Future>
+class RustStreamNextAwaiter;
+template <typename Future>
+class RustStreamReceiver;
+class SuspendedCoroutine;
 
 struct RustExeclet;
 
 template <typename Future>
 struct Vtable {
-  RustChannel<Future> (*channel)(RustExeclet* execlet);
+  RustChannel<Future> (*channel)();
   uint32_t (*sender_send)(
       RustSender<Future>& self,
       uint32_t status,
@@ -238,11 +249,70 @@ class RustFuture {
   }
 
   inline RustAwaiter<Derived> operator co_await() && noexcept {
+    static_assert(
+        std::is_same<
+            typename Derived::YieldResult,
+            typename Derived::FinalResult>::value,
+        "Rust streams can't be awaited directly; use `co_await stream.next()`");
     // Transfer ownership of the Rust future to the awaiter.
     return RustAwaiter(std::move(*static_cast<Derived*>(this)));
   }
+
+  // Identifies this future in trace events. See `TraceEvent`.
+  uint64_t trace_id() const noexcept {
+    return reinterpret_cast<uintptr_t>(m_data);
+  }
+};
+
+// Abstract CRTP base class for all streams.
+template <typename Derived>
+class RustStream : public RustFuture<Derived> {
+  friend class RustStreamNextAwaiter<Derived>;
+
+  // The state behind `next()`. The first call creates it, and every call after
+  // that reuses it. This holds a reference to it, which Rust drops along with
+  // the stream, so this must match `CxxAsyncNextReceiver` in `lib.rs`.
+  SuspendedCoroutine* m_next_receiver;
+
+  RustStream() = delete;
+  RustStream(const RustStream&) = delete;
+  void operator=(const RustStream&) = delete;
+
+  RustStreamReceiver<Derived>& next_receiver();
+
+ public:
+  RustStream(RustStream&& other) noexcept
+      : RustFuture<Derived>(std::move(other)),
+        m_next_receiver(std::exchange(other.m_next_receiver, nullptr)) {}
+
+  RustStream& operator=(RustStream&& other) noexcept {
+    // Dropping our Rust stream drops our receiver along with it.
+    RustFuture<Derived>::operator=(std::move(other));
+    m_next_receiver = std::exchange(other.m_next_receiver, nullptr);
+    return *this;
+  }
+
+  // Returns an awaitable that resolves to the next item of a Rust stream, or
+  // to `std::nullopt` once the stream is finished. If Rust produces an error
+  // instead, awaiting it throws. The stream must outlive the awaitable.
+  //
+  // This makes it possible to consume a Rust stream incrementally:
+  //
+  //      while (auto item = co_await stream.next()) {
+  //        ...
+  //      }
+  inline RustStreamNextAwaiter<Derived> next() & noexcept {
+    return RustStreamNextAwaiter<Derived>(*static_cast<Derived*>(this));
+  }
 };
 
+// The base class of the C++ side of a bridged future or stream.
+template <typename Derived, typename YieldResult, typename FinalResult>
+using RustFutureOrStream = std::conditional_t<
+    std::is_same_v<YieldResult, FinalResult>,
+    RustFuture<Derived>,
+    RustStream<Derived>>;
+
 template <typename Future, bool YieldResultIsVoid, bool FinalResultIsVoid>
 struct RustFutureCoroutineTraits {
   using promise_type =
@@ -284,9 +354,13 @@ class RustSender {
     other.m_ptr = nullptr;
     return *this;
   }
-};
 
-class SuspendedCoroutine;
+  // The sender points at the same channel as the future that it sends to, so
+  // the two share an ID. See `TraceEvent`.
+  uint64_t trace_id() const noexcept {
+    return reinterpret_cast<uintptr_t>(m_ptr);
+  }
+};
 
 // This has to be separate from `rust::Error` because constructing a
 // `rust::Error` is private API.
@@ -307,6 +381,10 @@ class Error final : public std::exception {
   }
   template <typename Future>
   friend class RustFutureReceiver;
+  template <typename Future>
+  friend class RustStreamReceiver;
+  template <typename Future>
+  friend class CombinatorSlot;
 
  public:
   Error(const Error& other) {
@@ -376,6 +454,65 @@ struct TryCatch {
   }
 };
 
+// Waker storage customization point. By default, awaiting a Rust future from
+// C++ heap-allocates the waker that Rust uses to resume the coroutine, because
+// a Rust `Waker` is allowed to outlive the poll that it was handed to.
+//
+// If the Rust futures of a given type usually finish without holding on to
+// their waker, because they're ready when first polled or only wake the waker
+// they're polled with before the poll returns, you can store the waker inline
+// in the awaiter instead, which makes `co_await` allocation-free:
+//
+//      namespace rust::async::behavior {
+//      template <>
+//      struct InlineWaker<RustFutureF64, Custom> : std::true_type {};
+//      } // namespace rust::async::behavior
+//
+// Specialize `InlineWaker<T, Custom>` for all `T` to enable this globally.
+// Futures that do hold on to their waker still work: the first time Rust
+// clones an inline waker, the clone goes to the heap as an `EscapedWaker`, so
+// such futures pay for the allocation then instead of up front.
+template <typename T, typename C>
+struct InlineWaker : std::false_type {};
+
+// Coroutine frame allocation customization point. By default, the frame of a
+// C++ coroutine that returns a Rust future or stream comes from the global
+// `operator new`.
+//
+// If you create and destroy lots of short-lived coroutines of a given type, you
+// can have their frames come from a per-thread pool of recently freed frames
+// instead, which avoids the global allocator in the common case and keeps the
+// frames warm in cache:
+//
+//      namespace rust::async::behavior {
+//      template <>
+//      struct PooledFrames<RustFutureString, Custom> : std::true_type {};
+//      } // namespace rust::async::behavior
+//
+// Frames may be freed on any thread. See `FramePool` for statistics.
+template <typename T, typename C>
+struct PooledFrames : std::false_type {};
+
+// Eager polling customization point. By default, `co_await`ing a Rust future
+// always suspends the coroutine and polls the future from `await_suspend()`.
+//
+// If Rust futures of a given type are often finished by the time they're
+// awaited (cache hits, `infallible(async { value })`, and so on), you can have
+// `await_ready()` poll them once first, with a waker that does nothing. If
+// that poll finishes the future, the coroutine takes the result without ever
+// suspending or allocating a waker:
+//
+//      namespace rust::async::behavior {
+//      template <>
+//      struct EagerPoll<RustFutureString, Custom> : std::true_type {};
+//      } // namespace rust::async::behavior
+//
+// If it doesn't, the future is polled again as usual, so a future that's
+// rarely ready right away pays for an extra poll. See `EagerPollCounter` to
+// find out how often it pays off.
+template <typename T, typename C>
+struct EagerPoll : std::false_type {};
+
 } // namespace behavior
 
 void cxxasync_assert(
@@ -384,34 +521,307 @@ void cxxasync_assert(
     const char* file,
     int line);
 
+// How well a thread's coroutine frame pool is doing. See `FramePool::stats()`.
+struct FramePoolStats {
+  // Allocations that reused a frame from the pool.
+  uint64_t hits;
+  // Allocations that had to go to the global `operator new`, either because
+  // the pool was empty or because the frame was too big to pool.
+  uint64_t misses;
+  // Frames that were allocated by this thread and freed by another one.
+  uint64_t remote_frees;
+};
+
+// The per-thread, size-segregated pool that coroutine frames come from when
+// `behavior::PooledFrames` is enabled.
+//
+// Each thread keeps a free list per size class. A frame freed on the thread
+// that allocated it goes straight back onto that thread's free list; a frame
+// freed anywhere else goes onto a lock-free return list, which the owning
+// thread takes over the next time its own free list runs dry.
+class FramePool {
+  FramePool() = delete;
+
+ public:
+  static void* allocate(size_t size);
+  static void deallocate(void* ptr, size_t size) noexcept;
+
+  // Returns the statistics for the calling thread's pool.
+  static FramePoolStats stats() noexcept;
+};
+
+// How often eager polls have found the future already finished on a thread. See
+// `behavior::EagerPoll`.
+struct EagerPollStats {
+  // Eager polls that finished the future.
+  uint64_t hits;
+  // Eager polls after which the coroutine had to suspend anyway.
+  uint64_t misses;
+};
+
+class EagerPollCounter {
+  EagerPollCounter() = delete;
+
+ public:
+  static void count(bool hit) noexcept;
+
+  // Returns the statistics for the calling thread.
+  static EagerPollStats stats() noexcept;
+};
+
+// Latency histograms are only compiled in when `CXXASYNC_LATENCY_HISTOGRAMS` is
+// defined, which the `latency-histograms` feature of the `cxx-async` crate does
+// for its own sources and exports to dependent build scripts as
+// `DEP_CXX_ASYNC_LATENCY_HISTOGRAMS`. Unlike `CXXASYNC_TRACING`, it doesn't
+// change any layouts, so only code that reads the histograms needs it. Without
+// it, nothing reads the clock on the wakeup and execlet paths.
+#ifdef CXXASYNC_LATENCY_HISTOGRAMS
+
+// The intervals that `LatencyHistograms` measures. This must match
+// `LatencyKind` in `latency.rs`.
+enum class LatencyKind : uint32_t {
+  // From a Rust waker firing for a suspended coroutine to the coroutine being
+  // resumed.
+  WakeToResume = 0,
+  // From a task being submitted to an execlet to the execlet running it.
+  ExecletSubmitToRun = 1,
+};
+
+constexpr size_t LATENCY_KIND_COUNT = 2;
+
+// Latency histograms are log-linear, like HdrHistogram: every power of two is
+// split into 16 equal buckets, so a value is never off by more than a sixteenth
+// once it's been bucketed. Values under 16 ns get a bucket each, and values of
+// 2^36 ns (about 69 seconds) and up all share the last bucket.
+//
+// `latency.rs` derives the bucket count from the same constants, and checks it
+// against `LATENCY_BUCKET_COUNT` before it reads a histogram.
+constexpr size_t LATENCY_SUB_BUCKET_BITS = 4;
+constexpr size_t LATENCY_MAX_VALUE_LOG2 = 36;
+constexpr size_t LATENCY_BUCKET_COUNT =
+    (LATENCY_MAX_VALUE_LOG2 - LATENCY_SUB_BUCKET_BITS + 1)
+    << LATENCY_SUB_BUCKET_BITS;
+
+// A histogram of one kind of interval, merged across every thread. See
+// `LatencyHistograms::histogram()`.
+//
+// This must match the layout of `LatencyHistogram` in `latency.rs`.
+struct LatencyHistogram {
+  // How many intervals have been recorded.
+  uint64_t count;
+  // The sum of all of them and the longest one, in nanoseconds.
+  uint64_t total_ns;
+  uint64_t max_ns;
+  // How many intervals fell into each bucket.
+  uint64_t buckets[LATENCY_BUCKET_COUNT];
+
+  // Returns the shortest interval, in nanoseconds, that falls into bucket
+  // `index`.
+  static uint64_t bucket_lower_bound(size_t index) noexcept;
+
+  // Returns the interval, in nanoseconds, that the given fraction (from 0 to 1)
+  // of recorded intervals are no longer than, to the precision of a bucket.
+  // Returns 0 if nothing has been recorded.
+  uint64_t value_at_quantile(double quantile) const noexcept;
+};
+
+// Histograms of the latencies that a wakeup or a submission spends waiting to
+// run, which are otherwise invisible from either side of the bridge.
+//
+// Each thread records into histograms of its own, so recording doesn't contend
+// with other threads. Reading a histogram merges those of every thread, along
+// with the ones of threads that have exited. The histograms count up from
+// process start and are never reset; to look at a window of time, take the
+// difference of two snapshots.
+class LatencyHistograms {
+  LatencyHistograms() = delete;
+
+ public:
+  // Returns the current time, in nanoseconds, on the clock that intervals are
+  // measured with.
+  static uint64_t now() noexcept;
+
+  // Records an interval of the given kind that started at `start_ns` and ends
+  // now.
+  static void record_since(LatencyKind kind, uint64_t start_ns) noexcept;
+
+  static LatencyHistogram histogram(LatencyKind kind) noexcept;
+};
+#endif
+
+// The points in a bridged future's life that can be traced. The numbering is
+// shared with the Rust side.
+enum class TraceEventKind : uint32_t {
+  // A C++ coroutine's channel was created.
+  Create = 0,
+  // A future or stream was polled.
+  Poll = 1,
+  // A Rust waker fired for a suspended C++ coroutine.
+  Wake = 2,
+  // A suspended C++ coroutine was handed back to be resumed.
+  Resume = 3,
+  // A C++ coroutine sent a value, an error, or the end of a stream to Rust.
+  Send = 4,
+  // A future or stream was dropped.
+  Drop = 5,
+};
+
+// One traced event. `future_id` is the address of the state behind the
+// bridged handle, which is the same on both sides of the bridge and stays the
+// same for as long as the handle is alive. It's 0 for combinators, which
+// aren't bridged futures themselves.
+struct TraceEvent {
+  TraceEventKind kind;
+  uint64_t future_id;
+  // Nanoseconds on a monotonic clock. Rust timestamps its own events with the
+  // same clock, so the two sides can be lined up.
+  uint64_t timestamp_ns;
+};
+
+// Per-future lifecycle tracing, for finding out where a future spent its time
+// as it went back and forth across the bridge.
+//
+// This is only compiled in when `CXXASYNC_TRACING` is defined, which the
+// `tracing` feature of the `cxx-async` crate does for its own sources and
+// exports to dependent build scripts as `DEP_CXX_ASYNC_TRACING`. It must be
+// defined the same way in every translation unit that includes this header,
+// because it changes the layout of the wakers. Without it, all of this
+// compiles to nothing.
+//
+// Rust reports creation, polls, sends, and drops to the `tracing` crate. C++
+// reports wakeups and resumptions to the callback installed here, if any.
+#ifdef CXXASYNC_TRACING
+class Tracing {
+  Tracing() = delete;
+
+ public:
+  using Callback = void (*)(const TraceEvent& event);
+
+  // Installs the callback that C++ events go to, replacing any previous one.
+  // Pass null to stop tracing. The callback may be called on any thread.
+  static void set_callback(Callback callback) noexcept;
+
+  // Returns the current time on the clock that events are stamped with.
+  static uint64_t now() noexcept;
+
+  static void emit(TraceEventKind kind, uint64_t future_id) noexcept;
+};
+#endif
+
+// A task that can be submitted to an execlet.
+//
+// Tasks are intrusive: the execlet links queued tasks together through `next`
+// instead of allocating queue nodes of its own. The submitter owns the memory,
+// usually by deriving from this, and must keep it alive until the execlet calls
+// `run`, after which the execlet never touches it again.
+//
+// This must match the layout of `ExecletTask` in `execlet.rs`.
+struct ExecletTask;
+
+extern "C" {
+// Runs a task. Rust calls this through a C function pointer, so it must have C
+// language linkage, which rules out static member functions.
+typedef void ExecletTaskRun(ExecletTask* task);
+}
+
+struct ExecletTask {
+  // Owned by the execlet while the task is queued.
+  ExecletTask* next;
+  ExecletTaskRun* run;
+  // Set by the execlet on submission when latency histograms are on. See
+  // `LatencyKind::ExecletSubmitToRun`.
+  uint64_t submitted_at_ns;
+};
+
+// Something that wants to know when Rust drops the future of a coroutine
+// before the coroutine finishes. See `Execlet::set_canceller()`.
+//
+// This must match the layout of `ExecletCanceller` in `execlet.rs`.
+struct ExecletCanceller;
+
+extern "C" {
+// A callback on an `ExecletCanceller`. Like `ExecletTaskRun`, this must have C
+// language linkage.
+typedef void ExecletCancellerCallback(ExecletCanceller* canceller);
+}
+
+struct ExecletCanceller {
+  // Requests cancellation. This may be called more than once, on any thread.
+  ExecletCancellerCallback* cancel;
+  // Drops the reference that the execlet holds.
+  ExecletCancellerCallback* drop;
+};
+
 // Execlet API
 extern "C" {
-// Creates a new execlet.
-RustExeclet* cxxasync_execlet_create();
-// Decrements the reference count on an execlet and frees it if the count hits
-// zero. Returns true if the execlet is still alive after this call and false
-// otherwise.
-bool cxxasync_execlet_release(RustExeclet* self);
-// Submit a task to the execlet. This internally bumps the reference count.
-void cxxasync_execlet_submit(RustExeclet* self, void (*run)(void*), void* task);
+// Submit a task to the execlet.
+void cxxasync_execlet_submit(RustExeclet* self, ExecletTask* task);
+// Register the object to notify when the coroutine is cancelled.
+void cxxasync_execlet_set_canceller(
+    RustExeclet* self,
+    ExecletCanceller* canceller);
 }
 
 // Execlet
+//
+// The Rust execlet lives in the same allocation as the channel of the
+// coroutine that it belongs to, so this doesn't own a reference to it; the
+// promise's sender keeps it alive.
 class Execlet {
+ public:
+  // An executor that a backend layers on top of an execlet (e.g.
+  // `FollyExeclet`). Each execlet creates at most one of these, on first use,
+  // and releases it when the execlet goes away, so that every `co_await` in a
+  // coroutine shares the same one.
+  class Adapter {
+   public:
+    // Called when the execlet is destroyed. The adapter may outlive this call
+    // if it has other users.
+    virtual void release() noexcept = 0;
+
+   protected:
+    ~Adapter() = default;
+  };
+
+ private:
   RustExeclet* m_priv;
+  Adapter* m_adapter;
 
   Execlet(const Execlet&) = delete;
   Execlet& operator=(const Execlet&) = delete;
 
  public:
-  Execlet() : m_priv(cxxasync_execlet_create()) {}
+  explicit Execlet(RustExeclet* priv) : m_priv(priv), m_adapter(nullptr) {}
 
   ~Execlet() {
-    cxxasync_execlet_release(m_priv);
+    if (m_adapter != nullptr) {
+      m_adapter->release();
+    }
+  }
+
+  // Returns this execlet's adapter, creating it with `new T(*this)` if it
+  // doesn't exist yet. A coroutine must only ever use one adapter type.
+  template <typename T>
+  T& adapter() {
+    if (m_adapter == nullptr) {
+      m_adapter = new T(*this);
+    }
+    return *static_cast<T*>(m_adapter);
   }
 
-  void submit(void* task, void (*run)(void*)) noexcept {
-    cxxasync_execlet_submit(m_priv, run, task);
+  // Queues `task` to be run the next time Rust polls the coroutine that this
+  // execlet belongs to. This is safe to call from any thread.
+  void submit(ExecletTask* task) noexcept {
+    cxxasync_execlet_submit(m_priv, task);
+  }
+
+  // Arranges for `canceller` to be notified if Rust drops the future of the
+  // coroutine that this execlet belongs to before the coroutine finishes, and
+  // hands it a reference that it releases when the execlet goes away. If that
+  // has already happened, it's notified right away. Backends call this when
+  // they set up their adapter; call it at most once per execlet.
+  void set_canceller(ExecletCanceller* canceller) noexcept {
+    cxxasync_execlet_set_canceller(m_priv, canceller);
   }
 
   RustExeclet* raw() {
@@ -419,6 +829,38 @@ class Execlet {
   }
 };
 
+// `co_await rust::async::cancellation_token()` inside a coroutine that
+// returns a Rust future or stream to get a token that's cancelled if Rust
+// drops the future before the coroutine finishes. This never suspends.
+//
+// The type of the token depends on the backend: `folly::CancellationToken` for
+// Folly and `cppcoro::cancellation_token` for cppcoro. Folly also passes the
+// token along to every Folly operation that the coroutine awaits, so most Folly
+// code doesn't need to ask for it.
+struct CancellationTokenRequest {};
+
+inline CancellationTokenRequest cancellation_token() noexcept {
+  return {};
+}
+
+// An awaitable that finishes right away with a value. Backends use this to
+// answer `cancellation_token()`.
+template <typename T>
+class ReadyAwaiter {
+  T m_value;
+
+ public:
+  explicit ReadyAwaiter(T&& value) : m_value(std::move(value)) {}
+
+  bool await_ready() const noexcept {
+    return true;
+  }
+  void await_suspend(std_coroutine::coroutine_handle<void>) const noexcept {}
+  T await_resume() {
+    return std::move(m_value);
+  }
+};
+
 enum class FuturePollStatus {
   Pending,
   Complete,
@@ -445,6 +887,11 @@ enum class RustSendResult {
   Finished,
 };
 
+// The status to pass to `sender_send` along with a `RustStreamBatchData` to
+// send several stream items at once. This must match
+// `FUTURE_STATUS_RUNNING_BATCH` in `lib.rs`.
+constexpr uint32_t FUTURE_STATUS_RUNNING_BATCH = 4;
+
 inline bool wake_status_is_done(FutureWakeStatus status) {
   return status == FutureWakeStatus::Complete ||
       status == FutureWakeStatus::Error;
@@ -480,6 +927,9 @@ template <typename Future>
 struct RustChannel {
   Future future;
   RustSender<Future> sender;
+  // Owned by the same allocation as the sender, so this stays alive for as
+  // long as the sender does.
+  RustExeclet* execlet;
 };
 
 // A temporary place to hold future results or errors that are sent to or
@@ -513,162 +963,226 @@ union RustFutureResult<void> {
   void getResult() {}
 };
 
-template <typename Future>
-class RustFutureReceiver {
-  using YieldResult = typename Future::YieldResult;
-
-  std::mutex m_lock;
-  Future m_future;
-  RustFutureResult<YieldResult> m_result;
-  FuturePollStatus m_status;
+// The operations that differ between kinds of suspended coroutine. There's one
+// static instance of this per `SuspendedCoroutineImpl` instantiation.
+struct SuspendedCoroutineVtable {
+  std_coroutine::coroutine_handle<void> (*take_wakeup)(SuspendedCoroutine*);
+  void (*deallocate)(SuspendedCoroutine*);
+  // Called when only the owner's reference is left, so that nothing can wake
+  // the coroutine anymore.
+  void (*abandon)(SuspendedCoroutine*);
+  // Answer Rust cloning and waking (consuming the reference) a waker.
+  SuspendedCoroutine* (*clone)(SuspendedCoroutine*);
+  void (*wake)(SuspendedCoroutine*);
+};
 
-  RustFutureReceiver(const RustFutureReceiver&) = delete;
-  void operator=(const RustFutureReceiver&) = delete;
+// Runs the wakeups that Rust sends to suspended C++ coroutines one after
+// another on each thread, instead of nesting them.
+//
+// Without this, a Rust waker that fires while C++ is polling or resuming would
+// poll and resume its coroutine right there on the stack, so a chain of
+// coroutines that wake one another (Rust to C++ to Rust and so on) would grow
+// the stack by several frames per hop, and could even try to poll a future
+// whose lock is already held further up the stack. Instead, such a wakeup is
+// queued, and the outermost wakeup on the thread, or the outermost
+// `await_suspend()`, drains the queue in a loop. A coroutine that suspends
+// while the queue is being drained transfers control straight to the next
+// queued coroutine that's ready to run.
+class WakeTrampoline {
+  WakeTrampoline() = delete;
+
+  static std_coroutine::coroutine_handle<void> take_next() noexcept;
+  static void drain() noexcept;
 
  public:
-  explicit RustFutureReceiver(Future&& future)
-      : m_lock(),
-        m_future(std::move(future)),
-        m_status(FuturePollStatus::Pending) {}
+  // What the trampoline on this thread is doing.
+  enum class Mode : uint8_t {
+    // Nothing; wakeups run right away.
+    Idle,
+    // Polling a Rust future on behalf of a coroutine; wakeups are queued.
+    Polling,
+    // Draining the queue; wakeups are queued.
+    Draining,
+  };
 
-  // Consumes the `coroutine` reference (so you probably want to addref it
-  // first).
-  FutureWakeStatus wake(SuspendedCoroutine* coroutine);
+  // Wakes `coroutine`, consuming a reference to it.
+  static void wake(SuspendedCoroutine* coroutine) noexcept;
 
-  YieldResult get_result() {
-    // Safe to use without taking the lock because the caller asserts that the
-    // future has already completed.
-    switch (m_status) {
-      case FuturePollStatus::Complete:
-        return m_result.getResult();
-      case FuturePollStatus::Error: {
-        Error error(m_result.m_exception.c_str());
-        m_result.m_exception.~String();
-        throw std::move(error);
-      }
-      case FuturePollStatus::Pending:
-      case FuturePollStatus::Running:
-        // TODO(pcwalton): Handle C++ consuming Rust streams.
-        CXXASYNC_ASSERT(false);
-        std::terminate();
+  // Brackets a poll of a Rust future that happens outside the trampoline's
+  // own loop. `begin_poll()` returns what to pass to `end_poll()`.
+  //
+  // Until the outermost poll ends, every wakeup on this thread is queued
+  // instead of run. So nothing inside a poll may block the thread on a
+  // coroutine (with `cppcoro::sync_wait()`, `folly::coro::blockingWait()`,
+  // `futures::executor::block_on()`, and so on): if that coroutine is woken on
+  // this thread, its wakeup sits in the queue behind the blocked poll forever.
+  // `begin_blocking()` catches this.
+  static Mode begin_poll() noexcept;
+  static void end_poll(Mode previous) noexcept;
+
+  // Like `end_poll()`, but for a poll made by `await_suspend()`. `next` is the
+  // coroutine to resume, or null if it went to sleep. Returns the coroutine
+  // that `await_suspend()` should transfer control to.
+  static std_coroutine::coroutine_handle<void> end_suspend(
+      Mode previous,
+      std_coroutine::coroutine_handle<void> next) noexcept;
+
+  // Brackets a call that blocks this thread on a coroutine. `begin_blocking()`
+  // returns what to pass to `end_blocking()`.
+  //
+  // `begin_blocking()` aborts if this thread is in the middle of a poll, where
+  // blocking could deadlock; see `begin_poll()`. If the trampoline is draining
+  // instead, then a coroutine that the trampoline resumed is about to block,
+  // and the trampoline can't run anything else until it returns. So this runs
+  // the wakeups that are already queued, and until `end_blocking()`, wakeups
+  // on this thread run right away instead of being queued.
+  static Mode begin_blocking() noexcept;
+  static void end_blocking(Mode previous) noexcept;
+
+  // Calls `begin_blocking()` and `end_blocking()` around its lifetime.
+  class BlockingScope {
+    Mode m_previous;
+
+    BlockingScope(const BlockingScope&) = delete;
+    BlockingScope& operator=(const BlockingScope&) = delete;
+
+   public:
+    BlockingScope() noexcept : m_previous(begin_blocking()) {}
+    ~BlockingScope() noexcept {
+      end_blocking(m_previous);
     }
-  }
+  };
 };
 
-template <typename Future>
-class RustAwaiter {
-  using YieldResult = typename Future::YieldResult;
-
-  friend class SuspendedCoroutine;
-
-  std::shared_ptr<RustFutureReceiver<Future>> m_receiver;
+// Wrapper object that encapsulates a suspended coroutine. This is the waker
+// that is exposed to Rust.
+//
+// This object is *manually* reference counted via `add_ref()` and `release()`,
+// to match the `RawWaker` interface that Rust expects. The awaiter that owns it
+// holds one reference for as long as it's alive, and every Rust `Waker` holds
+// another.
+//
+// Concrete wakers derive from `SuspendedCoroutineImpl`, which supplies a
+// static `SuspendedCoroutineVtable`, or from `EscapedWaker`. The extern "C"
+// wake functions normally hand the waker to `WakeTrampoline`, which
+// dispatches through that table exactly once per wakeup.
+class SuspendedCoroutine {
+  SuspendedCoroutine(const SuspendedCoroutine&) = delete;
+  void operator=(const SuspendedCoroutine&) = delete;
 
-  RustAwaiter(const RustAwaiter&) = delete;
-  void operator=(const RustAwaiter&) = delete;
+  template <typename Derived>
+  friend class SuspendedCoroutineImpl;
+  friend class WakeTrampoline;
+  friend class EscapedWaker;
+
+  // Where we are in the process of going to sleep. This lets a wakeup that
+  // races with `initial_suspend()` on another thread hand the coroutine back to
+  // `initial_suspend()` instead of resuming it out from underneath
+  // `await_suspend()`.
+  enum class State : uint8_t {
+    // Running, finished, or not yet suspended.
+    Running,
+    // Inside `initial_suspend()`.
+    Suspending,
+    // Asleep and waiting for a Rust waker to fire.
+    Suspended,
+    // Completed on another thread while still inside `initial_suspend()`.
+    WokenEarly,
+    // The awaiter has gone away, so nothing may resume the coroutine anymore,
+    // and any Rust wakers that are still around do nothing when fired.
+    Detached,
+  };
 
- public:
-  explicit RustAwaiter(Future&& future)
-      : m_receiver(
-            std::make_shared<RustFutureReceiver<Future>>(std::move(future))) {}
+  const SuspendedCoroutineVtable* m_vtable;
+  std::atomic<uintptr_t> m_refcount;
+  std::atomic<State> m_state;
+  std_coroutine::coroutine_handle<void> m_next;
+#ifdef CXXASYNC_TRACING
+  // The future that the coroutine is waiting on. See `TraceEvent`.
+  uint64_t m_trace_id = 0;
+#endif
 
-  bool await_ready() noexcept {
-    // We could poll here, but let's not. Assume that polling is more expensive
-    // than creating the coroutine state.
-    return false;
+  // Claims the right to resume the coroutine. Returns a null handle if
+  // `initial_suspend()` is still running, in which case it will resume the
+  // coroutine itself by declining to go to sleep, or if the awaiter has been
+  // destroyed in the meantime.
+  std_coroutine::coroutine_handle<void> take_coroutine_handle() {
+    State state = State::Suspending;
+    if (m_state.compare_exchange_strong(state, State::WokenEarly)) {
+      return {};
+    }
+    state = State::Suspended;
+    if (!m_state.compare_exchange_strong(state, State::Running)) {
+      // The awaiter has gone away in the meantime. A reused waker may even
+      // have moved on to a new awaiter already. See `RustStreamReceiver`.
+      CXXASYNC_ASSERT(state == State::Detached || state == State::Running);
+      return {};
+    }
+    return std::exchange(m_next, {});
   }
 
-  bool await_suspend(std_coroutine::coroutine_handle<void> next);
+ protected:
+  explicit SuspendedCoroutine(const SuspendedCoroutineVtable* vtable)
+      : m_vtable(vtable), m_refcount(1), m_state(State::Running), m_next() {}
 
-  YieldResult await_resume() {
-    return m_receiver->get_result();
+  ~SuspendedCoroutine() {
+    // If this fires, a Rust waker outlived the awaiter that it points into.
+    CXXASYNC_ASSERT(m_refcount.load() == 0);
   }
-};
-
-template <typename Future>
-class RustStreamAwaiter {
-  using YieldResult = typename Future::YieldResult;
-
-  friend class SuspendedCoroutine;
-
-  // FIXME(pcwalton): I think this needs to be a `shared_ptr`!
-  RustSender<Future>& m_sender;
-  YieldResult&& m_value;
-
-  FutureWakeStatus poll_next(SuspendedCoroutine* coroutine) noexcept;
-
-  RustStreamAwaiter(const RustStreamAwaiter&) = delete;
-  void operator=(const RustStreamAwaiter&) = delete;
 
- public:
-  RustStreamAwaiter(RustSender<Future>& sender, YieldResult&& value)
-      : m_sender(sender), m_value(std::move(value)) {}
+  // Waits for the references that other threads are still using to go away.
+  // For wakers that live inside their awaiter, which can't be destroyed before
+  // then. The caller must have made sure that no new references can appear.
+  void wait_until_unreferenced() noexcept;
 
-  bool await_ready() noexcept {
-    return false;
+  // Called when `initial_suspend()` decides not to go to sleep after all.
+  void forget_coroutine_handle() {
+    m_state.store(State::Running);
+    m_next = {};
   }
-  bool await_suspend(std_coroutine::coroutine_handle<void> next);
-  void await_resume() {}
-};
-
-// This is like `std_coroutine::coroutine_handle<void>`, but it doesn't *have*
-// to be a coroutine handle.
-class Continuation {
-  Continuation(const Continuation&) = delete;
-  void operator=(const Continuation&) = delete;
-
- protected:
-  Continuation() {}
-
- public:
-  virtual ~Continuation() {}
-  virtual void resume() = 0;
-  virtual void destroy() = 0;
-};
 
-class CoroutineHandleContinuation : public Continuation {
-  std_coroutine::coroutine_handle<void> m_next;
-
- public:
-  explicit CoroutineHandleContinuation(
-      std_coroutine::coroutine_handle<void>&& next)
-      : m_next(next) {}
-  void resume() override {
-    m_next.resume();
-  }
-  void destroy() override {
-    m_next.destroy();
+  // Called by the owning awaiter when it's destroyed, before it drops what it
+  // was waiting on, so that a wakeup racing with the destruction can neither
+  // resume the coroutine nor destroy it a second time. Returns true if the
+  // coroutine was still asleep, in which case nobody will ever collect the
+  // result of the operation, even if it has finished.
+  bool detach_coroutine() {
+    if (m_state.exchange(State::Detached) != State::Suspended) {
+      return false;
+    }
+    m_next = {};
+    return true;
   }
-};
 
-// Wrapper object that encapsulates a suspended coroutine. This is the waker
-// that is exposed to Rust.
-//
-// This object is *manually* reference counted via `add_ref()` and `release()`,
-// to match the `RawWaker` interface that Rust expects.
-class SuspendedCoroutine {
-  SuspendedCoroutine(const SuspendedCoroutine&) = delete;
-  void operator=(const SuspendedCoroutine&) = delete;
+  bool is_detached() const {
+    return m_state.load() == State::Detached;
+  }
 
-  using WakeFn = std::function<FutureWakeStatus(SuspendedCoroutine*)>;
+  // Whether the coroutine has started to go to sleep and hasn't been woken
+  // yet.
+  bool is_waiting() const {
+    State state = m_state.load();
+    return state == State::Suspending || state == State::Suspended;
+  }
 
-  std::atomic<uintptr_t> m_refcount;
-  std::unique_ptr<Continuation> m_next;
-  WakeFn m_wake_fn;
+  // Undoes `detach_coroutine()`, for wakers that are reused by one awaiter
+  // after another.
+  void reattach_coroutine() {
+    m_state.store(State::Running);
+  }
 
-  void forget_coroutine_handle() {
-    m_next.reset();
+  void set_trace_id([[maybe_unused]] uint64_t trace_id) {
+#ifdef CXXASYNC_TRACING
+    m_trace_id = trace_id;
+#endif
   }
 
  public:
-  SuspendedCoroutine(std::unique_ptr<Continuation>&& next, WakeFn&& wake_fn)
-      : m_refcount(1), m_next(std::move(next)), m_wake_fn(std::move(wake_fn)) {}
-
-  ~SuspendedCoroutine() {
-    if (m_next) {
-      m_next->destroy();
-      m_next.reset();
-    }
+#ifdef CXXASYNC_TRACING
+  uint64_t trace_id() const {
+    return m_trace_id;
   }
+#endif
 
   SuspendedCoroutine* add_ref() {
     m_refcount.fetch_add(1);
@@ -679,59 +1193,1308 @@ class SuspendedCoroutine {
     uintptr_t last_refcount = m_refcount.fetch_sub(1);
     CXXASYNC_ASSERT(last_refcount > 0);
     if (last_refcount == 1) {
-      delete this;
+      m_vtable->deallocate(this);
+    } else if (last_refcount == 2) {
+      m_vtable->abandon(this);
     }
   }
 
-  // Does not consume the `this` reference.
-  FutureWakeStatus wake() {
-    return m_wake_fn(this);
+  // Answers Rust cloning the waker. Returns the waker that the clone refers
+  // to, which isn't necessarily `this`.
+  SuspendedCoroutine* clone() {
+    return m_vtable->clone(this);
   }
 
-  // Performs the initial poll needed when we go to sleep for the first time.
-  // Returns true if we should go to sleep and false otherwise.
+  // Polls, and resumes the coroutine if that finished the operation it was
+  // waiting for. This may happen later, via `WakeTrampoline`.
   //
-  // Consumes the `this` reference.
-  bool initial_suspend() {
-    FutureWakeStatus status = wake();
-
-    // Tricky: if the future is already complete, we won't go to sleep, which
-    // means we won't resume, so unless we intervene like this nothing will stop
-    // our destructor from destroying the coroutine handle.
-    bool done = wake_status_is_done(status);
-    if (done) {
-      forget_coroutine_handle();
-    }
-    release();
-    return !done;
+  // Does not consume the `this` reference.
+  void wake_by_ref() {
+    m_vtable->wake(add_ref());
   }
 
-  void resume() {
-    CXXASYNC_ASSERT(bool(m_next));
-    std::unique_ptr<Continuation> next = std::move(m_next);
-    forget_coroutine_handle();
-    next->resume();
+  // Like `wake_by_ref()`, but consumes the `this` reference.
+  void wake() {
+    m_vtable->wake(this);
   }
 };
 
-// Promise object that manages the channel that is returned to Rust when Rust
-// calls a C++ coroutine.
-template <typename Future>
-class RustPromiseBase {
-  using Channel = RustChannel<Future>;
-
-  // This must precede `m_channel`.
-  Execlet m_execlet;
-
-  RustPromiseBase(const RustPromiseBase&) = delete;
-  RustPromiseBase& operator=(const RustPromiseBase&) = delete;
+// A Rust waker cloned from one that lives inside its awaiter. See
+// `behavior::InlineWaker`.
+//
+// Rust may keep a clone for as long as it likes, so clones can't point into
+// the awaiter. Instead, the first clone creates one of these on the heap, and
+// every clone after that shares it. It forwards wakeups to the inline waker
+// until the awaiter goes away, and does nothing afterward.
+class EscapedWaker final : public SuspendedCoroutine {
+  static const SuspendedCoroutineVtable s_vtable;
 
- protected:
-  Channel m_channel;
+  std::mutex m_lock;
+  // The inline waker, or null once its awaiter has gone away.
+  SuspendedCoroutine* m_target;
+  // Whether we hold a reference to the inline waker. We do whenever anything
+  // other than the inline waker refers to us, so that it knows it might still
+  // be woken.
+  bool m_holds_target;
+
+  static std_coroutine::coroutine_handle<void> take_wakeup_impl(
+      SuspendedCoroutine* coroutine);
+  static void deallocate_impl(SuspendedCoroutine* coroutine);
+  static void abandon_impl(SuspendedCoroutine* coroutine);
+  static SuspendedCoroutine* clone_impl(SuspendedCoroutine* coroutine);
+  static void wake_impl(SuspendedCoroutine* coroutine);
 
  public:
-  RustPromiseBase()
-      : m_execlet(), m_channel(Future::vtable()->channel(m_execlet.raw())) {}
+  // Holds one reference for `target` and one for the clone being made.
+  explicit EscapedWaker(SuspendedCoroutine* target);
+
+  // Makes another clone on behalf of the inline waker.
+  SuspendedCoroutine* clone_from_target();
+
+  // Called when the inline waker's awaiter goes away. Drops the inline waker's
+  // reference to us.
+  void detach_target();
+};
+
+// CRTP base for concrete suspended coroutines. `Derived` must provide:
+//
+// * `FutureWakeStatus poll()`, which tries to make progress on whatever the
+//   coroutine is waiting for. It must not consume the `this` reference.
+//
+// * `void deallocate()`, which is called when the last reference goes away.
+//
+// It may also hide `clone_from_rust()` and `wake_from_rust()`, which answer
+// Rust cloning and waking the waker.
+template <typename Derived>
+class SuspendedCoroutineImpl : public SuspendedCoroutine {
+  Derived* derived() noexcept {
+    return static_cast<Derived*>(this);
+  }
+
+  // Polls, and returns the coroutine to resume if that finished the operation
+  // it was waiting for. Consumes the `this` reference, dropping it *before* the
+  // caller resumes, so that the awaiter is free to go away once the coroutine
+  // runs.
+  static std_coroutine::coroutine_handle<void> take_wakeup_impl(
+      SuspendedCoroutine* coroutine) {
+    std_coroutine::coroutine_handle<void> next;
+    // A waker that fires after the awaiter has gone away has nothing to do.
+    if (!coroutine->is_detached() &&
+        wake_status_is_done(static_cast<Derived*>(coroutine)->poll())) {
+      next = coroutine->take_coroutine_handle();
+    }
+#ifdef CXXASYNC_TRACING
+    if (next) {
+      Tracing::emit(TraceEventKind::Resume, coroutine->trace_id());
+    }
+#endif
+    coroutine->release();
+    return next;
+  }
+
+  static void deallocate_impl(SuspendedCoroutine* coroutine) {
+    static_cast<Derived*>(coroutine)->deallocate();
+  }
+
+  static void abandon_impl(SuspendedCoroutine* coroutine) {
+    // Only the awaiter's own reference is left, so nothing can ever wake this
+    // coroutine up again. Destroy it so that its destructors run. This
+    // destroys the awaiter and therefore possibly `coroutine`.
+    State state = State::Suspended;
+    if (coroutine->m_state.compare_exchange_strong(state, State::Running)) {
+      std::exchange(coroutine->m_next, {}).destroy();
+    }
+  }
+
+  static SuspendedCoroutine* clone_impl(SuspendedCoroutine* coroutine) {
+    return static_cast<Derived*>(coroutine)->clone_from_rust();
+  }
+
+  static void wake_impl(SuspendedCoroutine* coroutine) {
+    static_cast<Derived*>(coroutine)->wake_from_rust();
+  }
+
+  static constexpr SuspendedCoroutineVtable s_vtable = {
+      take_wakeup_impl,
+      deallocate_impl,
+      abandon_impl,
+      clone_impl,
+      wake_impl,
+  };
+
+ protected:
+  SuspendedCoroutineImpl() : SuspendedCoroutine(&s_vtable) {}
+  ~SuspendedCoroutineImpl() = default;
+
+  SuspendedCoroutine* clone_from_rust() {
+    return this->add_ref();
+  }
+
+  void wake_from_rust() {
+    WakeTrampoline::wake(this);
+  }
+
+ public:
+  // Performs the initial poll needed when we go to sleep for the first time.
+  // Returns true if we should go to sleep and false otherwise.
+  //
+  // If this returns true, the coroutine might already have been destroyed, so
+  // the caller must not touch the awaiter afterward.
+  bool initial_suspend(std_coroutine::coroutine_handle<void> next) {
+    m_next = next;
+    m_state.store(State::Suspending);
+
+    // Hold a reference so that Rust dropping its waker during the poll can't
+    // trigger the "nobody can wake us" check in `release()` prematurely.
+    add_ref();
+
+    // Tricky: if the future is already complete, we won't go to sleep, which
+    // means we won't resume, so forget the coroutine handle. The same goes if
+    // another thread finished the operation while we were polling.
+    State state = State::Suspending;
+    if (wake_status_is_done(derived()->poll()) ||
+        !m_state.compare_exchange_strong(state, State::Suspended)) {
+      forget_coroutine_handle();
+      release();
+      return false;
+    }
+
+    release();
+    return true;
+  }
+
+  // Goes to sleep via `initial_suspend()` and returns the coroutine that
+  // `await_suspend()` should transfer control to: `next` if we didn't go to
+  // sleep after all, and otherwise whatever `WakeTrampoline` has ready.
+  //
+  // As with `initial_suspend()`, the caller must not touch the awaiter
+  // afterward.
+  std_coroutine::coroutine_handle<void> suspend(
+      std_coroutine::coroutine_handle<void> next) {
+    WakeTrampoline::Mode previous = WakeTrampoline::begin_poll();
+    bool sleeping = initial_suspend(next);
+    return WakeTrampoline::end_suspend(
+        previous, sleeping ? std_coroutine::coroutine_handle<void>() : next);
+  }
+};
+
+// The state needed to await a Rust future from C++: the future itself, the
+// place to put its result, and the waker that Rust uses to get back to us.
+//
+// This is either allocated on the heap or stored directly inside the
+// `RustAwaiter`, according to `behavior::InlineWaker`.
+template <typename Future>
+class RustFutureReceiver final
+    : public SuspendedCoroutineImpl<RustFutureReceiver<Future>> {
+  friend class SuspendedCoroutineImpl<RustFutureReceiver>;
+
+  using YieldResult = typename Future::YieldResult;
+
+  std::mutex m_lock;
+  std::optional<Future> m_future;
+  RustFutureResult<YieldResult> m_result;
+  FuturePollStatus m_status;
+  bool m_heap_allocated;
+  // Only used when we live inside the awaiter. Set if Rust wakes the waker
+  // that it's polling with before the poll returns.
+  std::atomic<bool> m_woken_during_poll;
+  // Only used when we live inside the awaiter. Where Rust's clones of our
+  // waker point. See `EscapedWaker`.
+  std::atomic<EscapedWaker*> m_escaped;
+
+  RustFutureReceiver(const RustFutureReceiver&) = delete;
+  void operator=(const RustFutureReceiver&) = delete;
+
+  FutureWakeStatus poll();
+
+  void deallocate() {
+    if (m_heap_allocated) {
+      delete this;
+    }
+  }
+
+  // Rust can only clone the waker that it's polling with, so if we live
+  // inside the awaiter, hand it a waker on the heap that can outlive us.
+  SuspendedCoroutine* clone_from_rust() {
+    if (m_heap_allocated) {
+      return this->add_ref();
+    }
+    EscapedWaker* escaped = m_escaped.load();
+    if (escaped != nullptr) {
+      return escaped->clone_from_target();
+    }
+    escaped = new EscapedWaker(this);
+    EscapedWaker* expected = nullptr;
+    if (!m_escaped.compare_exchange_strong(expected, escaped)) {
+      // Another thread beat us to it.
+      escaped->detach_target();
+      escaped->release();
+      return expected->clone_from_target();
+    }
+    return escaped;
+  }
+
+  // Likewise, Rust can only wake the waker that it's polling with while the
+  // poll is still running, so if we live inside the awaiter, `poll()` takes
+  // care of it instead of `WakeTrampoline`. That way, no wakeup that refers to
+  // us can still be queued once the awaiter has gone away.
+  void wake_from_rust() {
+    if (m_heap_allocated) {
+      WakeTrampoline::wake(this);
+      return;
+    }
+    m_woken_during_poll.store(true);
+    this->release();
+  }
+
+  // Destroys a result that the coroutine will never pick up. Must be called
+  // with the lock held.
+  void drop_unclaimed_result() {
+    switch (m_status) {
+      case FuturePollStatus::Complete:
+        if constexpr (!std::is_void_v<YieldResult>) {
+          m_result.m_result.~YieldResult();
+        }
+        break;
+      case FuturePollStatus::Error:
+        m_result.m_exception.~String();
+        break;
+      case FuturePollStatus::Pending:
+      case FuturePollStatus::Running:
+        break;
+    }
+  }
+
+ public:
+  RustFutureReceiver(Future&& future, bool heap_allocated)
+      : m_lock(),
+        m_future(std::move(future)),
+        m_status(FuturePollStatus::Pending),
+        m_heap_allocated(heap_allocated),
+        m_woken_during_poll(false),
+        m_escaped(nullptr) {
+    this->set_trace_id(m_future->trace_id());
+  }
+
+  // Drops the Rust future and the awaiter's reference to this object. Called
+  // when the awaiter is destroyed, including when the coroutine is destroyed
+  // while it's still waiting, so that the Rust future and whatever it holds
+  // go away right here instead of whenever a stray waker next fires. Any
+  // wakers that Rust still holds become no-ops.
+  void detach() {
+    bool was_suspended = this->detach_coroutine();
+
+    // Taking the lock waits out any poll that's running on another thread.
+    // Drop the future outside the lock, because dropping it might drop or even
+    // invoke wakers that point back at us.
+    std::unique_lock<std::mutex> guard(m_lock);
+    std::optional<Future> future(std::move(m_future));
+    m_future.reset();
+    if (was_suspended) {
+      drop_unclaimed_result();
+    }
+    guard.unlock();
+    future.reset();
+
+    if (EscapedWaker* escaped = m_escaped.load()) {
+      escaped->detach_target();
+    }
+    // If we're on the heap, this might destroy us.
+    bool inline_waker = !m_heap_allocated;
+    this->release();
+    if (inline_waker) {
+      this->wait_until_unreferenced();
+    }
+  }
+
+  YieldResult get_result() {
+    // Safe to use without taking the lock because the caller asserts that the
+    // future has already completed.
+    return take_result(m_status, m_result);
+  }
+
+  // Returns the value that a finished poll left in `result`, or throws the
+  // error that it left there.
+  static YieldResult take_result(
+      FuturePollStatus status,
+      RustFutureResult<YieldResult>& result) {
+    switch (status) {
+      case FuturePollStatus::Complete:
+        return result.getResult();
+      case FuturePollStatus::Error: {
+        Error error(result.m_exception.c_str());
+        result.m_exception.~String();
+        throw std::move(error);
+      }
+      case FuturePollStatus::Pending:
+      case FuturePollStatus::Running:
+        // Futures never report `Running`; streams go through
+        // `RustStreamReceiver` instead.
+        CXXASYNC_ASSERT(false);
+        std::terminate();
+    }
+  }
+};
+
+template <typename Future>
+class RustAwaiter {
+  using YieldResult = typename Future::YieldResult;
+  using Receiver = RustFutureReceiver<Future>;
+
+  static constexpr bool INLINE_WAKER =
+      behavior::InlineWaker<Future, behavior::Custom>::value;
+  static constexpr bool EAGER_POLL =
+      behavior::EagerPoll<Future, behavior::Custom>::value;
+
+  // The future, until the receiver takes it over in `await_suspend()`.
+  Future m_future;
+  // Where an eager poll puts the result, if it finishes the future.
+  RustFutureResult<YieldResult> m_result;
+  FuturePollStatus m_status;
+  // Created when the coroutine first suspends, so that futures that are
+  // already finished by then don't need one.
+  std::conditional_t<INLINE_WAKER, std::optional<Receiver>, Receiver*>
+      m_receiver;
+
+  RustAwaiter(const RustAwaiter&) = delete;
+  void operator=(const RustAwaiter&) = delete;
+
+  Receiver& make_receiver() {
+    if constexpr (INLINE_WAKER) {
+      return m_receiver.emplace(std::move(m_future), false);
+    } else {
+      m_receiver = new Receiver(std::move(m_future), true);
+      return *m_receiver;
+    }
+  }
+
+ public:
+  explicit RustAwaiter(Future&& future)
+      : m_future(std::move(future)),
+        m_status(FuturePollStatus::Pending),
+        m_receiver() {}
+
+  ~RustAwaiter() {
+    if (m_receiver) {
+      m_receiver->detach();
+    }
+  }
+
+  bool await_ready() noexcept {
+    // By default, don't poll here. Assume that polling is more expensive than
+    // creating the coroutine state. See `behavior::EagerPoll`.
+    if constexpr (EAGER_POLL) {
+      // A null waker tells Rust to use a waker that does nothing. If the
+      // future isn't finished yet, it'll be polled again with a real waker
+      // before we go to sleep.
+      WakeTrampoline::Mode previous = WakeTrampoline::begin_poll();
+      m_status = static_cast<FuturePollStatus>(
+          Future::vtable()->future_poll(m_future, &m_result, nullptr));
+      WakeTrampoline::end_poll(previous);
+      bool ready = m_status != FuturePollStatus::Pending;
+      EagerPollCounter::count(ready);
+      return ready;
+    } else {
+      return false;
+    }
+  }
+
+  std_coroutine::coroutine_handle<void> await_suspend(
+      std_coroutine::coroutine_handle<void> next) {
+    return make_receiver().suspend(next);
+  }
+
+  YieldResult await_resume() {
+    if (m_status != FuturePollStatus::Pending) {
+      return Receiver::take_result(m_status, m_result);
+    }
+    return m_receiver->get_result();
+  }
+};
+
+// What `when_all()` and `when_any()` produce for a future that yields `void`,
+// so that it can go in a tuple or variant.
+template <typename T>
+using CombinatorValue =
+    std::conditional_t<std::is_void_v<T>, std::monostate, T>;
+
+// One of the futures that a `when_all()` or `when_any()` is waiting on, along
+// with its result once it has one. Only the receiver that owns this touches
+// it.
+template <typename Future>
+class CombinatorSlot {
+  using YieldResult = typename Future::YieldResult;
+
+  std::optional<Future> m_future;
+  RustFutureResult<YieldResult> m_result;
+  // Goes back to `Pending` once the result has been taken or dropped; by then
+  // the receiver won't poll anymore.
+  FuturePollStatus m_status;
+
+  CombinatorSlot(const CombinatorSlot&) = delete;
+  void operator=(const CombinatorSlot&) = delete;
+
+ public:
+  CombinatorSlot() : m_future(), m_status(FuturePollStatus::Pending) {}
+
+  explicit CombinatorSlot(Future&& future)
+      : m_future(std::move(future)), m_status(FuturePollStatus::Pending) {}
+
+  void set_future(Future&& future) {
+    m_future.emplace(std::move(future));
+  }
+
+  // Polls the future if it isn't finished yet, handing Rust a new reference to
+  // the shared waker. Returns true if this poll finished it.
+  bool poll(SuspendedCoroutine* coroutine) {
+    if (m_status != FuturePollStatus::Pending || !m_future) {
+      return false;
+    }
+    m_status =
+        static_cast<FuturePollStatus>(Future::vtable()->future_poll(
+            *m_future, &m_result, coroutine->add_ref()));
+    return m_status != FuturePollStatus::Pending;
+  }
+
+  bool failed() const {
+    return m_status == FuturePollStatus::Error;
+  }
+
+  Error take_error() {
+    Error error(m_result.m_exception.c_str());
+    m_result.m_exception.~String();
+    m_status = FuturePollStatus::Pending;
+    return error;
+  }
+
+  CombinatorValue<YieldResult> take() {
+    CXXASYNC_ASSERT(m_status == FuturePollStatus::Complete);
+    m_status = FuturePollStatus::Pending;
+    if constexpr (std::is_void_v<YieldResult>) {
+      return {};
+    } else {
+      CombinatorValue<YieldResult> value(std::move(m_result.m_result));
+      m_result.m_result.~YieldResult();
+      return value;
+    }
+  }
+
+  // Destroys the result, if there is one, without looking at it.
+  void drop_result() {
+    switch (m_status) {
+      case FuturePollStatus::Complete:
+        if constexpr (!std::is_void_v<YieldResult>) {
+          m_result.m_result.~YieldResult();
+        }
+        break;
+      case FuturePollStatus::Error:
+        m_result.m_exception.~String();
+        break;
+      case FuturePollStatus::Pending:
+      case FuturePollStatus::Running:
+        break;
+    }
+    m_status = FuturePollStatus::Pending;
+  }
+
+  // Drops the Rust future. That might drop or even invoke wakers that point
+  // back at the receiver, so the caller must either not hold the receiver's
+  // lock or be polling, in which case `WakeTrampoline` queues those wakeups
+  // instead of running them right away.
+  void drop_future() {
+    m_future.reset();
+  }
+};
+
+// The slots of a combinator over a fixed list of futures of possibly different
+// types.
+template <typename... Futures>
+class CombinatorTupleSlots {
+  std::tuple<CombinatorSlot<Futures>...> m_slots;
+
+  template <size_t... Indices>
+  auto take_one(size_t index, std::index_sequence<Indices...>) {
+    std::optional<AnyResult> result;
+    ((Indices == index ? (void)result.emplace(
+                             std::in_place_index<Indices>,
+                             std::get<Indices>(m_slots).take())
+                       : (void)0),
+     ...);
+    return std::move(*result);
+  }
+
+ public:
+  // What `when_all()` produces.
+  using AllResult =
+      std::tuple<CombinatorValue<typename Futures::YieldResult>...>;
+  // What `when_any()` produces. The index of the alternative is the index of
+  // the future that finished first.
+  using AnyResult =
+      std::variant<CombinatorValue<typename Futures::YieldResult>...>;
+
+  explicit CombinatorTupleSlots(Futures&&... futures)
+      : m_slots(std::move(futures)...) {}
+
+  size_t size() const {
+    return sizeof...(Futures);
+  }
+
+  template <typename Function>
+  void for_each(Function&& function) {
+    std::apply([&](auto&... slot) { (function(slot), ...); }, m_slots);
+  }
+
+  AllResult take_all() {
+    return std::apply(
+        [](auto&... slot) { return AllResult(slot.take()...); }, m_slots);
+  }
+
+  AnyResult take_one(size_t index) {
+    return take_one(index, std::index_sequence_for<Futures...>());
+  }
+};
+
+// The slots of a combinator over a vector of futures of the same type.
+template <typename Future>
+class CombinatorRangeSlots {
+  using YieldResult = typename Future::YieldResult;
+
+  // Not a `std::vector`, because slots can't be moved.
+  std::unique_ptr<CombinatorSlot<Future>[]> m_slots;
+  size_t m_size;
+
+ public:
+  // What `when_all()` produces.
+  using AllResult = std::
+      conditional_t<std::is_void_v<YieldResult>, void, std::vector<YieldResult>>;
+  // What `when_any()` produces: the index of the future that finished first,
+  // and its result.
+  using AnyResult = std::pair<size_t, CombinatorValue<YieldResult>>;
+
+  explicit CombinatorRangeSlots(std::vector<Future>&& futures)
+      : m_slots(new CombinatorSlot<Future>[futures.size()]),
+        m_size(futures.size()) {
+    for (size_t i = 0; i < m_size; i++) {
+      m_slots[i].set_future(std::move(futures[i]));
+    }
+  }
+
+  size_t size() const {
+    return m_size;
+  }
+
+  template <typename Function>
+  void for_each(Function&& function) {
+    for (size_t i = 0; i < m_size; i++) {
+      function(m_slots[i]);
+    }
+  }
+
+  AllResult take_all() {
+    if constexpr (std::is_void_v<YieldResult>) {
+      for_each([](CombinatorSlot<Future>& slot) { slot.take(); });
+    } else {
+      std::vector<YieldResult> results;
+      results.reserve(m_size);
+      for_each([&](CombinatorSlot<Future>& slot) {
+        results.push_back(slot.take());
+      });
+      return results;
+    }
+  }
+
+  AnyResult take_one(size_t index) {
+    return AnyResult(index, m_slots[index].take());
+  }
+};
+
+// The state needed to await several Rust futures at once from C++. All the
+// futures share this one waker, and the coroutine goes to sleep once and wakes
+// up once, when the last of them finishes.
+//
+// Because the futures share a waker, a wakeup can't tell which of them is
+// ready, so it polls every one that hasn't finished yet, the same way that
+// Rust's `join!` does. This is always allocated on the heap.
+template <typename Slots>
+class WhenAllReceiver final
+    : public SuspendedCoroutineImpl<WhenAllReceiver<Slots>> {
+  friend class SuspendedCoroutineImpl<WhenAllReceiver>;
+
+  std::mutex m_lock;
+  Slots m_slots;
+  // How many futures haven't finished yet.
+  size_t m_remaining;
+
+  WhenAllReceiver(const WhenAllReceiver&) = delete;
+  void operator=(const WhenAllReceiver&) = delete;
+
+  FutureWakeStatus poll() {
+    std::lock_guard<std::mutex> guard(m_lock);
+
+    // Have all the futures already finished, or has the awaiter gone away? If
+    // so, don't poll again.
+    if (m_remaining == 0 || this->is_detached()) {
+      return FutureWakeStatus::Dead;
+    }
+
+    m_slots.for_each([&](auto& slot) {
+      if (slot.poll(this)) {
+        m_remaining--;
+      }
+    });
+    return m_remaining == 0 ? FutureWakeStatus::Complete
+                            : FutureWakeStatus::Pending;
+  }
+
+  void deallocate() {
+    delete this;
+  }
+
+ public:
+  using Result = typename Slots::AllResult;
+
+  template <typename... Args>
+  explicit WhenAllReceiver(Args&&... args)
+      : m_lock(),
+        m_slots(std::forward<Args>(args)...),
+        m_remaining(m_slots.size()) {}
+
+  bool empty() const {
+    return m_slots.size() == 0;
+  }
+
+  // Drops the Rust futures, any results that the coroutine never collected,
+  // and the awaiter's reference to this object. Called when the awaiter is
+  // destroyed.
+  void detach() {
+    this->detach_coroutine();
+    {
+      std::lock_guard<std::mutex> guard(m_lock);
+      m_slots.for_each([](auto& slot) { slot.drop_result(); });
+    }
+    // Nothing polls the futures anymore, so it's safe to drop them unlocked.
+    m_slots.for_each([](auto& slot) { slot.drop_future(); });
+    this->release();
+  }
+
+  // Returns all the results, or throws the error of the first future, in
+  // argument order, that failed.
+  Result get_result() {
+    // Safe to use without taking the lock because the caller asserts that all
+    // the futures have already finished.
+    std::optional<Error> error;
+    m_slots.for_each([&](auto& slot) {
+      if (!error && slot.failed()) {
+        error.emplace(slot.take_error());
+      }
+    });
+    if (error) {
+      m_slots.for_each([](auto& slot) { slot.drop_result(); });
+      throw std::move(*error);
+    }
+    return m_slots.take_all();
+  }
+};
+
+// The state needed to race several Rust futures from C++. Like
+// `WhenAllReceiver`, the futures share one waker, but the coroutine wakes up
+// as soon as any of them finishes, and the rest are dropped on the spot.
+//
+// A wakeup polls the unfinished futures in argument order and stops at the
+// first one that's done, so when several are ready at once, the earliest
+// wins.
+template <typename Slots>
+class WhenAnyReceiver final
+    : public SuspendedCoroutineImpl<WhenAnyReceiver<Slots>> {
+  friend class SuspendedCoroutineImpl<WhenAnyReceiver>;
+
+  static constexpr size_t NO_WINNER = SIZE_MAX;
+
+  std::mutex m_lock;
+  Slots m_slots;
+  // The index of the future that finished first, if any has.
+  size_t m_winner;
+
+  WhenAnyReceiver(const WhenAnyReceiver&) = delete;
+  void operator=(const WhenAnyReceiver&) = delete;
+
+  FutureWakeStatus poll() {
+    std::lock_guard<std::mutex> guard(m_lock);
+
+    // Has a future already finished, or has the awaiter gone away? If so,
+    // don't poll again.
+    if (m_winner != NO_WINNER || this->is_detached()) {
+      return FutureWakeStatus::Dead;
+    }
+
+    size_t index = 0;
+    m_slots.for_each([&](auto& slot) {
+      if (m_winner == NO_WINNER && slot.poll(this)) {
+        m_winner = index;
+      }
+      index++;
+    });
+    if (m_winner == NO_WINNER) {
+      return FutureWakeStatus::Pending;
+    }
+
+    // Reclaim the losers now rather than when the awaiter goes away, so that
+    // whatever they hold is released before the coroutine even resumes.
+    index = 0;
+    m_slots.for_each([&](auto& slot) {
+      if (index++ != m_winner) {
+        slot.drop_future();
+      }
+    });
+    return FutureWakeStatus::Complete;
+  }
+
+  void deallocate() {
+    delete this;
+  }
+
+ public:
+  using Result = typename Slots::AnyResult;
+
+  template <typename... Args>
+  explicit WhenAnyReceiver(Args&&... args)
+      : m_lock(), m_slots(std::forward<Args>(args)...), m_winner(NO_WINNER) {}
+
+  bool empty() const {
+    return false;
+  }
+
+  // Drops the Rust futures, the result if the coroutine never collected it,
+  // and the awaiter's reference to this object. Called when the awaiter is
+  // destroyed.
+  void detach() {
+    this->detach_coroutine();
+    {
+      std::lock_guard<std::mutex> guard(m_lock);
+      m_slots.for_each([](auto& slot) { slot.drop_result(); });
+    }
+    // Nothing polls the futures anymore, so it's safe to drop them unlocked.
+    m_slots.for_each([](auto& slot) { slot.drop_future(); });
+    this->release();
+  }
+
+  // Returns the result of the future that finished first, or throws its
+  // error.
+  Result get_result() {
+    // Safe to use without taking the lock because the caller asserts that a
+    // future has already finished.
+    std::optional<Error> error;
+    size_t index = 0;
+    m_slots.for_each([&](auto& slot) {
+      if (index++ == m_winner && slot.failed()) {
+        error.emplace(slot.take_error());
+      }
+    });
+    if (error) {
+      throw std::move(*error);
+    }
+    return m_slots.take_one(m_winner);
+  }
+};
+
+// The awaitable returned by `when_all()` and `when_any()`.
+template <typename Receiver>
+class CombinatorAwaiter {
+  Receiver* m_receiver;
+
+  CombinatorAwaiter(const CombinatorAwaiter&) = delete;
+  void operator=(const CombinatorAwaiter&) = delete;
+
+ public:
+  template <typename... Args>
+  explicit CombinatorAwaiter(Args&&... args)
+      : m_receiver(new Receiver(std::forward<Args>(args)...)) {}
+
+  CombinatorAwaiter(CombinatorAwaiter&& other) noexcept
+      : m_receiver(std::exchange(other.m_receiver, nullptr)) {}
+
+  ~CombinatorAwaiter() {
+    if (m_receiver != nullptr) {
+      m_receiver->detach();
+    }
+  }
+
+  bool await_ready() noexcept {
+    return m_receiver->empty();
+  }
+
+  std_coroutine::coroutine_handle<void> await_suspend(
+      std_coroutine::coroutine_handle<void> next) {
+    return m_receiver->suspend(next);
+  }
+
+  typename Receiver::Result await_resume() {
+    return m_receiver->get_result();
+  }
+};
+
+template <typename... Futures>
+using WhenAllAwaiter =
+    CombinatorAwaiter<WhenAllReceiver<CombinatorTupleSlots<Futures...>>>;
+template <typename Future>
+using WhenAllRangeAwaiter =
+    CombinatorAwaiter<WhenAllReceiver<CombinatorRangeSlots<Future>>>;
+template <typename... Futures>
+using WhenAnyAwaiter =
+    CombinatorAwaiter<WhenAnyReceiver<CombinatorTupleSlots<Futures...>>>;
+template <typename Future>
+using WhenAnyRangeAwaiter =
+    CombinatorAwaiter<WhenAnyReceiver<CombinatorRangeSlots<Future>>>;
+
+// Awaits all of the given Rust futures at once, and produces a tuple of their
+// results, with `std::monostate` standing in for `void`. This suspends the
+// calling coroutine at most once, no matter how many futures there are. If any
+// of the futures fail, this waits for the rest anyway and then throws the
+// first error in argument order.
+//
+//      auto [a, b] = co_await rust::async::when_all(rust_a(), rust_b());
+template <typename... Futures>
+WhenAllAwaiter<Futures...> when_all(Futures&&... futures) {
+  static_assert(
+      (std::is_same_v<
+           typename Futures::YieldResult,
+           typename Futures::FinalResult> &&
+       ...),
+      "Rust streams can't be passed to `when_all()`");
+  return WhenAllAwaiter<Futures...>(std::move(futures)...);
+}
+
+// Like the above, but for any number of futures of the same type. This
+// produces a vector of the results in the same order, or nothing if the
+// futures yield `void`.
+template <typename Future>
+WhenAllRangeAwaiter<Future> when_all(std::vector<Future>&& futures) {
+  static_assert(
+      std::is_same_v<typename Future::YieldResult, typename Future::FinalResult>,
+      "Rust streams can't be passed to `when_all()`");
+  return WhenAllRangeAwaiter<Future>(std::move(futures));
+}
+
+// Races the given Rust futures, and produces a variant holding the result of
+// the one that finished first, with `std::monostate` standing in for `void`.
+// The variant's `index()` says which future that was. If it failed, this
+// throws its error instead. The other futures are dropped as soon as the
+// winner is known, without waiting for the calling coroutine to resume.
+//
+// Only Rust futures can be raced, not Rust streams or the awaitables that
+// their `next()` returns. Passing those fails to compile.
+//
+//      auto result = co_await rust::async::when_any(rust_a(), rust_timeout());
+//      if (result.index() == 1) { /* timed out */ }
+template <typename... Futures>
+WhenAnyAwaiter<Futures...> when_any(Futures&&... futures) {
+  static_assert(sizeof...(Futures) > 0, "`when_any()` needs a future to race");
+  static_assert(
+      (std::is_same_v<
+           typename Futures::YieldResult,
+           typename Futures::FinalResult> &&
+       ...),
+      "Rust streams can't be passed to `when_any()`");
+  return WhenAnyAwaiter<Futures...>(std::move(futures)...);
+}
+
+// Like the above, but for any number of futures of the same type. This
+// produces the index of the future that finished first along with its result.
+// Throws `std::invalid_argument` if there are no futures, since then nothing
+// could ever win.
+template <typename Future>
+WhenAnyRangeAwaiter<Future> when_any(std::vector<Future>&& futures) {
+  static_assert(
+      std::is_same_v<typename Future::YieldResult, typename Future::FinalResult>,
+      "Rust streams can't be passed to `when_any()`");
+  if (futures.empty()) {
+    throw std::invalid_argument("`when_any()` needs a future to race");
+  }
+  return WhenAnyRangeAwaiter<Future>(std::move(futures));
+}
+
+// The state needed to await the next item of a Rust stream from C++. This is
+// like `RustFutureReceiver`, except that it only borrows the stream.
+//
+// There's one of these per stream, on the heap, because the stream may hold
+// onto our waker arbitrarily long. The stream owns it, and every `next()`
+// call reuses it, so Rust sees the same waker every time and
+// `Waker::will_wake()` saves it from cloning a new one.
+template <typename Future>
+class RustStreamReceiver final
+    : public SuspendedCoroutineImpl<RustStreamReceiver<Future>> {
+  friend class SuspendedCoroutineImpl<RustStreamReceiver>;
+
+  using YieldResult = typename Future::YieldResult;
+
+  std::mutex m_lock;
+  // The stream that the current `next()` call is waiting on, or null between
+  // calls.
+  Future* m_stream;
+  RustFutureResult<YieldResult> m_result;
+  FuturePollStatus m_status;
+
+  RustStreamReceiver(const RustStreamReceiver&) = delete;
+  void operator=(const RustStreamReceiver&) = delete;
+
+  FutureWakeStatus poll();
+
+  void deallocate() {
+    delete this;
+  }
+
+  // Destroys an item that the coroutine will never pick up. Must be called
+  // with the lock held.
+  void drop_unclaimed_result() {
+    switch (m_status) {
+      case FuturePollStatus::Running:
+        m_result.m_result.~YieldResult();
+        break;
+      case FuturePollStatus::Error:
+        m_result.m_exception.~String();
+        break;
+      case FuturePollStatus::Pending:
+      case FuturePollStatus::Complete:
+        break;
+    }
+  }
+
+ public:
+  // The reference that this starts out with belongs to the stream.
+  explicit RustStreamReceiver(Future& stream)
+      : m_lock(), m_stream(nullptr), m_status(FuturePollStatus::Pending) {
+    this->set_trace_id(stream.trace_id());
+    this->detach_coroutine();
+  }
+
+  // Starts answering a `next()` call on `stream`. Called when an awaiter is
+  // created.
+  void attach(Future& stream) {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_stream = &stream;
+    m_status = FuturePollStatus::Pending;
+    this->reattach_coroutine();
+  }
+
+  // Polls once with a waker that does nothing. Returns true if that answered
+  // the `next()` call, in which case there's no need to suspend.
+  bool poll_now() {
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_status = static_cast<FuturePollStatus>(
+        Future::vtable()->future_poll(*m_stream, &m_result, nullptr));
+    return m_status != FuturePollStatus::Pending;
+  }
+
+  // Severs the link to the stream until the next `next()` call. Called when
+  // the awaiter is destroyed. The stream keeps its reference to this object.
+  void detach() {
+    bool was_suspended = this->detach_coroutine();
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_stream = nullptr;
+    if (was_suspended) {
+      drop_unclaimed_result();
+    }
+  }
+
+  std::optional<YieldResult> get_result() {
+    // Safe to use without taking the lock because the caller asserts that the
+    // poll has already completed.
+    switch (m_status) {
+      case FuturePollStatus::Running: {
+        std::optional<YieldResult> result(std::move(m_result.m_result));
+        m_result.m_result.~YieldResult();
+        return result;
+      }
+      case FuturePollStatus::Complete:
+        return std::nullopt;
+      case FuturePollStatus::Error: {
+        Error error(m_result.m_exception.c_str());
+        m_result.m_exception.~String();
+        throw std::move(error);
+      }
+      case FuturePollStatus::Pending:
+        CXXASYNC_ASSERT(false);
+        std::terminate();
+    }
+  }
+};
+
+// The awaitable returned by `RustFuture::next()`.
+template <typename Future>
+class RustStreamNextAwaiter {
+  using YieldResult = typename Future::YieldResult;
+  using Receiver = RustStreamReceiver<Future>;
+
+  Receiver* m_receiver;
+
+  RustStreamNextAwaiter(const RustStreamNextAwaiter&) = delete;
+  void operator=(const RustStreamNextAwaiter&) = delete;
+
+ public:
+  explicit RustStreamNextAwaiter(Future& stream)
+      : m_receiver(&stream.next_receiver()) {
+    m_receiver->attach(stream);
+  }
+
+  ~RustStreamNextAwaiter() {
+    m_receiver->detach();
+  }
+
+  bool await_ready() noexcept {
+    // Items that the stream has already buffered come back without suspending.
+    WakeTrampoline::Mode previous = WakeTrampoline::begin_poll();
+    bool ready = m_receiver->poll_now();
+    WakeTrampoline::end_poll(previous);
+    return ready;
+  }
+
+  std_coroutine::coroutine_handle<void> await_suspend(
+      std_coroutine::coroutine_handle<void> next) {
+    return m_receiver->suspend(next);
+  }
+
+  std::optional<YieldResult> await_resume() {
+    return m_receiver->get_result();
+  }
+};
+
+// A run of stream items laid out contiguously, for sending to Rust in one go.
+//
+// This must match the layout of `CxxAsyncBatch` in `lib.rs`.
+struct RustStreamBatchData {
+  const void* items;
+  size_t len;
+};
+
+// A chunk of items that a coroutine returning a Rust stream yields all at
+// once. See `batch()`.
+template <typename T>
+class RustStreamBatch {
+  std::vector<T> m_items;
+
+ public:
+  explicit RustStreamBatch(std::vector<T>&& items)
+      : m_items(std::move(items)) {}
+
+  std::vector<T>& items() noexcept {
+    return m_items;
+  }
+};
+
+// `co_yield rust::async::batch(std::move(items))` inside a coroutine that
+// returns a Rust stream to hand all of `items` to Rust with a single call
+// across the language boundary, instead of one per item. Rust still sees the
+// items one at a time, in order.
+//
+// A batch goes into the stream's buffer whole as soon as there's room for at
+// least one item, even if that overfills the buffer, so that it never has to
+// be split up.
+template <typename T>
+RustStreamBatch<T> batch(std::vector<T>&& items) {
+  return RustStreamBatch<T>(std::move(items));
+}
+
+// How `RustStreamAwaiter` hands a single item over to Rust.
+template <typename Future>
+class RustStreamItemPayload {
+  using YieldResult = typename Future::YieldResult;
+
+  YieldResult&& m_value;
+
+ public:
+  explicit RustStreamItemPayload(YieldResult&& value)
+      : m_value(std::move(value)) {}
+
+  bool empty() const noexcept {
+    return false;
+  }
+
+  // Sends the item, or leaves it alone if there's no room, in which case Rust
+  // wakes `coroutine` once there is. `coroutine` may be null to try without
+  // waiting.
+  RustSendResult send(
+      RustSender<Future>& sender,
+      SuspendedCoroutine* coroutine) noexcept {
+    RustFutureResult<YieldResult> result;
+    new (&result.m_result) YieldResult(std::move(m_value));
+    RustSendResult send_result =
+        static_cast<RustSendResult>(Future::vtable()->sender_send(
+            sender,
+            static_cast<uint32_t>(FuturePollStatus::Running),
+            reinterpret_cast<const uint8_t*>(&result),
+            coroutine != nullptr ? coroutine->add_ref() : nullptr));
+    if (send_result == RustSendResult::Wait) {
+      m_value = std::move(result.m_result);
+    }
+    return send_result;
+  }
+};
+
+// How `RustStreamAwaiter` hands a batch of items over to Rust.
+template <typename Future>
+class RustStreamBatchPayload {
+  using YieldResult = typename Future::YieldResult;
+
+  // The items, moved out of the batch into raw storage so that the storage can
+  // be freed without destroying them once Rust has taken them over. Null once
+  // that has happened.
+  YieldResult* m_items;
+  size_t m_len;
+
+  RustStreamBatchPayload(const RustStreamBatchPayload&) = delete;
+  void operator=(const RustStreamBatchPayload&) = delete;
+
+ public:
+  explicit RustStreamBatchPayload(RustStreamBatch<YieldResult>&& batch) {
+    std::vector<YieldResult>& items = batch.items();
+    m_len = items.size();
+    m_items = std::allocator<YieldResult>().allocate(m_len);
+    std::uninitialized_move(items.begin(), items.end(), m_items);
+  }
+
+  ~RustStreamBatchPayload() {
+    if (m_items != nullptr) {
+      std::destroy_n(m_items, m_len);
+      std::allocator<YieldResult>().deallocate(m_items, m_len);
+    }
+  }
+
+  bool empty() const noexcept {
+    return m_len == 0;
+  }
+
+  // Like `RustStreamItemPayload::send()`, but all or nothing.
+  RustSendResult send(
+      RustSender<Future>& sender,
+      SuspendedCoroutine* coroutine) noexcept {
+    RustStreamBatchData data{m_items, m_len};
+    RustSendResult send_result =
+        static_cast<RustSendResult>(Future::vtable()->sender_send(
+            sender,
+            FUTURE_STATUS_RUNNING_BATCH,
+            &data,
+            coroutine != nullptr ? coroutine->add_ref() : nullptr));
+    if (send_result == RustSendResult::Sent) {
+      // Rust owns the items now.
+      std::allocator<YieldResult>().deallocate(m_items, m_len);
+      m_items = nullptr;
+    }
+    return send_result;
+  }
+};
+
+// The awaitable returned by `co_yield` in a coroutine that returns a Rust
+// stream. `Payload` is what's being yielded: a single item or a batch.
+template <typename Future, typename Payload = RustStreamItemPayload<Future>>
+class RustStreamAwaiter {
+  using YieldResult = typename Future::YieldResult;
+
+  // The waker for a coroutine blocked on a full stream channel. This points
+  // back to the awaiter until the awaiter goes away.
+  class Suspended final : public SuspendedCoroutineImpl<Suspended> {
+    friend class SuspendedCoroutineImpl<Suspended>;
+
+    std::mutex m_lock;
+    // Null once the value has been sent or the awaiter has gone away.
+    RustStreamAwaiter* m_awaiter;
+
+    FutureWakeStatus poll() {
+      std::lock_guard<std::mutex> guard(m_lock);
+      if (m_awaiter == nullptr) {
+        return FutureWakeStatus::Dead;
+      }
+      FutureWakeStatus status = m_awaiter->poll_next(this);
+      if (wake_status_is_done(status)) {
+        m_awaiter = nullptr;
+      }
+      return status;
+    }
+
+    void deallocate() {
+      delete this;
+    }
+
+   public:
+    explicit Suspended(RustStreamAwaiter* awaiter)
+        : m_lock(), m_awaiter(awaiter) {
+      this->set_trace_id(awaiter->m_sender.trace_id());
+    }
+
+    // Severs the link to the awaiter, waiting for any send that's in progress
+    // on another thread to finish. Called when the awaiter is destroyed.
+    void detach() {
+      this->detach_coroutine();
+      {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_awaiter = nullptr;
+      }
+      this->release();
+    }
+  };
+
+  RustSender<Future>& m_sender;
+  Payload m_payload;
+  Suspended* m_suspended;
+
+  FutureWakeStatus poll_next(SuspendedCoroutine* coroutine) noexcept;
+
+  RustStreamAwaiter(const RustStreamAwaiter&) = delete;
+  void operator=(const RustStreamAwaiter&) = delete;
+
+ public:
+  template <typename Value>
+  RustStreamAwaiter(RustSender<Future>& sender, Value&& value)
+      : m_sender(sender),
+        m_payload(std::forward<Value>(value)),
+        m_suspended(nullptr) {}
+
+  ~RustStreamAwaiter() {
+    if (m_suspended != nullptr) {
+      m_suspended->detach();
+    }
+  }
+
+  bool await_ready() noexcept {
+    // An empty batch has nothing to send.
+    if (m_payload.empty()) {
+      return true;
+    }
+
+    // Try to send right away, without a waker. As long as the consumer keeps
+    // up, this is all `co_yield` costs; the waker and the trip through
+    // `initial_suspend()` are only needed if the buffer is full.
+    WakeTrampoline::Mode previous = WakeTrampoline::begin_poll();
+    RustSendResult send_result = m_payload.send(m_sender, nullptr);
+    WakeTrampoline::end_poll(previous);
+    return send_result != RustSendResult::Wait;
+  }
+  std_coroutine::coroutine_handle<void> await_suspend(
+      std_coroutine::coroutine_handle<void> next) {
+    m_suspended = new Suspended(this);
+    return m_suspended->suspend(next);
+  }
+  void await_resume() {}
+};
+
+// Promise object that manages the channel that is returned to Rust when Rust
+// calls a C++ coroutine.
+template <typename Future>
+class RustPromiseBase {
+  using Channel = RustChannel<Future>;
+
+  RustPromiseBase(const RustPromiseBase&) = delete;
+  RustPromiseBase& operator=(const RustPromiseBase&) = delete;
+
+ protected:
+  // This must precede `m_execlet`.
+  Channel m_channel;
+
+ private:
+  Execlet m_execlet;
+
+ public:
+  RustPromiseBase()
+      : m_channel(Future::vtable()->channel()), m_execlet(m_channel.execlet) {}
 
   Future get_return_object() noexcept {
     return std::move(m_channel.future);
@@ -764,6 +2527,23 @@ class RustPromiseBase {
     return m_execlet;
   }
 
+  // Allocates the coroutine frame. See `behavior::PooledFrames`.
+  static void* operator new(size_t size) {
+    if constexpr (behavior::PooledFrames<Future, behavior::Custom>::value) {
+      return FramePool::allocate(size);
+    } else {
+      return ::operator new(size);
+    }
+  }
+
+  static void operator delete(void* ptr, size_t size) noexcept {
+    if constexpr (behavior::PooledFrames<Future, behavior::Custom>::value) {
+      FramePool::deallocate(ptr, size);
+    } else {
+      ::operator delete(ptr);
+    }
+  }
+
   // Customization point for library integration (e.g. Folly).
   template <
       typename Awaiter,
@@ -796,7 +2576,13 @@ class RustStreamPromiseBase<Future, false> : public RustPromiseBase<Future> {
  public:
   RustStreamAwaiter<Future> yield_value(
       typename Future::YieldResult&& value) noexcept {
-    return RustStreamAwaiter(this->m_channel.sender, std::move(value));
+    return RustStreamAwaiter<Future>(this->m_channel.sender, std::move(value));
+  }
+
+  RustStreamAwaiter<Future, RustStreamBatchPayload<Future>> yield_value(
+      RustStreamBatch<YieldResult>&& batch) {
+    return RustStreamAwaiter<Future, RustStreamBatchPayload<Future>>(
+        this->m_channel.sender, std::move(batch));
   }
 };
 
@@ -845,70 +2631,72 @@ class RustPromise<Future, YieldResultIsVoid, true> final
   }
 };
 
-// Consumes the `coroutine` reference (so you probably want to addref it first).
 template <typename Future>
-FutureWakeStatus RustFutureReceiver<Future>::wake(
-    SuspendedCoroutine* coroutine) {
+FutureWakeStatus RustFutureReceiver<Future>::poll() {
   std::lock_guard<std::mutex> guard(m_lock);
 
-  // Have we already polled this future to completion? If so, don't poll again.
-  if (m_status != FuturePollStatus::Pending) {
-    coroutine->release();
+  // Have we already polled this future to completion, or has the awaiter gone
+  // away? If so, don't poll again.
+  if (m_status != FuturePollStatus::Pending || !m_future) {
     return FutureWakeStatus::Dead;
   }
 
-  m_status = static_cast<FuturePollStatus>(
-      Future::vtable()->future_poll(m_future, &m_result, coroutine));
+  // If Rust woke us during the poll, and we live inside the awaiter, poll
+  // again right away. See `wake_from_rust()`.
+  do {
+    m_woken_during_poll.store(false);
+    m_status = static_cast<FuturePollStatus>(
+        Future::vtable()->future_poll(*m_future, &m_result, this->add_ref()));
+  } while (m_status == FuturePollStatus::Pending &&
+           m_woken_during_poll.load());
   return static_cast<FutureWakeStatus>(m_status);
 }
 
-template <typename Future>
-inline bool RustAwaiter<Future>::await_suspend(
-    std_coroutine::coroutine_handle<void> next) {
-  std::weak_ptr<RustFutureReceiver<Future>> weak_receiver = m_receiver;
-  SuspendedCoroutine* coroutine = new SuspendedCoroutine(
-      std::make_unique<CoroutineHandleContinuation>(std::move(next)),
-      [weak_receiver =
-           std::move(weak_receiver)](SuspendedCoroutine* coroutine) {
-        std::shared_ptr<RustFutureReceiver<Future>> receiver =
-            weak_receiver.lock();
-        // This rarely ever happens in practice, but I think it can.
-        if (!receiver) {
-          return FutureWakeStatus::Dead;
-        }
-        return receiver->wake(coroutine->add_ref());
-      });
-  return coroutine->initial_suspend();
+template <typename Derived>
+RustStreamReceiver<Derived>& RustStream<Derived>::next_receiver() {
+  if (m_next_receiver == nullptr) {
+    m_next_receiver =
+        new RustStreamReceiver<Derived>(*static_cast<Derived*>(this));
+  }
+  return *static_cast<RustStreamReceiver<Derived>*>(m_next_receiver);
 }
 
 template <typename Future>
-inline bool RustStreamAwaiter<Future>::await_suspend(
-    std_coroutine::coroutine_handle<void> next) {
-  SuspendedCoroutine* coroutine = new SuspendedCoroutine(
-      std::make_unique<CoroutineHandleContinuation>(std::move(next)),
-      [=](SuspendedCoroutine* coroutine) {
-        return this->poll_next(coroutine);
-      });
-  return coroutine->initial_suspend();
+FutureWakeStatus RustStreamReceiver<Future>::poll() {
+  std::lock_guard<std::mutex> guard(m_lock);
+
+  // Have we already received an item, or has the awaiter gone away? If so,
+  // don't poll again. Nor if the awaiter hasn't started to suspend yet, which
+  // means that this is a waker left over from an earlier `next()` call; the
+  // awaiter polls for itself when it suspends.
+  if (m_status != FuturePollStatus::Pending || m_stream == nullptr ||
+      !this->is_waiting()) {
+    return FutureWakeStatus::Dead;
+  }
+
+  m_status = static_cast<FuturePollStatus>(
+      Future::vtable()->future_poll(*m_stream, &m_result, this->add_ref()));
+  switch (m_status) {
+    case FuturePollStatus::Pending:
+      return FutureWakeStatus::Pending;
+    case FuturePollStatus::Running:
+    case FuturePollStatus::Complete:
+      // Either way, the `next()` call has its answer.
+      return FutureWakeStatus::Complete;
+    case FuturePollStatus::Error:
+      return FutureWakeStatus::Error;
+  }
+  CXXASYNC_ASSERT(false);
+  std::terminate();
 }
 
-template <typename Future>
-inline FutureWakeStatus RustStreamAwaiter<Future>::poll_next(
+template <typename Future, typename Payload>
+inline FutureWakeStatus RustStreamAwaiter<Future, Payload>::poll_next(
     SuspendedCoroutine* coroutine) noexcept {
-  RustFutureResult<YieldResult> result;
-  new (&result.m_result) YieldResult(std::move(m_value));
-  RustSendResult send_result =
-      static_cast<RustSendResult>(Future::vtable()->sender_send(
-          this->m_sender,
-          static_cast<uint32_t>(FuturePollStatus::Running),
-          reinterpret_cast<const uint8_t*>(&result),
-          coroutine->add_ref()));
-
-  switch (send_result) {
+  switch (m_payload.send(m_sender, coroutine)) {
     case RustSendResult::Sent:
       return FutureWakeStatus::Complete;
     case RustSendResult::Wait:
-      m_value = std::move(result.m_result);
       return FutureWakeStatus::Pending;
     case RustSendResult::Finished:
       // Should never get here.
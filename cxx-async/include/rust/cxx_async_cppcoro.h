@@ -12,6 +12,98 @@
 #ifndef RUST_CXX_ASYNC_CPPCORO_H
 #define RUST_CXX_ASYNC_CPPCORO_H
 
-// This file intentionally left blank.
+#include <cppcoro/cancellation_source.hpp>
+#include <cppcoro/cancellation_token.hpp>
+#include <cppcoro/sync_wait.hpp>
+#include <atomic>
+#include <cstdint>
+#include <utility>
+#include "rust/cxx_async.h"
+
+namespace rust {
+namespace async {
+
+// Callbacks that Rust uses when the future is dropped or goes away.
+extern "C" {
+inline void cxxasync_cppcoro_cancel(ExecletCanceller* canceller);
+inline void cxxasync_cppcoro_drop_canceller(ExecletCanceller* canceller);
+}
+
+// cppcoro-specific interface to execlets. cppcoro never needs to run anything
+// on an execlet, so all this does is own the coroutine's cancellation source.
+//
+// The execlet and Rust each hold a reference to this.
+class CppcoroExeclet final : public Execlet::Adapter, public ExecletCanceller {
+  std::atomic<uintptr_t> m_refcount;
+  cppcoro::cancellation_source m_cancellation_source;
+
+  CppcoroExeclet(const CppcoroExeclet&) = delete;
+  CppcoroExeclet& operator=(const CppcoroExeclet&) = delete;
+
+  friend void cxxasync_cppcoro_cancel(ExecletCanceller* canceller);
+
+ public:
+  explicit CppcoroExeclet(Execlet& rust_execlet)
+      : ExecletCanceller{
+            cxxasync_cppcoro_cancel,
+            cxxasync_cppcoro_drop_canceller},
+        m_refcount(2),
+        m_cancellation_source() {
+    rust_execlet.set_canceller(this);
+  }
+
+  // Returns a token that's cancelled if Rust drops the coroutine's future
+  // before the coroutine finishes.
+  cppcoro::cancellation_token cancellation_token() const noexcept {
+    return m_cancellation_source.token();
+  }
+
+  void release() noexcept override {
+    uintptr_t last_refcount = m_refcount.fetch_sub(1);
+    CXXASYNC_ASSERT(last_refcount > 0);
+    if (last_refcount == 1) {
+      delete this;
+    }
+  }
+};
+
+extern "C" inline void cxxasync_cppcoro_cancel(ExecletCanceller* canceller) {
+  static_cast<CppcoroExeclet*>(canceller)
+      ->m_cancellation_source.request_cancellation();
+}
+
+extern "C" inline void cxxasync_cppcoro_drop_canceller(
+    ExecletCanceller* canceller) {
+  static_cast<CppcoroExeclet*>(canceller)->release();
+}
+
+// Answers `co_await rust::async::cancellation_token()`.
+//
+// cppcoro has no notion of a current cancellation token, so unlike the Folly
+// backend, this can't pass the token along on its own; hand it to the
+// operations that should be cancelled.
+template <typename Future>
+class AwaitTransformer<CancellationTokenRequest, Future> {
+  AwaitTransformer() = delete;
+
+ public:
+  static auto await_transform(
+      RustPromiseBase<Future>& promise,
+      CancellationTokenRequest&&) noexcept {
+    return ReadyAwaiter<cppcoro::cancellation_token>(
+        promise.execlet().template adapter<CppcoroExeclet>().cancellation_token());
+  }
+};
+
+// Like `cppcoro::sync_wait()`, but first checks that blocking here can't
+// deadlock. See `WakeTrampoline::begin_blocking()`.
+template <typename Awaitable>
+decltype(auto) sync_wait(Awaitable&& awaitable) {
+  WakeTrampoline::BlockingScope blocking;
+  return cppcoro::sync_wait(std::forward<Awaitable>(awaitable));
+}
+
+} // namespace async
+} // namespace rust
 
 #endif // RUST_CXX_ASYNC_CPPCORO_H
@@ -12,51 +12,135 @@
 #ifndef RUST_CXX_ASYNC_FOLLY_H
 #define RUST_CXX_ASYNC_FOLLY_H
 
+#include <folly/CancellationToken.h>
 #include <folly/Executor.h>
 #include <folly/Try.h>
 #include <folly/executors/ManualExecutor.h>
+#include <folly/experimental/coro/BlockingWait.h>
 #include <folly/experimental/coro/Task.h>
 #include <folly/experimental/coro/ViaIfAsync.h>
+#include <folly/experimental/coro/WithCancellation.h>
 #include <atomic>
 #include <mutex>
 #include <queue>
 #include <type_traits>
+#include <utility>
 #include "rust/cxx_async.h"
 
 namespace rust {
 namespace async {
 
-// Callback that Rust uses to start a C++ task.
-extern "C" inline void execlet_run_task(void* task_ptr) {
-  folly::Function<void()>* task =
-      reinterpret_cast<folly::Function<void()>*>(task_ptr);
-  (*task)();
-  delete task;
+// Callbacks that Rust uses to start the C++ tasks below.
+extern "C" {
+inline void cxxasync_folly_run_task(ExecletTask* task);
+inline void cxxasync_folly_run_inline_task(ExecletTask* task);
+}
+
+// Callbacks that Rust uses when the future is dropped or goes away.
+extern "C" {
+inline void cxxasync_folly_cancel(ExecletCanceller* canceller);
+inline void cxxasync_folly_drop_canceller(ExecletCanceller* canceller);
+}
+
+// A Folly continuation queued on an execlet.
+struct FollyExecletTask final : public ExecletTask {
+  folly::Func m_func;
+
+  explicit FollyExecletTask(folly::Func&& func)
+      : ExecletTask{nullptr, cxxasync_folly_run_task, 0},
+        m_func(std::move(func)) {}
+};
+
+extern "C" inline void cxxasync_folly_run_task(ExecletTask* task) {
+  FollyExecletTask* folly_task = static_cast<FollyExecletTask*>(task);
+  folly_task->m_func();
+  delete folly_task;
 }
 
 // Folly-specific interface to execlets.
-class FollyExeclet : public folly::Executor {
+//
+// There's one of these per coroutine, shared by all the Folly operations that
+// the coroutine awaits. The execlet holds a keep-alive reference to it, and so
+// does Folly for as long as it has work scheduled on it.
+//
+// This also owns the coroutine's cancellation source, which Rust holds another
+// reference to so that it can request cancellation if it drops the future.
+class FollyExeclet final : public folly::Executor,
+                           public Execlet::Adapter,
+                           public ExecletCanceller {
+  // Storage for one queued continuation inside the executor itself.
+  //
+  // A coroutine almost always waits on one Folly operation at a time, so there
+  // is almost always at most one continuation in flight, and it can live here
+  // instead of in a fresh `FollyExecletTask`.
+  struct InlineTask final : public ExecletTask {
+    FollyExeclet* m_executor;
+    folly::Func m_func;
+    // True while this slot holds a continuation.
+    std::atomic<bool> m_busy;
+
+    explicit InlineTask(FollyExeclet* executor)
+        : ExecletTask{nullptr, cxxasync_folly_run_inline_task, 0},
+          m_executor(executor),
+          m_func(),
+          m_busy(false) {}
+  };
+
+  friend void cxxasync_folly_run_inline_task(ExecletTask* task);
+
   Execlet& m_rust_execlet;
 
-  // NB: This starts out at *zero*, not at one. Folly is weird in that it
-  // expects the object to be destroyed once `keepAliveRelease()` is called a
-  // number of times greater than zero and equal to the number of times
-  // `keepAliveAcquire()` was called.
+  // This starts out at two: one for the reference that the execlet holds,
+  // which `release()` gives up, and one for the reference that Rust holds as a
+  // canceller. Folly then expects the object to be destroyed once
+  // `keepAliveRelease()` has been called as many times as `keepAliveAcquire()`.
   std::atomic<uintptr_t> m_refcount;
 
+  InlineTask m_inline_task;
+
+  folly::CancellationSource m_cancellation_source;
+
   FollyExeclet(const FollyExeclet&) = delete;
   FollyExeclet& operator=(const FollyExeclet&) = delete;
 
+  friend void cxxasync_folly_cancel(ExecletCanceller* canceller);
+
  public:
-  FollyExeclet(Execlet& rust_execlet) : m_rust_execlet(rust_execlet) {}
+  explicit FollyExeclet(Execlet& rust_execlet)
+      : ExecletCanceller{cxxasync_folly_cancel, cxxasync_folly_drop_canceller},
+        m_rust_execlet(rust_execlet),
+        m_refcount(2),
+        m_inline_task(this),
+        m_cancellation_source() {
+    rust_execlet.set_canceller(this);
+  }
 
   Execlet& rust_execlet() {
     return m_rust_execlet;
   }
 
-  // Submits a task to the execlet.
+  // Returns a token that's cancelled if Rust drops the coroutine's future
+  // before the coroutine finishes.
+  folly::CancellationToken cancellation_token() const noexcept {
+    return m_cancellation_source.getToken();
+  }
+
+  // Submits a task to the execlet. This only allocates if a previous task is
+  // still occupying the inline slot.
   virtual void add(folly::Func task) {
-    m_rust_execlet.submit(new folly::Func(std::move(task)), execlet_run_task);
+    bool busy = false;
+    if (m_inline_task.m_busy.compare_exchange_strong(busy, true)) {
+      // The inline task lives inside us, so keep ourselves alive until it runs.
+      keepAliveAcquire();
+      m_inline_task.m_func = std::move(task);
+      m_rust_execlet.submit(&m_inline_task);
+      return;
+    }
+    m_rust_execlet.submit(new FollyExecletTask(std::move(task)));
+  }
+
+  void release() noexcept override {
+    keepAliveRelease();
   }
 
   virtual bool keepAliveAcquire() noexcept {
@@ -75,7 +159,33 @@ class FollyExeclet : public folly::Executor {
   }
 };
 
-// Allows Folly semi-awaitables (including Folly tasks) to be awaited.
+extern "C" inline void cxxasync_folly_run_inline_task(ExecletTask* task) {
+  FollyExeclet::InlineTask* inline_task =
+      static_cast<FollyExeclet::InlineTask*>(task);
+  FollyExeclet* executor = inline_task->m_executor;
+  {
+    // Free up the slot before running the continuation, because the
+    // continuation will typically queue up the next one.
+    folly::Func func(std::move(inline_task->m_func));
+    inline_task->m_busy.store(false);
+    func();
+  }
+  // Drop the reference that `add()` took on our behalf.
+  executor->keepAliveRelease();
+}
+
+extern "C" inline void cxxasync_folly_cancel(ExecletCanceller* canceller) {
+  static_cast<FollyExeclet*>(canceller)
+      ->m_cancellation_source.requestCancellation();
+}
+
+extern "C" inline void cxxasync_folly_drop_canceller(
+    ExecletCanceller* canceller) {
+  static_cast<FollyExeclet*>(canceller)->keepAliveRelease();
+}
+
+// Allows Folly semi-awaitables (including Folly tasks) to be awaited. Like a
+// Folly task, this passes the coroutine's cancellation token along.
 template <typename SemiAwaitable, typename Future>
 class AwaitTransformer<
     SemiAwaitable,
@@ -87,12 +197,37 @@ class AwaitTransformer<
   static auto await_transform(
       RustPromiseBase<Future>& promise,
       SemiAwaitable&& semiawaitable) noexcept {
+    FollyExeclet& executor = promise.execlet().template adapter<FollyExeclet>();
     return std::move(folly::coro::co_viaIfAsync(
-        new FollyExeclet(promise.execlet()),
-        std::forward<SemiAwaitable>(semiawaitable)));
+        &executor,
+        folly::coro::co_withCancellation(
+            executor.cancellation_token(),
+            std::forward<SemiAwaitable>(semiawaitable))));
   }
 };
 
+// Answers `co_await rust::async::cancellation_token()`.
+template <typename Future>
+class AwaitTransformer<CancellationTokenRequest, Future> {
+  AwaitTransformer() = delete;
+
+ public:
+  static auto await_transform(
+      RustPromiseBase<Future>& promise,
+      CancellationTokenRequest&&) noexcept {
+    return ReadyAwaiter<folly::CancellationToken>(
+        promise.execlet().template adapter<FollyExeclet>().cancellation_token());
+  }
+};
+
+// Like `folly::coro::blockingWait()`, but first checks that blocking here can't
+// deadlock. See `WakeTrampoline::begin_blocking()`.
+template <typename... Args>
+decltype(auto) blocking_wait(Args&&... args) {
+  WakeTrampoline::BlockingScope blocking;
+  return folly::coro::blockingWait(std::forward<Args>(args)...);
+}
+
 } // namespace async
 } // namespace rust
 
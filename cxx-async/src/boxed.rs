@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ *
+ * This source code is licensed under both the MIT license found in the
+ * LICENSE-MIT file in the root directory of this source tree and the Apache
+ * License, Version 2.0 found in the LICENSE-APACHE file in the root directory
+ * of this source tree.
+ */
+
+// cxx-async/src/boxed.rs
+//
+// Owning, type-erased handles to futures and streams that the `bridge` macro uses as the
+// representation of the types it defines.
+//
+// These are two words wide, just like `BoxFuture` and `BoxStream`, and C++ treats them as opaque
+// in exactly the same way. Unlike those types, they don't require the pointee to be a `Box`, which
+// lets a C++ coroutine's receiver point straight at the reference-counted channel block that it
+// shares with the sender instead of being boxed up separately.
+
+use crate::CxxAsyncResult;
+use futures::Stream;
+use std::future::Future;
+use std::pin::Pin;
+use std::ptr::NonNull;
+use std::task::Context;
+use std::task::Poll;
+
+// The operations on a type-erased handle. There's one static instance of this per concrete type.
+pub(crate) struct RawBoxVtable<R> {
+    poll: unsafe fn(NonNull<()>, &mut Context) -> Poll<R>,
+    drop: unsafe fn(NonNull<()>),
+}
+
+/// Types that can be converted into the data pointer of a handle that polls to `R`.
+///
+/// # Safety
+///
+/// `poll_raw` and `drop_raw` must only be called with a pointer returned by `into_raw`, and the
+/// pointee must stay at the same address until `drop_raw` is called.
+pub(crate) unsafe trait IntoRawBox<R>: Sized {
+    const VTABLE: RawBoxVtable<R> = RawBoxVtable {
+        poll: Self::poll_raw,
+        drop: Self::drop_raw,
+    };
+
+    fn into_raw(self) -> NonNull<()>;
+    unsafe fn poll_raw(data: NonNull<()>, cx: &mut Context) -> Poll<R>;
+    unsafe fn drop_raw(data: NonNull<()>);
+}
+
+// An arbitrary Rust future, boxed up.
+struct Boxed<T>(Box<T>);
+
+unsafe impl<F> IntoRawBox<F::Output> for Boxed<F>
+where
+    F: Future,
+{
+    fn into_raw(self) -> NonNull<()> {
+        unsafe { NonNull::new_unchecked(Box::into_raw(self.0) as *mut ()) }
+    }
+
+    unsafe fn poll_raw(data: NonNull<()>, cx: &mut Context) -> Poll<F::Output> {
+        Pin::new_unchecked(&mut *(data.as_ptr() as *mut F)).poll(cx)
+    }
+
+    unsafe fn drop_raw(data: NonNull<()>) {
+        drop(Box::from_raw(data.as_ptr() as *mut F))
+    }
+}
+
+// Wraps a stream so that it can share the `IntoRawBox` implementation with futures.
+struct BoxedStream<S>(Box<S>);
+
+unsafe impl<S> IntoRawBox<Option<S::Item>> for BoxedStream<S>
+where
+    S: Stream,
+{
+    fn into_raw(self) -> NonNull<()> {
+        unsafe { NonNull::new_unchecked(Box::into_raw(self.0) as *mut ()) }
+    }
+
+    unsafe fn poll_raw(data: NonNull<()>, cx: &mut Context) -> Poll<Option<S::Item>> {
+        Pin::new_unchecked(&mut *(data.as_ptr() as *mut S)).poll_next(cx)
+    }
+
+    unsafe fn drop_raw(data: NonNull<()>) {
+        drop(Box::from_raw(data.as_ptr() as *mut S))
+    }
+}
+
+// The untyped guts of `CxxAsyncBoxFuture` and `CxxAsyncBoxStream`.
+//
+// This must be laid out as the data pointer followed by the vtable pointer, because C++ checks the
+// second word to find out whether a future has been moved out of.
+#[repr(C)]
+struct RawBox<R> {
+    data: NonNull<()>,
+    vtable: *const RawBoxVtable<R>,
+}
+
+impl<R> RawBox<R> {
+    fn new<T>(value: T) -> RawBox<R>
+    where
+        T: IntoRawBox<R>,
+    {
+        RawBox {
+            data: value.into_raw(),
+            vtable: &T::VTABLE,
+        }
+    }
+
+    fn poll(&mut self, cx: &mut Context) -> Poll<R> {
+        unsafe { ((*self.vtable).poll)(self.data, cx) }
+    }
+}
+
+impl<R> Drop for RawBox<R> {
+    fn drop(&mut self) {
+        unsafe { ((*self.vtable).drop)(self.data) }
+    }
+}
+
+/// An owned, type-erased future, like `futures::future::BoxFuture`.
+///
+/// This is an implementation detail of the `bridge` macro.
+#[doc(hidden)]
+#[repr(transparent)]
+pub struct CxxAsyncBoxFuture<Output>(RawBox<CxxAsyncResult<Output>>);
+
+/// An owned, type-erased stream, like `futures::stream::BoxStream`.
+///
+/// This is an implementation detail of the `bridge` macro.
+#[doc(hidden)]
+#[repr(transparent)]
+pub struct CxxAsyncBoxStream<Item>(RawBox<Option<CxxAsyncResult<Item>>>);
+
+// The constructors require the wrapped value to be `Send`.
+unsafe impl<Output> Send for CxxAsyncBoxFuture<Output> {}
+unsafe impl<Item> Send for CxxAsyncBoxStream<Item> {}
+
+impl<Output> CxxAsyncBoxFuture<Output> {
+    /// Boxes up a Rust future.
+    pub fn new<Fut>(future: Fut) -> Self
+    where
+        Fut: Future<Output = CxxAsyncResult<Output>> + Send + 'static,
+    {
+        Self(RawBox::new(Boxed(Box::new(future))))
+    }
+
+    pub(crate) fn from_raw_box<T>(value: T) -> Self
+    where
+        T: IntoRawBox<CxxAsyncResult<Output>> + Send + 'static,
+    {
+        Self(RawBox::new(value))
+    }
+}
+
+impl<Item> CxxAsyncBoxStream<Item> {
+    /// Boxes up a Rust stream.
+    pub fn new<Stm>(stream: Stm) -> Self
+    where
+        Stm: Stream<Item = CxxAsyncResult<Item>> + Send + 'static,
+    {
+        Self(RawBox::new(BoxedStream(Box::new(stream))))
+    }
+
+    pub(crate) fn from_raw_box<T>(value: T) -> Self
+    where
+        T: IntoRawBox<Option<CxxAsyncResult<Item>>> + Send + 'static,
+    {
+        Self(RawBox::new(value))
+    }
+}
+
+impl<Output> Future for CxxAsyncBoxFuture<Output> {
+    type Output = CxxAsyncResult<Output>;
+
+    fn poll(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
+        self.0.poll(cx)
+    }
+}
+
+impl<Item> Stream for CxxAsyncBoxStream<Item> {
+    type Item = CxxAsyncResult<Item>;
+
+    fn poll_next(mut self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Option<Self::Item>> {
+        self.0.poll(cx)
+    }
+}
@@ -12,8 +12,19 @@
 // Glue functions for C++/Rust async interoperability.
 
 #include "rust/cxx_async.h"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
 
 namespace rust {
 namespace async {
@@ -29,12 +40,736 @@ void cxxasync_assert(
   }
 }
 
+namespace {
+
+#if defined(CXXASYNC_LATENCY_HISTOGRAMS) || defined(CXXASYNC_TRACING)
+// The monotonic clock that latencies and trace events are measured with.
+uint64_t steady_now_ns() noexcept {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+#endif
+
+// Pooled frames come in power-of-two size classes from 64 bytes up to 4 KiB.
+// Bigger frames go straight to the global allocator.
+const size_t FRAME_POOL_MIN_SIZE_LOG2 = 6;
+const size_t FRAME_POOL_SIZE_CLASS_COUNT = 7;
+const size_t FRAME_POOL_NO_SIZE_CLASS = FRAME_POOL_SIZE_CLASS_COUNT;
+
+// The most free frames that a thread keeps around in each size class.
+const size_t FRAME_POOL_MAX_FREE = 64;
+
+class ThreadFramePool;
+
+// Precedes every pooled frame. This is aligned so that the frame that follows
+// it gets the alignment that the global `operator new` would have given it.
+struct alignas(alignof(std::max_align_t)) FrameHeader {
+  // The pool of the thread that allocated the frame, or null if that thread
+  // was already shutting down.
+  ThreadFramePool* pool;
+};
+
+// A frame on a free list. This overlays the frame's `FrameHeader`.
+struct FreeFrame {
+  FreeFrame* next;
+};
+
+size_t frame_size_class(size_t size) {
+  size_t size_class = 0;
+  while ((size_t(1) << (size_class + FRAME_POOL_MIN_SIZE_LOG2)) < size) {
+    if (++size_class == FRAME_POOL_SIZE_CLASS_COUNT) {
+      return FRAME_POOL_NO_SIZE_CLASS;
+    }
+  }
+  return size_class;
+}
+
+size_t frame_block_size(size_t size_class) {
+  return sizeof(FrameHeader) +
+      (size_t(1) << (size_class + FRAME_POOL_MIN_SIZE_LOG2));
+}
+
+void free_frame_list(FreeFrame* frame) {
+  while (frame != nullptr) {
+    FreeFrame* next = frame->next;
+    ::operator delete(frame);
+    frame = next;
+  }
+}
+
+// The frame pool belonging to one thread.
+//
+// When its thread exits, the pool frees everything on its free lists but
+// deliberately leaks itself, because frames that it allocated may still be
+// alive on other threads, and those frames point back to it. Such frames are
+// freed directly once the pool has been orphaned.
+class ThreadFramePool {
+  // Only touched by the owning thread.
+  FreeFrame* m_free[FRAME_POOL_SIZE_CLASS_COUNT];
+  size_t m_free_count[FRAME_POOL_SIZE_CLASS_COUNT];
+  // Frames freed by other threads, waiting to be taken over by this one.
+  std::atomic<FreeFrame*> m_remote[FRAME_POOL_SIZE_CLASS_COUNT];
+  // True once the owning thread has exited.
+  std::atomic<bool> m_orphaned;
+  // Only written by the owning thread, except for `m_remote_frees`. These are
+  // atomic so that they can be read from anywhere.
+  std::atomic<uint64_t> m_hits;
+  std::atomic<uint64_t> m_misses;
+  std::atomic<uint64_t> m_remote_frees;
+
+  static void bump(std::atomic<uint64_t>& counter) {
+    counter.store(
+        counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+
+  void drain_remote(size_t size_class) {
+    free_frame_list(m_remote[size_class].exchange(nullptr));
+  }
+
+ public:
+  ThreadFramePool()
+      : m_free(),
+        m_free_count(),
+        m_remote(),
+        m_orphaned(false),
+        m_hits(0),
+        m_misses(0),
+        m_remote_frees(0) {}
+
+  // Must be called on the owning thread.
+  void* allocate(size_t size_class) {
+    FreeFrame* frame = m_free[size_class];
+    if (frame == nullptr) {
+      // Take over everything that other threads have given back.
+      frame = m_remote[size_class].exchange(nullptr, std::memory_order_acquire);
+      for (FreeFrame* other = frame; other != nullptr; other = other->next) {
+        m_free_count[size_class]++;
+      }
+    }
+
+    FrameHeader* header;
+    if (frame != nullptr) {
+      m_free[size_class] = frame->next;
+      m_free_count[size_class]--;
+      header = reinterpret_cast<FrameHeader*>(frame);
+      bump(m_hits);
+    } else {
+      header = static_cast<FrameHeader*>(
+          ::operator new(frame_block_size(size_class)));
+      bump(m_misses);
+    }
+
+    header->pool = this;
+    return header + 1;
+  }
+
+  // Must be called on the owning thread.
+  void deallocate_local(size_t size_class, FrameHeader* header) {
+    if (m_free_count[size_class] == FRAME_POOL_MAX_FREE) {
+      ::operator delete(header);
+      return;
+    }
+    FreeFrame* frame = reinterpret_cast<FreeFrame*>(header);
+    frame->next = m_free[size_class];
+    m_free[size_class] = frame;
+    m_free_count[size_class]++;
+  }
+
+  // May be called on any thread.
+  void deallocate_remote(size_t size_class, FrameHeader* header) {
+    m_remote_frees.fetch_add(1, std::memory_order_relaxed);
+
+    FreeFrame* frame = reinterpret_cast<FreeFrame*>(header);
+    FreeFrame* head = m_remote[size_class].load(std::memory_order_relaxed);
+    do {
+      frame->next = head;
+    } while (!m_remote[size_class].compare_exchange_weak(head, frame));
+
+    // If the owning thread has exited, nobody will ever take this list over,
+    // so free it ourselves. This pairs with `orphan()`: either it sees our
+    // frame, or we see its flag.
+    if (m_orphaned.load()) {
+      drain_remote(size_class);
+    }
+  }
+
+  // Called when the owning thread exits.
+  void orphan() {
+    m_orphaned.store(true);
+    for (size_t size_class = 0; size_class < FRAME_POOL_SIZE_CLASS_COUNT;
+         size_class++) {
+      free_frame_list(m_free[size_class]);
+      m_free[size_class] = nullptr;
+      m_free_count[size_class] = 0;
+      drain_remote(size_class);
+    }
+  }
+
+  // Must be called on the owning thread.
+  void count_oversized() {
+    bump(m_misses);
+  }
+
+  FramePoolStats stats() const noexcept {
+    return FramePoolStats{
+        m_hits.load(std::memory_order_relaxed),
+        m_misses.load(std::memory_order_relaxed),
+        m_remote_frees.load(std::memory_order_relaxed),
+    };
+  }
+};
+
+// The calling thread's pool, or null if it doesn't have one yet or has
+// already shut down.
+thread_local ThreadFramePool* t_frame_pool = nullptr;
+thread_local bool t_frame_pool_exited = false;
+
+// Orphans the calling thread's pool when the thread exits.
+struct ThreadFramePoolOwner {
+  ~ThreadFramePoolOwner() {
+    if (t_frame_pool != nullptr) {
+      t_frame_pool->orphan();
+      t_frame_pool = nullptr;
+    }
+    t_frame_pool_exited = true;
+  }
+};
+
+thread_local ThreadFramePoolOwner t_frame_pool_owner;
+
+// Returns the calling thread's pool, creating it if necessary. Returns null if
+// the thread is shutting down.
+ThreadFramePool* local_frame_pool() {
+  if (t_frame_pool == nullptr && !t_frame_pool_exited) {
+    // Touch the owner so that its destructor is registered.
+    (void)&t_frame_pool_owner;
+    t_frame_pool = new ThreadFramePool;
+  }
+  return t_frame_pool;
+}
+
+} // namespace
+
+void* FramePool::allocate(size_t size) {
+  size_t size_class = frame_size_class(size);
+  ThreadFramePool* pool = local_frame_pool();
+  if (size_class == FRAME_POOL_NO_SIZE_CLASS) {
+    if (pool != nullptr) {
+      pool->count_oversized();
+    }
+    return ::operator new(size);
+  }
+  if (pool == nullptr) {
+    FrameHeader* header =
+        static_cast<FrameHeader*>(::operator new(frame_block_size(size_class)));
+    header->pool = nullptr;
+    return header + 1;
+  }
+  return pool->allocate(size_class);
+}
+
+void FramePool::deallocate(void* ptr, size_t size) noexcept {
+  size_t size_class = frame_size_class(size);
+  if (size_class == FRAME_POOL_NO_SIZE_CLASS) {
+    ::operator delete(ptr);
+    return;
+  }
+
+  FrameHeader* header = static_cast<FrameHeader*>(ptr) - 1;
+  ThreadFramePool* pool = header->pool;
+  if (pool == nullptr) {
+    ::operator delete(header);
+  } else if (pool == t_frame_pool) {
+    pool->deallocate_local(size_class, header);
+  } else {
+    pool->deallocate_remote(size_class, header);
+  }
+}
+
+FramePoolStats FramePool::stats() noexcept {
+  ThreadFramePool* pool = t_frame_pool;
+  if (pool == nullptr) {
+    return FramePoolStats{0, 0, 0};
+  }
+  return pool->stats();
+}
+
+namespace {
+
+thread_local EagerPollStats t_eager_poll_stats = {0, 0};
+
+} // namespace
+
+void EagerPollCounter::count(bool hit) noexcept {
+  if (hit) {
+    t_eager_poll_stats.hits++;
+  } else {
+    t_eager_poll_stats.misses++;
+  }
+}
+
+EagerPollStats EagerPollCounter::stats() noexcept {
+  return t_eager_poll_stats;
+}
+
+#ifdef CXXASYNC_LATENCY_HISTOGRAMS
+
+namespace {
+
+const size_t LATENCY_SUB_BUCKET_COUNT = size_t(1) << LATENCY_SUB_BUCKET_BITS;
+
+size_t latency_bucket_index(uint64_t value) {
+  if (value < LATENCY_SUB_BUCKET_COUNT) {
+    return value;
+  }
+  if ((value >> LATENCY_MAX_VALUE_LOG2) != 0) {
+    return LATENCY_BUCKET_COUNT - 1;
+  }
+  // The top `LATENCY_SUB_BUCKET_BITS + 1` bits of the value pick the bucket.
+  size_t shift = std::bit_width(value) - 1 - LATENCY_SUB_BUCKET_BITS;
+  return ((shift + 1) << LATENCY_SUB_BUCKET_BITS) +
+      size_t(value >> shift) - LATENCY_SUB_BUCKET_COUNT;
+}
+
+// One thread's histograms. Only the owning thread records into them, but any
+// thread may read them, so the counters are atomic.
+class ThreadLatencyHistograms {
+  struct Histogram {
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> total_ns;
+    std::atomic<uint64_t> max_ns;
+    std::atomic<uint64_t> buckets[LATENCY_BUCKET_COUNT];
+  };
+
+  Histogram m_histograms[LATENCY_KIND_COUNT];
+
+  static void add(std::atomic<uint64_t>& counter, uint64_t value) {
+    counter.store(
+        counter.load(std::memory_order_relaxed) + value,
+        std::memory_order_relaxed);
+  }
+
+ public:
+  ThreadLatencyHistograms() : m_histograms() {}
+
+  // Must be called on the owning thread.
+  void record(LatencyKind kind, uint64_t value) {
+    Histogram& histogram = m_histograms[size_t(kind)];
+    add(histogram.count, 1);
+    add(histogram.total_ns, value);
+    if (value > histogram.max_ns.load(std::memory_order_relaxed)) {
+      histogram.max_ns.store(value, std::memory_order_relaxed);
+    }
+    add(histogram.buckets[latency_bucket_index(value)], 1);
+  }
+
+  // Adds the counts for `kind` to `out`.
+  void merge_into(LatencyKind kind, LatencyHistogram& out) const {
+    const Histogram& histogram = m_histograms[size_t(kind)];
+    out.count += histogram.count.load(std::memory_order_relaxed);
+    out.total_ns += histogram.total_ns.load(std::memory_order_relaxed);
+    out.max_ns =
+        std::max(out.max_ns, histogram.max_ns.load(std::memory_order_relaxed));
+    for (size_t index = 0; index < LATENCY_BUCKET_COUNT; index++) {
+      out.buckets[index] +=
+          histogram.buckets[index].load(std::memory_order_relaxed);
+    }
+  }
+};
+
+// The histograms of every live thread, and the merged histograms of every
+// thread that has exited.
+struct LatencyRegistry {
+  std::mutex lock;
+  std::vector<ThreadLatencyHistograms*> threads;
+  LatencyHistogram exited[LATENCY_KIND_COUNT];
+
+  LatencyRegistry() : lock(), threads(), exited() {}
+};
+
+// This is deliberately leaked, so that threads that exit during static
+// destruction can still unregister.
+LatencyRegistry& latency_registry() {
+  static LatencyRegistry* registry = new LatencyRegistry;
+  return *registry;
+}
+
+// The calling thread's histograms, or null if it doesn't have any yet or has
+// already shut down.
+thread_local ThreadLatencyHistograms* t_latency_histograms = nullptr;
+thread_local bool t_latency_histograms_exited = false;
+
+// Folds the calling thread's histograms into the registry's when the thread
+// exits.
+struct ThreadLatencyHistogramsOwner {
+  ~ThreadLatencyHistogramsOwner() {
+    ThreadLatencyHistograms* histograms = t_latency_histograms;
+    if (histograms != nullptr) {
+      LatencyRegistry& registry = latency_registry();
+      {
+        std::lock_guard<std::mutex> guard(registry.lock);
+        for (size_t kind = 0; kind < LATENCY_KIND_COUNT; kind++) {
+          histograms->merge_into(LatencyKind(kind), registry.exited[kind]);
+        }
+        registry.threads.erase(std::find(
+            registry.threads.begin(), registry.threads.end(), histograms));
+      }
+      delete histograms;
+      t_latency_histograms = nullptr;
+    }
+    t_latency_histograms_exited = true;
+  }
+};
+
+thread_local ThreadLatencyHistogramsOwner t_latency_histograms_owner;
+
+// Returns the calling thread's histograms, creating them if necessary. Returns
+// null if the thread is shutting down.
+ThreadLatencyHistograms* local_latency_histograms() {
+  if (t_latency_histograms == nullptr && !t_latency_histograms_exited) {
+    // Touch the owner so that its destructor is registered.
+    (void)&t_latency_histograms_owner;
+    ThreadLatencyHistograms* histograms = new ThreadLatencyHistograms;
+    LatencyRegistry& registry = latency_registry();
+    std::lock_guard<std::mutex> guard(registry.lock);
+    registry.threads.push_back(histograms);
+    t_latency_histograms = histograms;
+  }
+  return t_latency_histograms;
+}
+
+} // namespace
+
+uint64_t LatencyHistogram::bucket_lower_bound(size_t index) noexcept {
+  size_t group = index >> LATENCY_SUB_BUCKET_BITS;
+  uint64_t sub_bucket = index & (LATENCY_SUB_BUCKET_COUNT - 1);
+  if (group == 0) {
+    return sub_bucket;
+  }
+  return (LATENCY_SUB_BUCKET_COUNT + sub_bucket) << (group - 1);
+}
+
+uint64_t LatencyHistogram::value_at_quantile(double quantile) const noexcept {
+  if (count == 0) {
+    return 0;
+  }
+  // The rank of the interval we're looking for, counting from 1.
+  uint64_t rank =
+      uint64_t(std::ceil(std::clamp(quantile, 0.0, 1.0) * double(count)));
+  rank = std::clamp(rank, uint64_t(1), count);
+
+  uint64_t seen = 0;
+  for (size_t index = 0; index + 1 < LATENCY_BUCKET_COUNT; index++) {
+    seen += buckets[index];
+    if (seen >= rank) {
+      // Report the top of the bucket, like HdrHistogram does, but never more
+      // than the longest interval actually seen.
+      return std::min(bucket_lower_bound(index + 1) - 1, max_ns);
+    }
+  }
+  return max_ns;
+}
+
+uint64_t LatencyHistograms::now() noexcept {
+  return steady_now_ns();
+}
+
+void LatencyHistograms::record_since(
+    LatencyKind kind,
+    uint64_t start_ns) noexcept {
+  ThreadLatencyHistograms* histograms = local_latency_histograms();
+  if (histograms == nullptr) {
+    return;
+  }
+  uint64_t end_ns = steady_now_ns();
+  histograms->record(kind, end_ns > start_ns ? end_ns - start_ns : 0);
+}
+
+LatencyHistogram LatencyHistograms::histogram(LatencyKind kind) noexcept {
+  LatencyHistogram histogram = {};
+  LatencyRegistry& registry = latency_registry();
+  std::lock_guard<std::mutex> guard(registry.lock);
+  const LatencyHistogram& exited = registry.exited[size_t(kind)];
+  histogram.count = exited.count;
+  histogram.total_ns = exited.total_ns;
+  histogram.max_ns = exited.max_ns;
+  std::copy(
+      std::begin(exited.buckets),
+      std::end(exited.buckets),
+      std::begin(histogram.buckets));
+  for (const ThreadLatencyHistograms* thread : registry.threads) {
+    thread->merge_into(kind, histogram);
+  }
+  return histogram;
+}
+
+#endif
+
+#ifdef CXXASYNC_TRACING
+
+namespace {
+
+std::atomic<Tracing::Callback> g_trace_callback{nullptr};
+
+} // namespace
+
+void Tracing::set_callback(Callback callback) noexcept {
+  g_trace_callback.store(callback, std::memory_order_release);
+}
+
+uint64_t Tracing::now() noexcept {
+  return steady_now_ns();
+}
+
+void Tracing::emit(TraceEventKind kind, uint64_t future_id) noexcept {
+  Callback callback = g_trace_callback.load(std::memory_order_acquire);
+  if (callback != nullptr) {
+    callback(TraceEvent{kind, future_id, now()});
+  }
+}
+
+#endif
+
+namespace {
+
+thread_local WakeTrampoline::Mode t_wake_trampoline_mode =
+    WakeTrampoline::Mode::Idle;
+
+// A wakeup that arrived while the trampoline was busy. This owns a reference to
+// its coroutine.
+struct QueuedWakeup {
+  SuspendedCoroutine* coroutine;
+#ifdef CXXASYNC_LATENCY_HISTOGRAMS
+  // When the waker fired. See `LatencyKind::WakeToResume`.
+  uint64_t woken_at_ns;
+#endif
+};
+
+// Queued wakeups, oldest first. Entries before `t_wake_trampoline_head` have
+// already been taken.
+thread_local std::vector<QueuedWakeup> t_wake_trampoline_queue;
+thread_local size_t t_wake_trampoline_head = 0;
+
+} // namespace
+
+// Polls queued wakeups until one of them has a coroutine to resume, and
+// returns that coroutine. Returns null once the queue is empty.
+std_coroutine::coroutine_handle<void> WakeTrampoline::take_next() noexcept {
+  std::vector<QueuedWakeup>& queue = t_wake_trampoline_queue;
+  while (t_wake_trampoline_head < queue.size()) {
+    QueuedWakeup wakeup = queue[t_wake_trampoline_head++];
+    SuspendedCoroutine* coroutine = wakeup.coroutine;
+
+    // Polling may queue more wakeups, which is fine, since we index into the
+    // queue instead of holding an iterator.
+    Mode previous = t_wake_trampoline_mode;
+    t_wake_trampoline_mode = Mode::Polling;
+    std_coroutine::coroutine_handle<void> next =
+        coroutine->m_vtable->take_wakeup(coroutine);
+    t_wake_trampoline_mode = previous;
+
+    if (next) {
+      // Whoever called us resumes `next` right away.
+#ifdef CXXASYNC_LATENCY_HISTOGRAMS
+      LatencyHistograms::record_since(
+          LatencyKind::WakeToResume, wakeup.woken_at_ns);
+#endif
+      return next;
+    }
+  }
+
+  queue.clear();
+  t_wake_trampoline_head = 0;
+  return {};
+}
+
+// Resumes queued coroutines until there are none left.
+void WakeTrampoline::drain() noexcept {
+  t_wake_trampoline_mode = Mode::Draining;
+  while (std_coroutine::coroutine_handle<void> next = take_next()) {
+    next.resume();
+  }
+  t_wake_trampoline_mode = Mode::Idle;
+}
+
+void WakeTrampoline::wake(SuspendedCoroutine* coroutine) noexcept {
+#ifdef CXXASYNC_LATENCY_HISTOGRAMS
+  t_wake_trampoline_queue.push_back(QueuedWakeup{coroutine, steady_now_ns()});
+#else
+  t_wake_trampoline_queue.push_back(QueuedWakeup{coroutine});
+#endif
+  if (t_wake_trampoline_mode == Mode::Idle) {
+    drain();
+  }
+}
+
+WakeTrampoline::Mode WakeTrampoline::begin_poll() noexcept {
+  Mode previous = t_wake_trampoline_mode;
+  t_wake_trampoline_mode = Mode::Polling;
+  return previous;
+}
+
+void WakeTrampoline::end_poll(Mode previous) noexcept {
+  t_wake_trampoline_mode = previous;
+  if (previous == Mode::Idle) {
+    drain();
+  }
+}
+
+std_coroutine::coroutine_handle<void> WakeTrampoline::end_suspend(
+    Mode previous,
+    std_coroutine::coroutine_handle<void> next) noexcept {
+  t_wake_trampoline_mode = previous;
+  switch (previous) {
+    case Mode::Idle:
+      // Nobody else is going to run the wakeups that came in while we were
+      // polling, so run them now. This may resume the suspending coroutine
+      // itself, which is fine, since it's asleep.
+      drain();
+      break;
+    case Mode::Polling:
+      // Some poll further up the stack is still in progress, so we can't run
+      // anything else yet. The trampoline will get to it.
+      break;
+    case Mode::Draining:
+      // We were resumed by the trampoline's loop, so we can hand control
+      // straight to the next coroutine in line instead of returning to it.
+      if (!next) {
+        next = take_next();
+      }
+      break;
+  }
+  return next ? next : std_coroutine::noop_coroutine();
+}
+
+WakeTrampoline::Mode WakeTrampoline::begin_blocking() noexcept {
+  Mode previous = t_wake_trampoline_mode;
+  CXXASYNC_ASSERT(previous != Mode::Polling);
+  if (previous == Mode::Draining) {
+    // This leaves the trampoline idle, so wakeups run right away from now on.
+    // The loop further up the stack picks up where we left off once we return.
+    drain();
+  }
+  return previous;
+}
+
+void WakeTrampoline::end_blocking(Mode previous) noexcept {
+  // Nothing can be queued here, since wakeups ran right away while we blocked.
+  t_wake_trampoline_mode = previous;
+}
+
+void SuspendedCoroutine::wait_until_unreferenced() noexcept {
+  // Only a wakeup racing with the awaiter's destruction on another thread can
+  // still hold a reference, and it drops it as soon as it's done, so spin.
+  while (m_refcount.load() != 0) {
+    std::this_thread::yield();
+  }
+}
+
+const SuspendedCoroutineVtable EscapedWaker::s_vtable = {
+    take_wakeup_impl,
+    deallocate_impl,
+    abandon_impl,
+    clone_impl,
+    wake_impl,
+};
+
+EscapedWaker::EscapedWaker(SuspendedCoroutine* target)
+    : SuspendedCoroutine(&s_vtable),
+      m_lock(),
+      m_target(target->add_ref()),
+      m_holds_target(true) {
+  m_refcount.store(2);
+#ifdef CXXASYNC_TRACING
+  set_trace_id(target->trace_id());
+#endif
+}
+
+SuspendedCoroutine* EscapedWaker::clone_from_target() {
+  add_ref();
+  // If every clone had gone away, we let go of the inline waker, so take it
+  // back.
+  std::lock_guard<std::mutex> guard(m_lock);
+  if (!m_holds_target && m_target != nullptr) {
+    m_target->add_ref();
+    m_holds_target = true;
+  }
+  return this;
+}
+
+void EscapedWaker::detach_target() {
+  SuspendedCoroutine* target = nullptr;
+  {
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (m_holds_target) {
+      target = m_target;
+    }
+    m_target = nullptr;
+    m_holds_target = false;
+  }
+  if (target != nullptr) {
+    target->release();
+  }
+  release();
+}
+
+std_coroutine::coroutine_handle<void> EscapedWaker::take_wakeup_impl(
+    SuspendedCoroutine* coroutine) {
+  EscapedWaker* waker = static_cast<EscapedWaker*>(coroutine);
+  SuspendedCoroutine* target;
+  {
+    std::lock_guard<std::mutex> guard(waker->m_lock);
+    target = waker->m_target;
+    if (target != nullptr) {
+      target->add_ref();
+    }
+  }
+  // The inline waker's awaiter waits for this reference to go away before it
+  // does, so this is safe outside the lock.
+  std_coroutine::coroutine_handle<void> next;
+  if (target != nullptr) {
+    next = target->m_vtable->take_wakeup(target);
+  }
+  waker->release();
+  return next;
+}
+
+void EscapedWaker::deallocate_impl(SuspendedCoroutine* coroutine) {
+  delete static_cast<EscapedWaker*>(coroutine);
+}
+
+void EscapedWaker::abandon_impl(SuspendedCoroutine* coroutine) {
+  // Only the inline waker refers to us now, so if nothing else clones us, we
+  // can't wake it anymore. Let go of it, so that it can tell.
+  EscapedWaker* waker = static_cast<EscapedWaker*>(coroutine);
+  SuspendedCoroutine* target = nullptr;
+  {
+    std::lock_guard<std::mutex> guard(waker->m_lock);
+    if (waker->m_holds_target && waker->m_refcount.load() == 1) {
+      target = waker->m_target;
+      waker->m_holds_target = false;
+    }
+  }
+  if (target != nullptr) {
+    target->release();
+  }
+}
+
+SuspendedCoroutine* EscapedWaker::clone_impl(SuspendedCoroutine* coroutine) {
+  return coroutine->add_ref();
+}
+
+void EscapedWaker::wake_impl(SuspendedCoroutine* coroutine) {
+  WakeTrampoline::wake(coroutine);
+}
+
 } // namespace async
 } // namespace rust
 
 extern "C" uint8_t* cxxasync_suspended_coroutine_clone(uint8_t* ptr) {
   return reinterpret_cast<uint8_t*>(
-      reinterpret_cast<rust::async::SuspendedCoroutine*>(ptr)->add_ref());
+      reinterpret_cast<rust::async::SuspendedCoroutine*>(ptr)->clone());
 }
 
 extern "C" void cxxasync_suspended_coroutine_drop(uint8_t* address) {
@@ -44,12 +779,72 @@ extern "C" void cxxasync_suspended_coroutine_drop(uint8_t* address) {
 extern "C" void cxxasync_suspended_coroutine_wake_by_ref(uint8_t* ptr) {
   rust::async::SuspendedCoroutine* coroutine =
       reinterpret_cast<rust::async::SuspendedCoroutine*>(ptr);
-  if (wake_status_is_done(coroutine->wake())) {
-    coroutine->resume();
-  }
+#ifdef CXXASYNC_TRACING
+  rust::async::Tracing::emit(
+      rust::async::TraceEventKind::Wake, coroutine->trace_id());
+#endif
+  coroutine->wake_by_ref();
 }
 
 extern "C" void cxxasync_suspended_coroutine_wake(uint8_t* ptr) {
-  cxxasync_suspended_coroutine_wake_by_ref(ptr);
-  cxxasync_suspended_coroutine_drop(ptr);
+  rust::async::SuspendedCoroutine* coroutine =
+      reinterpret_cast<rust::async::SuspendedCoroutine*>(ptr);
+#ifdef CXXASYNC_TRACING
+  rust::async::Tracing::emit(
+      rust::async::TraceEventKind::Wake, coroutine->trace_id());
+#endif
+  coroutine->wake();
+}
+
+// Lets `cxx_async::block_on()` check and prepare for blocking the thread.
+extern "C" uint8_t cxxasync_begin_blocking() {
+  return static_cast<uint8_t>(rust::async::WakeTrampoline::begin_blocking());
 }
+
+extern "C" void cxxasync_end_blocking(uint8_t previous) {
+  rust::async::WakeTrampoline::end_blocking(
+      rust::async::WakeTrampoline::Mode(previous));
+}
+
+#ifdef CXXASYNC_TRACING
+
+// The clock that Rust stamps its own trace events with, so that they line up
+// with the C++ ones.
+extern "C" uint64_t cxxasync_trace_now() {
+  return rust::async::Tracing::now();
+}
+
+// Lets Rust forward C++ trace events to the `tracing` crate.
+extern "C" void cxxasync_trace_set_callback(
+    rust::async::Tracing::Callback callback) {
+  rust::async::Tracing::set_callback(callback);
+}
+
+#endif
+
+#ifdef CXXASYNC_LATENCY_HISTOGRAMS
+
+// Lets Rust stamp and record execlet tasks, and read the histograms.
+extern "C" size_t cxxasync_latency_bucket_count() {
+  return rust::async::LATENCY_BUCKET_COUNT;
+}
+
+extern "C" uint64_t cxxasync_latency_now() {
+  return rust::async::LatencyHistograms::now();
+}
+
+extern "C" void cxxasync_latency_record_since(
+    uint32_t kind,
+    uint64_t start_ns) {
+  rust::async::LatencyHistograms::record_since(
+      rust::async::LatencyKind(kind), start_ns);
+}
+
+extern "C" void cxxasync_latency_histogram(
+    uint32_t kind,
+    rust::async::LatencyHistogram* out) {
+  *out = rust::async::LatencyHistograms::histogram(
+      rust::async::LatencyKind(kind));
+}
+
+#endif
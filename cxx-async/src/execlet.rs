@@ -13,141 +13,283 @@
 //
 // This is needed by the Folly backend, to allow awaiting semifutures.
 
+#[cfg(feature = "latency-histograms")]
+use crate::latency;
+#[cfg(feature = "latency-histograms")]
+use crate::latency::LatencyKind;
 use crate::SafeUnwrap;
+use futures::task::AtomicWaker;
 use once_cell::sync::OnceCell;
 use std::collections::VecDeque;
-use std::mem;
+use std::ptr;
+use std::sync::atomic::AtomicBool;
+use std::sync::atomic::AtomicPtr;
+use std::sync::atomic::Ordering;
 use std::sync::Arc;
 use std::sync::Condvar;
 use std::sync::Mutex;
 use std::sync::Weak;
 use std::task::Context;
-use std::task::RawWaker;
-use std::task::RawWakerVTable;
+use std::task::Wake;
 use std::task::Waker;
 use std::thread;
 
 // Allows the Rust polling interface to drive C++ tasks to completion.
 //
 // This is needed by the Folly backend, to allow awaiting semifutures.
+//
+// An execlet doesn't have an allocation of its own; it lives inside whatever object hosts it
+// (normally the channel block of the C++ coroutine that it belongs to), and this handle keeps that
+// host alive.
 #[derive(Clone)]
 #[doc(hidden)]
-pub struct Execlet(Arc<RustExeclet>);
+pub struct Execlet(Arc<dyn ExecletHost>);
 
-struct WeakExeclet(Weak<RustExeclet>);
+struct WeakExeclet(Weak<dyn ExecletHost>);
 
 // The type that C++ sees for an execlet. This is opaque as far as C++ is concerned.
+//
+// The runqueue is an intrusive lock-free stack of C++-owned tasks. Any thread may push onto it with
+// a single compare-and-swap; the one task that runs the execlet takes the whole stack at once with
+// a swap and runs it in submission order. Only one thread may run the execlet at a time, which is
+// guaranteed because only the receiver that owns the channel block, or the reaper after that
+// receiver is gone, ever runs it.
+//
+// Most coroutines never submit anything (the cppcoro backend never does), so an execlet starts out
+// dormant, and the receiver doesn't run it or register a waker with it until C++ submits its first
+// task. That first submission wakes the receiver through its host instead, since nobody is
+// listening on the execlet's own waker yet.
 #[doc(hidden)]
-pub struct RustExeclet(Mutex<ExecletImpl>);
+pub struct RustExeclet {
+    // The most recently submitted task, which links to the one submitted before it, and so on.
+    head: AtomicPtr<ExecletTask>,
+    // The Rust task to wake up when new tasks are submitted.
+    waker: AtomicWaker,
+    // True once C++ has submitted a task to this execlet. This never goes back to false.
+    active: AtomicBool,
+    // Wakes whatever task is waiting on the host of this execlet. Called on the first submission.
+    wake_host: unsafe fn(*const RustExeclet),
+    // Returns a new handle to the host of this execlet, keeping it alive.
+    retain_host: unsafe fn(*const RustExeclet) -> Execlet,
+    // What C++ wants us to call if the future of the coroutine is dropped before the coroutine
+    // finishes, if anything. We own a reference to it.
+    canceller: AtomicPtr<ExecletCanceller>,
+    // True once the future of the coroutine has been dropped before the coroutine finished.
+    cancelled: AtomicBool,
+}
+
+// An object that embeds an execlet.
+pub(crate) trait ExecletHost: Send + Sync + 'static {
+    fn execlet(&self) -> &RustExeclet;
+}
 
 impl Execlet {
-    // Creates a new execlet with no waker and an empty runqueue.
-    fn new() -> Execlet {
-        Execlet(Arc::new(RustExeclet(Mutex::new(ExecletImpl {
-            runqueue: VecDeque::new(),
-            waker: None,
-            running: false,
-        }))))
+    // Creates a handle to the execlet embedded in `host`.
+    pub(crate) fn new(host: Arc<dyn ExecletHost>) -> Execlet {
+        Execlet(host)
     }
 
     fn downgrade(&self) -> WeakExeclet {
         WeakExeclet(Arc::downgrade(&self.0))
     }
 
-    // Consumes the reference.
-    unsafe fn from_raw(ptr: *const RustExeclet) -> Execlet {
-        Execlet(Arc::from_raw(ptr))
+    // Runs all tasks in the runqueue to completion.
+    pub(crate) fn run(&self, cx: &mut Context) {
+        self.0.execlet().run(cx)
+    }
+}
+
+impl RustExeclet {
+    // Creates a new dormant execlet with no waker and an empty runqueue. `wake_host` is called with
+    // a pointer to this execlet when C++ first submits a task to it, and `retain_host` whenever C++
+    // submits a task.
+    pub(crate) fn new(
+        wake_host: unsafe fn(*const RustExeclet),
+        retain_host: unsafe fn(*const RustExeclet) -> Execlet,
+    ) -> RustExeclet {
+        RustExeclet {
+            head: AtomicPtr::new(ptr::null_mut()),
+            waker: AtomicWaker::new(),
+            active: AtomicBool::new(false),
+            wake_host,
+            retain_host,
+            canceller: AtomicPtr::new(ptr::null_mut()),
+            cancelled: AtomicBool::new(false),
+        }
+    }
+
+    // Tells the C++ coroutine that nobody is waiting for its result anymore.
+    pub(crate) fn cancel(&self) {
+        self.cancelled.store(true, Ordering::SeqCst);
+        let canceller = self.canceller.load(Ordering::SeqCst);
+        if !canceller.is_null() {
+            unsafe { ((*canceller).cancel)(canceller) }
+        }
+    }
+
+    // Installs the object to notify on cancellation, taking over a reference to it. If the
+    // coroutine has already been cancelled, notifies it right away.
+    //
+    // Either this or `cancel()` sees the other's write, and possibly both do, so the canceller may
+    // be notified twice.
+    unsafe fn set_canceller(&self, canceller: *mut ExecletCanceller) {
+        self.canceller.store(canceller, Ordering::SeqCst);
+        if self.cancelled.load(Ordering::SeqCst) {
+            ((*canceller).cancel)(canceller)
+        }
     }
 
-    // Bumps the reference count.
-    pub(crate) unsafe fn from_raw_ref(ptr: *const RustExeclet) -> Execlet {
-        let this = Execlet::from_raw(ptr);
-        mem::forget(this.clone());
-        this
+    // Returns true if C++ has ever submitted a task to this execlet. Until then, there's no need to
+    // run it.
+    pub(crate) fn is_active(&self) -> bool {
+        self.active.load(Ordering::SeqCst)
     }
 
     // Runs all tasks in the runqueue to completion.
     pub(crate) fn run(&self, cx: &mut Context) {
-        // Lock.
-        let mut guard = self.0 .0.lock().safe_unwrap();
-        safe_debug_assert!(!guard.running);
-        guard.running = true;
-
-        // Run as many tasks as we have.
-        guard.waker = Some((*cx.waker()).clone());
-        while let Some(task) = guard.runqueue.pop_front() {
-            // Drop the lock so that the task that we run can safely enqueue new tasks without
-            // deadlocking.
-            drop(guard);
+        loop {
+            while self.run_batch() {}
+
+            // Check again after registering, in case a task was submitted in between.
+            self.waker.register(cx.waker());
+            if self.head.load(Ordering::Acquire).is_null() {
+                break;
+            }
+        }
+    }
+
+    // Takes every task in the runqueue and runs them all, oldest first. Returns false if the
+    // runqueue was empty.
+    fn run_batch(&self) -> bool {
+        let mut task = self.head.swap(ptr::null_mut(), Ordering::Acquire);
+        if task.is_null() {
+            return false;
+        }
+
+        // The stack has the newest task on top, so reverse it.
+        let mut batch: *mut ExecletTask = ptr::null_mut();
+        while !task.is_null() {
             unsafe {
-                task.run();
+                let next = (*task).next.load(Ordering::Relaxed);
+                (*task).next.store(batch, Ordering::Relaxed);
+                batch = task;
+                task = next;
             }
-            // Re-acquire the lock.
-            guard = self.0 .0.lock().safe_unwrap();
         }
 
-        // Unlock.
-        guard.running = false;
+        while !batch.is_null() {
+            unsafe {
+                // Read the link first, because running the task hands it back to C++, which is free
+                // to deallocate it.
+                let next = (*batch).next.load(Ordering::Relaxed);
+                #[cfg(feature = "latency-histograms")]
+                latency::record_since(LatencyKind::ExecletSubmitToRun, (*batch).submitted_at_ns);
+                ((*batch).run)(batch);
+                batch = next;
+            }
+        }
+        true
     }
 
     // Submits a task to this execlet.
-    fn submit(&self, task: ExecletTask) {
-        let mut this = self.0 .0.lock().safe_unwrap();
-        this.runqueue.push_back(task);
-        if !this.running {
-            if let Some(ref waker) = this.waker {
-                // Avoid possible deadlocks.
-                let waker = (*waker).clone();
-                drop(this);
-                waker.wake_by_ref();
+    //
+    // SAFETY: `task` must remain valid until its `run` function is called.
+    unsafe fn submit(&self, task: *mut ExecletTask) {
+        // Wake up the receiver the first time around, since it isn't listening on `waker` yet. It
+        // checks the flag again after registering with its host, so either it notices the flip or
+        // the host wakes it up. Do this before queuing the task, because once the task is queued,
+        // running it may finish the coroutine and free the host.
+        if !self.active.load(Ordering::Relaxed) && !self.active.swap(true, Ordering::SeqCst) {
+            (self.wake_host)(self);
+        }
+
+        // Once the task is queued, the receiver may run it, finish the coroutine, and free the host
+        // (and this execlet with it) before we get around to waking the receiver, so hold on to
+        // the host until then.
+        let _host = (self.retain_host)(self);
+
+        #[cfg(feature = "latency-histograms")]
+        {
+            (*task).submitted_at_ns = latency::now();
+        }
+        let mut head = self.head.load(Ordering::Relaxed);
+        loop {
+            (*task).next.store(head, Ordering::Relaxed);
+            match self
+                .head
+                .compare_exchange_weak(head, task, Ordering::Release, Ordering::Relaxed)
+            {
+                Ok(_) => break,
+                Err(new_head) => head = new_head,
             }
         }
+        self.waker.wake();
     }
 }
 
-// Data for each execlet.
-struct ExecletImpl {
-    // Tasks waiting to run.
-    runqueue: VecDeque<ExecletTask>,
-    // A Rust Waker that will be informed when we need to wake up and run some tasks in our
-    // runqueue or yield the result.
-    waker: Option<Waker>,
-    // True if we're running; false otherwise. This flag is necessary to avoid deadlocks resulting
-    // from recursive invocations.
-    running: bool,
+impl Drop for RustExeclet {
+    fn drop(&mut self) {
+        let canceller = *self.canceller.get_mut();
+        if !canceller.is_null() {
+            unsafe { ((*canceller).drop)(canceller) }
+        }
+    }
 }
 
-// A continuation in an execlet's run queue.
-struct ExecletTask {
+// A continuation in an execlet's runqueue. C++ allocates these, usually as part of a larger object,
+// and owns them; the execlet only borrows them from submission until it calls `run`.
+//
+// This must match the layout of `ExecletTask` in `cxx_async.h`.
+#[repr(C)]
+#[doc(hidden)]
+pub struct ExecletTask {
+    // The task that was submitted before this one. Owned by the execlet while the task is queued.
+    next: AtomicPtr<ExecletTask>,
     // A C++ stub that resumes this task.
-    run: unsafe extern "C" fn(*mut u8),
-    // The task data, passed to `run`.
-    data: *mut u8,
+    run: unsafe extern "C" fn(*mut ExecletTask),
+    // When the task was submitted, if latency histograms are on. See
+    // `LatencyKind::ExecletSubmitToRun`.
+    #[cfg_attr(not(feature = "latency-histograms"), allow(dead_code))]
+    submitted_at_ns: u64,
 }
 
-impl ExecletTask {
-    // Creates a new `ExecletTask`.
-    fn new(run: unsafe extern "C" fn(*mut u8), data: *mut u8) -> Self {
-        Self { run, data }
-    }
-
-    // Resumes the task.
-    unsafe fn run(self) {
-        (self.run)(self.data)
-    }
+// Something on the C++ side, typically a cancellation source, that wants to know when the future
+// of a coroutine is dropped before the coroutine finishes. C++ owns these and reference counts them
+// itself; the execlet holds one reference, which it gives back with `drop`.
+//
+// This must match the layout of `ExecletCanceller` in `cxx_async.h`.
+#[repr(C)]
+#[doc(hidden)]
+pub struct ExecletCanceller {
+    // Requests cancellation. This must be safe to call more than once, and from any thread.
+    cancel: unsafe extern "C" fn(*mut ExecletCanceller),
+    // Drops the execlet's reference.
+    drop: unsafe extern "C" fn(*mut ExecletCanceller),
 }
 
-unsafe impl Send for ExecletTask {}
-unsafe impl Sync for ExecletTask {}
-
+// Runs the execlets of C++ coroutines whose futures were dropped before they finished, so that
+// those coroutines still run to completion and their destructors get called.
+//
+// The reaper doesn't poll anything on its own. Each execlet that it's responsible for gets a waker
+// that puts the execlet on the reaper's queue when the execlet has tasks to run, and the reaper
+// thread sleeps whenever that queue is empty.
 pub(crate) struct ExecletReaper {
-    execlets: Mutex<ExecletReaperQueue>,
+    // Execlets that have tasks waiting to run.
+    pending: Mutex<VecDeque<Arc<ReapedExeclet>>>,
     cond: Condvar,
 }
 
-struct ExecletReaperQueue {
-    new: Vec<WeakExeclet>,
-    old: Vec<Execlet>,
+// An execlet that the reaper is responsible for. This is the data behind the waker that the reaper
+// gives to the execlet.
+//
+// This only holds a weak reference, because the waker is stored inside the execlet itself. The C++
+// coroutine's sender keeps the execlet alive until the coroutine finishes, after which there's
+// nothing left to run and the execlet can go away.
+struct ReapedExeclet {
+    execlet: WeakExeclet,
+    // True if this is in the reaper's queue. This keeps a burst of submissions from queuing the
+    // same execlet more than once.
+    queued: AtomicBool,
 }
 
 impl ExecletReaper {
@@ -155,10 +297,7 @@ impl ExecletReaper {
         static INSTANCE: OnceCell<Arc<ExecletReaper>> = OnceCell::new();
         (*INSTANCE.get_or_init(|| {
             let reaper = Arc::new(ExecletReaper {
-                execlets: Mutex::new(ExecletReaperQueue {
-                    new: vec![],
-                    old: vec![],
-                }),
+                pending: Mutex::new(VecDeque::new()),
                 cond: Condvar::new(),
             });
             let reaper_ = reaper.clone();
@@ -169,14 +308,11 @@ impl ExecletReaper {
     }
 
     pub(crate) fn add(&self, execlet: Execlet) {
-        let mut execlets = self.execlets.lock().safe_unwrap();
-        execlets.new.push(execlet.downgrade());
-
-        // Go ahead and start running the execlet if the reaper is sleeping. This makes sure that
+        // Run the execlet once right away, even though it hasn't asked us to. This makes sure that
         // we properly handle the following sequence of events:
         //
-        // 1. User code drops the `CxxAsyncReceiver` from a task T and `CxxAsyncReceiver::drop()`
-        //    starts running, but doesn't get here yet.
+        // 1. User code drops the future wrapping a C++ coroutine from a task T and the receiver's
+        //    drop code starts running, but doesn't get here yet.
         // 2. The wrapped C++ future resolves on some C++ executor on another thread and submits a
         //    task U to the execlet.
         // 3. The original Waker is invoked and the Rust executor makes a note to resume task T.
@@ -184,132 +320,86 @@ impl ExecletReaper {
         //    execlet to run.
         // 4. We add the execlet to this reaper.
         //
-        // In this case, we have to make sure that we run task U, even though an execlet reaper
-        // waker was never invoked.
-        self.cond.notify_all();
+        // In this case, we have to make sure that we run task U, even though the reaper's waker
+        // was never invoked.
+        self.enqueue(Arc::new(ReapedExeclet {
+            execlet: execlet.downgrade(),
+            queued: AtomicBool::new(false),
+        }));
     }
 
-    fn run(self: Arc<Self>) {
-        loop {
-            let mut execlets = self.execlets.lock().safe_unwrap();
-            while execlets.is_empty() {
-                execlets = self.cond.wait(execlets).safe_unwrap();
-            }
-
-            let execlets_to_process = execlets.take();
-            for execlet in execlets_to_process {
-                drop(execlets);
-                unsafe {
-                    execlet.run(&mut Context::from_waker(&Waker::from_raw(
-                        ExecletReaperWaker {
-                            execlet: execlet.clone(),
-                        }
-                        .into_raw(),
-                    )));
-                }
-                execlets = self.execlets.lock().safe_unwrap();
-                execlets.old.push(execlet);
-            }
+    fn enqueue(&self, reaped: Arc<ReapedExeclet>) {
+        if reaped.queued.swap(true, Ordering::AcqRel) {
+            return;
         }
+        self.pending.lock().safe_unwrap().push_back(reaped);
+        self.cond.notify_one();
     }
 
-    fn wake(&self) {
-        self.cond.notify_all();
-    }
-}
+    fn run(self: Arc<Self>) {
+        loop {
+            let reaped = {
+                let mut pending = self.pending.lock().safe_unwrap();
+                loop {
+                    match pending.pop_front() {
+                        Some(reaped) => break reaped,
+                        None => pending = self.cond.wait(pending).safe_unwrap(),
+                    }
+                }
+            };
 
-impl ExecletReaperQueue {
-    fn is_empty(&self) -> bool {
-        self.new.is_empty() && self.old.is_empty()
-    }
+            // Clear the flag first, so that tasks submitted while the execlet runs queue it again.
+            reaped.queued.store(false, Ordering::Release);
 
-    fn take(&mut self) -> Vec<Execlet> {
-        let mut execlets = mem::take(&mut self.old);
-        for execlet in mem::take(&mut self.new).into_iter() {
-            if let Some(execlet) = execlet.0.upgrade() {
-                execlets.push(Execlet(execlet));
+            // If the C++ coroutine has finished, it has dropped the last strong reference and
+            // there's nothing more to do.
+            if let Some(execlet) = reaped.execlet.upgrade() {
+                let waker = Waker::from(reaped);
+                execlet.run(&mut Context::from_waker(&waker));
             }
         }
-        execlets
     }
 }
 
-#[derive(Clone)]
-struct ExecletReaperWaker {
-    execlet: Execlet,
-}
-
-impl ExecletReaperWaker {
-    unsafe fn from_raw(data: *const ()) -> ExecletReaperWaker {
-        ExecletReaperWaker {
-            execlet: Execlet(Arc::from_raw(data as *const RustExeclet)),
-        }
+impl WeakExeclet {
+    fn upgrade(&self) -> Option<Execlet> {
+        self.0.upgrade().map(Execlet)
     }
+}
 
-    fn into_raw(self) -> RawWaker {
-        RawWaker::new(
-            Arc::into_raw(self.execlet.0) as *const (),
-            &EXECLET_REAPER_WAKER_VTABLE,
-        )
+impl Wake for ReapedExeclet {
+    fn wake(self: Arc<Self>) {
+        ExecletReaper::get().enqueue(self)
     }
 
-    fn wake(self) {
-        ExecletReaper::get().wake();
+    fn wake_by_ref(self: &Arc<Self>) {
+        ExecletReaper::get().enqueue(self.clone())
     }
 }
 
-unsafe fn execlet_reaper_waker_clone(data: *const ()) -> RawWaker {
-    let execlet_reaper_waker = ExecletReaperWaker::from_raw(data);
-    let waker = execlet_reaper_waker.clone().into_raw();
-    mem::forget(execlet_reaper_waker);
-    waker
-}
-
-unsafe fn execlet_reaper_waker_wake(data: *const ()) {
-    ExecletReaperWaker::from_raw(data).wake()
-}
-
-unsafe fn execlet_reaper_waker_wake_by_ref(data: *const ()) {
-    let waker = ExecletReaperWaker::from_raw(data);
-    waker.clone().wake();
-    mem::forget(waker);
-}
-
-unsafe fn execlet_reaper_waker_drop(data: *const ()) {
-    drop(ExecletReaperWaker::from_raw(data))
-}
-
-static EXECLET_REAPER_WAKER_VTABLE: RawWakerVTable = RawWakerVTable::new(
-    execlet_reaper_waker_clone,
-    execlet_reaper_waker_wake,
-    execlet_reaper_waker_wake_by_ref,
-    execlet_reaper_waker_drop,
-);
-
 // Execlet FFI
 
-// C++ calls this to create a new execlet.
-#[no_mangle]
-#[doc(hidden)]
-pub unsafe extern "C" fn cxxasync_execlet_create() -> *const RustExeclet {
-    Arc::into_raw(Execlet::new().0)
-}
-
-// C++ calls this to decrement the reference count on an execlet and free it if the count hits zero.
+// C++ calls this to submit a task to the execlet.
+//
+// The execlet is owned by the channel of the C++ coroutine that's submitting the task, which keeps
+// it alive on entry. That's no longer true once the task is queued, since running it may finish
+// the coroutine, so `submit()` holds its own reference to the channel until it returns.
 #[no_mangle]
 #[doc(hidden)]
-pub unsafe extern "C" fn cxxasync_execlet_release(this: *mut RustExeclet) -> bool {
-    let execlet = Execlet::from_raw(this);
-    Arc::strong_count(&execlet.0) > 1 // Also destroys the execlet reference.
+pub unsafe extern "C" fn cxxasync_execlet_submit(this: *const RustExeclet, task: *mut ExecletTask) {
+    (*this).submit(task)
 }
 
-// C++ calls this to submit a task to the execlet. This internally bumps the reference count.
+// C++ calls this to find out when the future of the coroutine that owns the execlet is dropped. The
+// execlet takes over one reference to `canceller`. This may only be called once per execlet.
+//
+// The coroutine's channel keeps the execlet alive for the duration of this call, since nothing is
+// queued that could finish the coroutine in the meantime.
 #[no_mangle]
 #[doc(hidden)]
-pub unsafe extern "C" fn cxxasync_execlet_submit(
-    this: *mut RustExeclet,
-    run: extern "C" fn(*mut u8),
-    task_data: *mut u8,
+pub unsafe extern "C" fn cxxasync_execlet_set_canceller(
+    this: *const RustExeclet,
+    canceller: *mut ExecletCanceller,
 ) {
-    Execlet::from_raw_ref(this).submit(ExecletTask::new(run, task_data))
+    (*this).set_canceller(canceller)
 }
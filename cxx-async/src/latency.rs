@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ *
+ * This source code is licensed under both the MIT license found in the
+ * LICENSE-MIT file in the root directory of this source tree and the Apache
+ * License, Version 2.0 found in the LICENSE-APACHE file in the root directory
+ * of this source tree.
+ */
+
+// cxx-async/src/latency.rs
+//
+// Histograms of how long wakeups and execlet tasks wait before they run.
+//
+// The histograms themselves live on the C++ side (see `LatencyHistograms` in `cxx_async.h`), since
+// that's where most of the recording happens; this module reads them and records execlet tasks
+// into them.
+
+use std::sync::Once;
+use std::time::Duration;
+
+// These must match `LATENCY_SUB_BUCKET_BITS` and `LATENCY_MAX_VALUE_LOG2` in `cxx_async.h`. The
+// bucket count is derived the same way on both sides, and checked against C++ the first time a
+// histogram is read.
+const SUB_BUCKET_BITS: u32 = 4;
+const MAX_VALUE_LOG2: u32 = 36;
+const SUB_BUCKET_COUNT: u64 = 1 << SUB_BUCKET_BITS;
+const BUCKET_COUNT: usize = ((MAX_VALUE_LOG2 - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS) as usize;
+
+static CHECK_BUCKET_COUNT: Once = Once::new();
+
+extern "C" {
+    fn cxxasync_latency_bucket_count() -> usize;
+    fn cxxasync_latency_now() -> u64;
+    fn cxxasync_latency_record_since(kind: u32, start_ns: u64);
+    fn cxxasync_latency_histogram(kind: u32, out: *mut LatencyHistogram);
+}
+
+/// An interval that `cxx-async` measures.
+///
+/// This must match `LatencyKind` in `cxx_async.h`.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+#[repr(u32)]
+pub enum LatencyKind {
+    /// From a Rust waker firing for a suspended C++ coroutine to the coroutine being resumed.
+    WakeToResume = 0,
+    /// From C++ submitting a task to an execlet (as the Folly backend does to get back onto the
+    /// coroutine's executor) to the execlet running it.
+    ExecletSubmitToRun = 1,
+}
+
+/// A log-linear histogram of one kind of interval, merged across every thread, with every
+/// recorded value accurate to within a sixteenth.
+///
+/// Histograms count up from process start and are never reset, so to look at a window of time,
+/// take the difference of two snapshots.
+///
+/// This must match the layout of `LatencyHistogram` in `cxx_async.h`.
+#[derive(Clone)]
+#[repr(C)]
+pub struct LatencyHistogram {
+    count: u64,
+    total_ns: u64,
+    max_ns: u64,
+    buckets: [u64; BUCKET_COUNT],
+}
+
+/// Returns a snapshot of the histogram for the given kind of interval.
+pub fn latency_histogram(kind: LatencyKind) -> LatencyHistogram {
+    // C++ fills in the whole histogram, so the two sides had better agree on how big it is.
+    CHECK_BUCKET_COUNT.call_once(|| {
+        assert_eq!(
+            unsafe { cxxasync_latency_bucket_count() },
+            BUCKET_COUNT,
+            "latency histogram bucket counts differ between C++ and Rust"
+        )
+    });
+
+    let mut histogram = LatencyHistogram {
+        count: 0,
+        total_ns: 0,
+        max_ns: 0,
+        buckets: [0; BUCKET_COUNT],
+    };
+    unsafe { cxxasync_latency_histogram(kind as u32, &mut histogram) };
+    histogram
+}
+
+impl LatencyHistogram {
+    /// Returns how many intervals have been recorded.
+    pub fn count(&self) -> u64 {
+        self.count
+    }
+
+    /// Returns the sum of all recorded intervals.
+    pub fn total(&self) -> Duration {
+        Duration::from_nanos(self.total_ns)
+    }
+
+    /// Returns the longest recorded interval.
+    pub fn max(&self) -> Duration {
+        Duration::from_nanos(self.max_ns)
+    }
+
+    /// Returns the mean of all recorded intervals, or zero if there aren't any.
+    pub fn mean(&self) -> Duration {
+        match self.count {
+            0 => Duration::ZERO,
+            count => Duration::from_nanos(self.total_ns / count),
+        }
+    }
+
+    /// Returns the interval that the given fraction (from 0 to 1) of recorded intervals are no
+    /// longer than, to the precision of a bucket, or zero if nothing has been recorded.
+    pub fn value_at_quantile(&self, quantile: f64) -> Duration {
+        if self.count == 0 {
+            return Duration::ZERO;
+        }
+        let rank = (quantile.clamp(0.0, 1.0) * self.count as f64).ceil() as u64;
+        let rank = rank.clamp(1, self.count);
+
+        let mut seen = 0;
+        for index in 0..(BUCKET_COUNT - 1) {
+            seen += self.buckets[index];
+            if seen >= rank {
+                // Report the top of the bucket, like HdrHistogram does, but never more than the
+                // longest interval actually seen.
+                let top = bucket_lower_bound(index + 1) - 1;
+                return Duration::from_nanos(top.min(self.max_ns));
+            }
+        }
+        self.max()
+    }
+
+    /// Returns the nonempty buckets, in order, as the shortest interval that falls into each one
+    /// along with how many intervals did. Each bucket ends where the next possible one begins.
+    pub fn buckets(&self) -> impl Iterator<Item = (Duration, u64)> + '_ {
+        self.buckets
+            .iter()
+            .enumerate()
+            .filter(|&(_, &count)| count != 0)
+            .map(|(index, &count)| (Duration::from_nanos(bucket_lower_bound(index)), count))
+    }
+}
+
+// Returns the shortest interval, in nanoseconds, that falls into bucket `index`. This must match
+// `LatencyHistogram::bucket_lower_bound()` in `cxx_async.cpp`.
+fn bucket_lower_bound(index: usize) -> u64 {
+    let group = (index >> SUB_BUCKET_BITS) as u32;
+    let sub_bucket = index as u64 & (SUB_BUCKET_COUNT - 1);
+    if group == 0 {
+        sub_bucket
+    } else {
+        (SUB_BUCKET_COUNT + sub_bucket) << (group - 1)
+    }
+}
+
+// Returns the time to stamp the start of an interval with.
+pub(crate) fn now() -> u64 {
+    unsafe { cxxasync_latency_now() }
+}
+
+// Records an interval that started at `start_ns` and ends now.
+pub(crate) fn record_since(kind: LatencyKind, start_ns: u64) {
+    unsafe { cxxasync_latency_record_since(kind as u32, start_ns) }
+}
@@ -148,11 +148,18 @@
 
 extern crate link_cplusplus;
 
+use crate::boxed::CxxAsyncBoxFuture;
+use crate::boxed::CxxAsyncBoxStream;
+use crate::boxed::IntoRawBox;
 use crate::execlet::Execlet;
+use crate::execlet::ExecletHost;
 use crate::execlet::ExecletReaper;
 use crate::execlet::RustExeclet;
+use crate::oneshot::Oneshot;
+use futures::task::noop_waker;
 use futures::Stream;
 use futures::StreamExt;
+use std::collections::VecDeque;
 use std::convert::From;
 use std::error::Error;
 use std::ffi::CStr;
@@ -169,6 +176,9 @@ use std::panic::AssertUnwindSafe;
 use std::pin::Pin;
 use std::process;
 use std::ptr;
+use std::ptr::NonNull;
+use std::sync::atomic;
+use std::sync::atomic::Ordering;
 use std::sync::Arc;
 use std::sync::Mutex;
 use std::task::Context;
@@ -181,11 +191,19 @@ const FUTURE_STATUS_PENDING: u32 = 0;
 const FUTURE_STATUS_COMPLETE: u32 = 1;
 const FUTURE_STATUS_ERROR: u32 = 2;
 const FUTURE_STATUS_RUNNING: u32 = 3;
+// Only ever sent by C++, never returned from a poll: `value` points to a `CxxAsyncBatch`.
+const FUTURE_STATUS_RUNNING_BATCH: u32 = 4;
 
 const SEND_RESULT_WAIT: u32 = 0;
 const SEND_RESULT_SENT: u32 = 1;
 const SEND_RESULT_FINISHED: u32 = 2;
 
+#[cfg(feature = "latency-histograms")]
+pub use crate::latency::latency_histogram;
+#[cfg(feature = "latency-histograms")]
+pub use crate::latency::LatencyHistogram;
+#[cfg(feature = "latency-histograms")]
+pub use crate::latency::LatencyKind;
 pub use cxx_async_macro::bridge;
 
 #[doc(hidden)]
@@ -224,6 +242,19 @@ macro_rules! safe_debug_assert {
     ($cond:expr) => {};
 }
 
+// Reports a point in a bridged future's life to the `tracing` crate. When the `tracing` feature is
+// off, this expands to nothing and the arguments aren't evaluated. See `trace.rs`.
+#[cfg(feature = "tracing")]
+macro_rules! trace_event {
+    ($kind:ident, $future_id:expr) => {
+        crate::trace::emit(crate::trace::TraceEventKind::$kind, $future_id as u64)
+    };
+}
+#[cfg(not(feature = "tracing"))]
+macro_rules! trace_event {
+    ($kind:ident, $future_id:expr) => {};
+}
+
 macro_rules! safe_unreachable {
     () => {
         safe_panic!("unreachable code executed")
@@ -263,8 +294,17 @@ where
     }
 }
 
+mod boxed;
 #[doc(hidden)]
 pub mod execlet;
+#[cfg(feature = "latency-histograms")]
+mod latency;
+mod oneshot;
+#[cfg(feature = "tracing")]
+mod trace;
+
+#[cfg(feature = "tracing")]
+pub use crate::trace::forward_cpp_trace_events;
 
 // Bridged glue functions.
 extern "C" {
@@ -272,6 +312,8 @@ extern "C" {
     fn cxxasync_suspended_coroutine_wake(waker_data: *mut u8);
     fn cxxasync_suspended_coroutine_wake_by_ref(waker_data: *mut u8);
     fn cxxasync_suspended_coroutine_drop(waker_data: *mut u8);
+    fn cxxasync_begin_blocking() -> u8;
+    fn cxxasync_end_blocking(previous: u8);
 }
 
 // A suspended C++ coroutine needs to act as a waker if it awaits a Rust future. This vtable
@@ -283,6 +325,28 @@ static CXXASYNC_WAKER_VTABLE: RawWakerVTable = RawWakerVTable::new(
     rust_suspended_coroutine_drop,
 );
 
+/// Runs a future to completion on the current thread, like `futures::executor::block_on()`.
+///
+/// Use this instead of `futures::executor::block_on()` in any code that a C++ coroutine might
+/// call. It aborts if the thread is in the middle of polling a Rust future on behalf of a C++
+/// coroutine, where blocking could deadlock, and otherwise makes sure that C++ coroutines woken on
+/// this thread while it blocks still get to run. See `rust::async::WakeTrampoline`.
+pub fn block_on<F>(future: F) -> F::Output
+where
+    F: Future,
+{
+    struct Blocking(u8);
+
+    impl Drop for Blocking {
+        fn drop(&mut self) {
+            unsafe { cxxasync_end_blocking(self.0) }
+        }
+    }
+
+    let _blocking = Blocking(unsafe { cxxasync_begin_blocking() });
+    futures::executor::block_on(future)
+}
+
 /// Any exception that a C++ coroutine throws is automatically caught and converted into this error
 /// type.
 ///
@@ -341,7 +405,9 @@ pub struct CxxAsyncFutureChannel<Fut, Out> {
     // The receiving end.
     future: Fut,
     // The sending end.
-    sender: CxxAsyncSender<Out>,
+    sender: CxxAsyncOneshotSender<Out>,
+    // The execlet that the C++ coroutine submits tasks to. This is owned by the channel block.
+    execlet: *const RustExeclet,
 }
 
 // A sender/receiver pair for the return value of a wrapped C++ multi-shot coroutine.
@@ -358,26 +424,117 @@ where
     future: Stm,
     // The sending end.
     sender: CxxAsyncSender<Item>,
+    // The execlet that the C++ coroutine submits tasks to. This is owned by the channel block.
+    execlet: *const RustExeclet,
+}
+
+// The single allocation that backs a call from Rust to a C++ coroutine. It holds the channel that
+// the coroutine's results travel over and the execlet that drives the coroutine. The receiving end,
+// the sending end, and any execlet handles all point at it.
+//
+// This is `#[repr(C)]` so that the execlet can find its way back to the block: see
+// `wake_receiver()`.
+#[repr(C)]
+struct ChannelBlock<C> {
+    // This must be the first field.
+    execlet: RustExeclet,
+    channel: C,
+}
+
+// A channel that can live in a `ChannelBlock`.
+trait BlockChannel {
+    // Wakes up the receiving end if it's waiting for a value.
+    fn wake_receiver(&self);
+}
+
+impl<C> ChannelBlock<C>
+where
+    C: BlockChannel + Send + Sync + 'static,
+{
+    fn new(channel: C) -> Arc<ChannelBlock<C>> {
+        Arc::new(ChannelBlock {
+            execlet: RustExeclet::new(ChannelBlock::<C>::wake_receiver, ChannelBlock::<C>::retain),
+            channel,
+        })
+    }
+
+    // Returns a new handle to the block, given a pointer to its execlet.
+    //
+    // SAFETY: `execlet` must point to the execlet of a live `ChannelBlock<C>` allocated by `new()`.
+    unsafe fn retain(execlet: *const RustExeclet) -> Execlet {
+        let block = execlet as *const ChannelBlock<C>;
+        Arc::increment_strong_count(block);
+        Execlet::new(Arc::from_raw(block))
+    }
+
+    // Called when C++ first submits a task to the execlet. Until then the receiver hasn't
+    // registered a waker with the execlet, only with the channel.
+    //
+    // SAFETY: `execlet` must point to the execlet of a live `ChannelBlock<C>`.
+    unsafe fn wake_receiver(execlet: *const RustExeclet) {
+        (*(execlet as *const ChannelBlock<C>)).channel.wake_receiver()
+    }
+
+    // Polls the receiving end with `recv`, first running any C++ tasks that are waiting in the
+    // execlet.
+    //
+    // The execlet is skipped entirely until C++ submits something to it, so that coroutines that
+    // never use it (for example, all cppcoro ones) don't pay for it on every poll.
+    fn poll_with<T, F>(&self, cx: &mut Context, recv: F) -> Poll<T>
+    where
+        F: Fn(&C, &Context) -> Poll<T>,
+    {
+        if !self.execlet.is_active() {
+            let result = recv(&self.channel, cx);
+            if result.is_ready() {
+                return result;
+            }
+
+            // Check again now that we're registered with the channel, in case C++ submitted its
+            // first task in the meantime. If it does so after this, it wakes us through the
+            // channel.
+            atomic::fence(Ordering::SeqCst);
+            if !self.execlet.is_active() {
+                return Poll::Pending;
+            }
+        }
+
+        self.execlet.run(cx);
+        recv(&self.channel, cx)
+    }
+}
+
+impl<C> ExecletHost for ChannelBlock<C>
+where
+    C: Send + Sync + 'static,
+{
+    fn execlet(&self) -> &RustExeclet {
+        &self.execlet
+    }
 }
 
-// The single-producer/single-consumer channel type that future and stream implementations use to
-// pass values between the two languages.
+// The single-producer/single-consumer channel type that stream implementations use to pass values
+// between the two languages. Futures use the simpler `Oneshot` channel instead.
 //
 // We can't use a `futures::channel::mpsc` channel because it can deadlock. With a standard MPSC
 // channel, if we try to send a value when the buffer is full and the receiving end is woken up and
 // then tries to receive the value, a deadlock occurs, as the MPSC channel doesn't drop locks before
 // calling the waker.
-struct SpscChannel<T>(Arc<Mutex<SpscChannelImpl<T>>>);
+struct SpscChannel<T>(Mutex<SpscChannelImpl<T>>);
 
 // Data for each SPSC channel.
 struct SpscChannelImpl<T> {
-    // The waker waiting on the value.
+    // The waker waiting on the channel.
     //
-    // This can either be the sending end waiting for the receiving end to receive a previously-sent
-    // value (for streams only) or the receiving end waiting for the sending end to post a value.
+    // This can either be the sending end waiting for the receiving end to make room in a full
+    // buffer or the receiving end waiting for the sending end to post a value. The buffer can't be
+    // both full and empty at once, so only one side can ever be waiting.
     waiter: Option<Waker>,
-    // The value waiting to be read.
-    value: Option<T>,
+    // The values waiting to be read, oldest first.
+    values: VecDeque<T>,
+    // The maximum number of values that may be waiting to be read before the sending end has to
+    // wait. This is always at least 1.
+    capacity: usize,
     // An exception from the C++ side that is to be delivered over to the Rust side.
     exception: Option<CxxAsyncException>,
     // True if the channel is closed; false otherwise.
@@ -385,14 +542,16 @@ struct SpscChannelImpl<T> {
 }
 
 impl<T> SpscChannel<T> {
-    // Creates a new SPSC channel.
-    fn new() -> SpscChannel<T> {
-        SpscChannel(Arc::new(Mutex::new(SpscChannelImpl {
+    // Creates a new SPSC channel that can buffer up to `capacity` values.
+    fn new(capacity: usize) -> SpscChannel<T> {
+        safe_debug_assert!(capacity > 0);
+        SpscChannel(Mutex::new(SpscChannelImpl {
             waiter: None,
-            value: None,
+            values: VecDeque::with_capacity(capacity),
+            capacity,
             exception: None,
             closed: false,
-        })))
+        }))
     }
 
     // Marks the channel as closed. Only the sending end may call this.
@@ -413,22 +572,31 @@ impl<T> SpscChannel<T> {
         }
     }
 
-    // Attempts to send a value. If this channel already has a value yet to be read, this function
-    // returns false. Otherwise, it calls the provided closure to retrieve the value and returns
-    // true.
+    // Attempts to send a value. If this channel's buffer is full, this function returns false.
+    // Otherwise, it calls the provided closure to retrieve the value and returns true.
     //
     // This callback-based design eliminates the requirement to return the original value if the
     // send fails.
     fn try_send_value_with<F>(&self, context: Option<&Context>, getter: F) -> bool
     where
         F: FnOnce() -> T,
+    {
+        self.try_send_values_with(context, |values| values.push_back(getter()))
+    }
+
+    // Like `try_send_value_with`, but the closure may append any number of values at once. As long
+    // as the buffer isn't full, they're all accepted, even if that takes the buffer past its
+    // capacity; a batch is never split up.
+    fn try_send_values_with<F>(&self, context: Option<&Context>, push: F) -> bool
+    where
+        F: FnOnce(&mut VecDeque<T>),
     {
         // Drop the lock before possibly calling the waiter because we could deadlock otherwise.
         let waiter;
         {
             let mut this = self.0.lock().safe_unwrap();
-            if this.value.is_none() {
-                this.value = Some(getter());
+            if this.values.len() < this.capacity {
+                push(&mut this.values);
                 waiter = this.waiter.take();
             } else if context.is_some() && this.waiter.is_some() {
                 safe_panic!("Only one task may block on a `SpscChannel`!")
@@ -470,7 +638,7 @@ impl<T> SpscChannel<T> {
         let (result, waiter);
         {
             let mut this = self.0.lock().safe_unwrap();
-            match this.value.take() {
+            match this.values.pop_front() {
                 Some(value) => {
                     result = Ok(value);
                     waiter = this.waiter.take();
@@ -494,96 +662,154 @@ impl<T> SpscChannel<T> {
         }
         Poll::Ready(Some(result))
     }
+
+    // Returns true if the sending end has closed this channel.
+    fn is_closed(&self) -> bool {
+        self.0.lock().safe_unwrap().closed
+    }
+}
+
+impl<T> BlockChannel for SpscChannel<T> {
+    fn wake_receiver(&self) {
+        // If there are values in the buffer, then the receiving end isn't waiting, and any waiter
+        // is the sending end waiting for room.
+        let waiter = {
+            let mut this = self.0.lock().safe_unwrap();
+            if !this.values.is_empty() {
+                return;
+            }
+            this.waiter.take()
+        };
+
+        if let Some(waiter) = waiter {
+            waiter.wake();
+        }
+    }
 }
 
-impl<T> Clone for SpscChannel<T> {
-    fn clone(&self) -> Self {
-        Self(self.0.clone())
+impl<T> BlockChannel for Oneshot<T> {
+    fn wake_receiver(&self) {
+        self.wake()
     }
 }
 
-// The concrete type of the stream that wraps a C++ coroutine, either one-shot (future) or
-// multi-shot (stream).
+// The concrete type of the stream that wraps a multi-shot C++ coroutine.
 //
-// The programmer only interacts with this abstractly behind a `Box<dyn Future>` or
-// `Box<dyn Stream>` trait object, so this type is considered an implementation detail. It must be
-// public because the `bridge_stream` macro needs to name it.
-#[doc(hidden)]
-pub struct CxxAsyncReceiver<Item> {
-    // The SPSC channel to receive on.
-    receiver: SpscChannel<Item>,
-    // Any execlet that must be driven when receiving.
-    execlet: Option<Execlet>,
-}
+// The programmer only interacts with this abstractly behind a `CxxAsyncBoxStream`, so this type is
+// considered an implementation detail.
+struct CxxAsyncReceiver<Item>(Arc<ChannelBlock<SpscChannel<Item>>>);
+
+// The concrete type of the future that wraps a one-shot C++ coroutine.
+//
+// The programmer only interacts with this abstractly behind a `CxxAsyncBoxFuture`, so this type is
+// considered an implementation detail.
+struct CxxAsyncOneshotReceiver<Output>(Arc<ChannelBlock<Oneshot<Output>>>);
 
 // The concrete type of the sending end of a stream.
 //
 // This must be public because the `bridge_stream` macro needs to name it.
 #[doc(hidden)]
 #[repr(transparent)]
-pub struct CxxAsyncSender<Item>(*mut SpscChannel<Item>);
+pub struct CxxAsyncSender<Item>(*const ChannelBlock<SpscChannel<Item>>);
 
 impl<Item> Drop for CxxAsyncSender<Item> {
     fn drop(&mut self) {
-        unsafe { drop(Box::from_raw(self.0)) }
+        unsafe { drop(Arc::from_raw(self.0)) }
     }
 }
 
-// This is a little weird in that `CxxAsyncReceiver` behaves as a oneshot if it's treated as a
-// Future and an SPSC stream if it's treated as a Stream. But since the programmer only ever
-// interacts with these objects behind boxed trait objects that only expose one of the two traits,
-// it's not a problem.
-impl<Item> Stream for CxxAsyncReceiver<Item> {
-    type Item = CxxAsyncResult<Item>;
+// The concrete type of the sending end of a future.
+//
+// This must be public because the `bridge` macro needs to name it.
+#[doc(hidden)]
+#[repr(transparent)]
+pub struct CxxAsyncOneshotSender<Output>(*const ChannelBlock<Oneshot<Output>>);
 
-    fn poll_next(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Option<Self::Item>> {
-        if let Some(ref execlet) = self.execlet {
-            execlet.run(cx);
-        }
-        self.receiver.recv(cx)
+impl<Output> Drop for CxxAsyncOneshotSender<Output> {
+    fn drop(&mut self) {
+        unsafe { drop(Arc::from_raw(self.0)) }
     }
 }
 
-impl<Output> Future for CxxAsyncReceiver<Output> {
-    type Output = CxxAsyncResult<Output>;
+// The C++ state behind a stream's `next()`, if C++ has ever called it.
+//
+// Only C++ uses this, but Rust holds a reference to it and drops it along with the stream, because
+// the stream might be dropped from either side. This must match `m_next_receiver` in
+// `RustStream`.
+//
+// This must be public because the `bridge_stream` macro needs to name it.
+#[doc(hidden)]
+#[repr(transparent)]
+pub struct CxxAsyncNextReceiver(*mut u8);
 
-    fn poll(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<Self::Output> {
-        if let Some(ref execlet) = self.execlet {
-            execlet.run(cx);
-        }
-        match self.receiver.recv(cx) {
-            Poll::Ready(Some(Ok(value))) => Poll::Ready(Ok(value)),
-            Poll::Ready(Some(Err(exception))) => Poll::Ready(Err(exception)),
-            Poll::Ready(None) => {
-                // This should never happen, because a future should never be polled again after
-                // returning `Ready`.
-                safe_panic!("Attempted to use a stream as a future!")
-            }
-            Poll::Pending => Poll::Pending,
+impl Default for CxxAsyncNextReceiver {
+    fn default() -> Self {
+        CxxAsyncNextReceiver(ptr::null_mut())
+    }
+}
+
+impl Drop for CxxAsyncNextReceiver {
+    fn drop(&mut self) {
+        if !self.0.is_null() {
+            unsafe { cxxasync_suspended_coroutine_drop(self.0) }
         }
     }
 }
 
-impl<Item> From<SpscChannel<Item>> for CxxAsyncReceiver<Item> {
-    fn from(receiver: SpscChannel<Item>) -> Self {
-        CxxAsyncReceiver {
-            receiver,
-            execlet: None,
+// The receiver is a C++ waker, which can be used from any thread.
+unsafe impl Send for CxxAsyncNextReceiver {}
+
+// The receivers convert directly into `CxxAsyncBoxFuture` and `CxxAsyncBoxStream` handles that
+// point at the channel block, so that wrapping them doesn't need an allocation of its own.
+
+unsafe impl<Item> IntoRawBox<Option<CxxAsyncResult<Item>>> for CxxAsyncReceiver<Item>
+where
+    Item: Send + 'static,
+{
+    fn into_raw(self) -> NonNull<()> {
+        unsafe { NonNull::new_unchecked(Arc::into_raw(self.0) as *mut ()) }
+    }
+
+    unsafe fn poll_raw(data: NonNull<()>, cx: &mut Context) -> Poll<Option<CxxAsyncResult<Item>>> {
+        trace_event!(Poll, data.as_ptr() as usize);
+        let block = &*(data.as_ptr() as *const ChannelBlock<SpscChannel<Item>>);
+        block.poll_with(cx, |channel, cx| channel.recv(cx))
+    }
+
+    unsafe fn drop_raw(data: NonNull<()>) {
+        trace_event!(Drop, data.as_ptr() as usize);
+        let block = Arc::from_raw(data.as_ptr() as *const ChannelBlock<SpscChannel<Item>>);
+        // If the C++ coroutine hasn't finished, tell it that nobody is listening anymore, and hand
+        // the execlet over to the reaper so that the coroutine can run to completion.
+        if !block.channel.is_closed() {
+            block.execlet.cancel();
+            ExecletReaper::get().add(Execlet::new(block));
         }
     }
 }
 
-impl<Item> Drop for CxxAsyncReceiver<Item> {
-    fn drop(&mut self) {
-        let execlet = match self.execlet {
-            Some(ref execlet) => execlet,
-            None => return,
-        };
-        let receiver = self.receiver.0.lock().safe_unwrap();
-        if receiver.closed {
-            return;
+unsafe impl<Output> IntoRawBox<CxxAsyncResult<Output>> for CxxAsyncOneshotReceiver<Output>
+where
+    Output: Send + 'static,
+{
+    fn into_raw(self) -> NonNull<()> {
+        unsafe { NonNull::new_unchecked(Arc::into_raw(self.0) as *mut ()) }
+    }
+
+    unsafe fn poll_raw(data: NonNull<()>, cx: &mut Context) -> Poll<CxxAsyncResult<Output>> {
+        trace_event!(Poll, data.as_ptr() as usize);
+        let block = &*(data.as_ptr() as *const ChannelBlock<Oneshot<Output>>);
+        block.poll_with(cx, |channel, cx| channel.recv(cx))
+    }
+
+    unsafe fn drop_raw(data: NonNull<()>) {
+        trace_event!(Drop, data.as_ptr() as usize);
+        let block = Arc::from_raw(data.as_ptr() as *const ChannelBlock<Oneshot<Output>>);
+        // See the comment in the stream version above.
+        if !block.channel.is_complete() {
+            block.execlet.cancel();
+            ExecletReaper::get().add(Execlet::new(block));
         }
-        ExecletReaper::get().add((*execlet).clone());
     }
 }
 
@@ -655,44 +881,40 @@ pub trait IntoCxxAsyncStream: Sized {
 //
 // This needs an out pointer because of https://github.com/rust-lang/rust-bindgen/issues/778
 #[doc(hidden)]
-pub unsafe extern "C" fn future_channel<Fut, Out>(
-    out_oneshot: *mut CxxAsyncFutureChannel<Fut, Out>,
-    execlet: *mut RustExeclet,
-) where
-    Fut: From<CxxAsyncReceiver<Out>> + Future<Output = CxxAsyncResult<Out>>,
+pub unsafe extern "C" fn future_channel<Fut, Out>(out_oneshot: *mut CxxAsyncFutureChannel<Fut, Out>)
+where
+    Fut: From<CxxAsyncBoxFuture<Out>> + Future<Output = CxxAsyncResult<Out>>,
+    Out: Send + 'static,
 {
-    let channel = SpscChannel::new();
+    let block = ChannelBlock::new(Oneshot::new());
+    trace_event!(Create, Arc::as_ptr(&block) as usize);
     let oneshot = CxxAsyncFutureChannel {
-        sender: CxxAsyncSender(Box::into_raw(Box::new(channel.clone()))),
-        future: CxxAsyncReceiver::<Out> {
-            receiver: channel,
-            execlet: Some(Execlet::from_raw_ref(execlet)),
-        }
-        .into(),
+        execlet: &block.execlet,
+        sender: CxxAsyncOneshotSender(Arc::into_raw(block.clone())),
+        future: CxxAsyncBoxFuture::from_raw_box(CxxAsyncOneshotReceiver(block)).into(),
     };
     ptr::write(out_oneshot, oneshot);
 }
 
-// Creates a new multi-shot sender/receiver pair for a stream.
+// Creates a new multi-shot sender/receiver pair for a stream. The C++ coroutine can yield up to
+// `CAPACITY` values ahead of the Rust consumer before it has to suspend.
 //
 // SAFETY: This is a raw FFI function called by our C++ code.
 //
 // This needs an out pointer because of https://github.com/rust-lang/rust-bindgen/issues/778
 #[doc(hidden)]
-pub unsafe extern "C" fn stream_channel<Stm, Item>(
+pub unsafe extern "C" fn stream_channel<Stm, Item, const CAPACITY: usize>(
     out_stream: *mut CxxAsyncStreamChannel<Stm, Item>,
-    execlet: *mut RustExeclet,
 ) where
-    Stm: From<CxxAsyncReceiver<Item>> + Stream<Item = CxxAsyncResult<Item>>,
+    Stm: From<CxxAsyncBoxStream<Item>> + Stream<Item = CxxAsyncResult<Item>>,
+    Item: Send + 'static,
 {
-    let channel = SpscChannel::new();
+    let block = ChannelBlock::new(SpscChannel::new(CAPACITY));
+    trace_event!(Create, Arc::as_ptr(&block) as usize);
     let stream = CxxAsyncStreamChannel {
-        sender: CxxAsyncSender(Box::into_raw(Box::new(channel.clone()))),
-        future: CxxAsyncReceiver {
-            receiver: channel,
-            execlet: Some(Execlet::from_raw_ref(execlet)),
-        }
-        .into(),
+        execlet: &block.execlet,
+        sender: CxxAsyncSender(Arc::into_raw(block.clone())),
+        future: CxxAsyncBoxStream::from_raw_box(CxxAsyncReceiver(block)).into(),
     };
     ptr::write(out_stream, stream);
 }
@@ -716,28 +938,35 @@ pub unsafe extern "C" fn stream_channel<Stm, Item>(
 // can be legally dropped in Rust to signal cancellation.
 #[doc(hidden)]
 pub unsafe extern "C" fn sender_future_send<Item>(
-    this: &mut CxxAsyncSender<Item>,
+    this: &mut CxxAsyncOneshotSender<Item>,
     status: u32,
     value: *const u8,
     waker_data: *const u8,
 ) -> u32 {
     safe_debug_assert!(waker_data.is_null());
 
-    let this = this.0.as_mut().safe_expect("Where's the SPSC sender?");
+    let block = this.0.as_ref().safe_expect("Where's the oneshot sender?");
+    let this = &block.channel;
     match status {
-        FUTURE_STATUS_COMPLETE => {
-            // This is a one-shot sender, so sending must always succeed.
-            let sent = this.try_send_value_with(None, || ptr::read(value as *const Item));
-            safe_debug_assert!(sent);
-        }
-        FUTURE_STATUS_ERROR => this.send_exception(unpack_exception(value)),
+        FUTURE_STATUS_COMPLETE => this.send(Ok(ptr::read(value as *const Item))),
+        FUTURE_STATUS_ERROR => this.send(Err(unpack_exception(value))),
         _ => safe_unreachable!(),
     }
+    trace_event!(Send, block as *const ChannelBlock<_> as usize);
 
-    this.close();
     SEND_RESULT_FINISHED
 }
 
+// A run of stream items that C++ sends all at once, laid out contiguously.
+//
+// This is an implementation detail and is not exposed to the programmer. It must match the
+// definition in `cxx_async.h`.
+#[repr(C)]
+struct CxxAsyncBatch {
+    items: *const u8,
+    len: usize,
+}
+
 // C++ calls this to yield a value for a multi-shot coroutine (stream).
 //
 // SAFETY: This is a low-level function called by our C++ code.
@@ -754,8 +983,13 @@ pub unsafe extern "C" fn sender_future_send<Item>(
 // from `sender_future_send`, which actually sends the value if `status` is
 // `FUTURE_STATUS_COMPLETE`.
 //
+// If `status` is `FUTURE_STATUS_RUNNING_BATCH`, then `value` points to a `CxxAsyncBatch`, and
+// either all of its items are sent, in order, or none of them are. Ownership works the same way as
+// for a single value, item by item.
+//
 // If `waker_data` is present, this identifies the coroutine handle that will be awakened if the
-// channel is currently full.
+// channel is currently full. If it's null, a full channel just returns `SEND_RESULT_WAIT`; C++
+// uses this to try sending before it sets up a waker.
 //
 // Any errors when sending are dropped on the floor. This is because futures can be legally dropped
 // in Rust to signal cancellation.
@@ -777,8 +1011,9 @@ pub unsafe extern "C" fn sender_stream_send<Item>(
         context = Some(Context::from_waker(&waker));
     }
 
-    let this = this.0.as_mut().safe_expect("Where's the SPSC sender?");
-    match status {
+    let block = this.0.as_ref().safe_expect("Where's the SPSC sender?");
+    let this = &block.channel;
+    let result = match status {
         FUTURE_STATUS_COMPLETE => {
             this.close();
             SEND_RESULT_FINISHED
@@ -792,20 +1027,47 @@ pub unsafe extern "C" fn sender_stream_send<Item>(
                 SEND_RESULT_WAIT
             }
         }
+        FUTURE_STATUS_RUNNING_BATCH => {
+            let batch = &*(value as *const CxxAsyncBatch);
+            let items = batch.items as *const Item;
+            let sent = this.try_send_values_with(context.as_ref(), |values| {
+                values.reserve(batch.len);
+                values.extend((0..batch.len).map(|index| ptr::read(items.add(index))));
+            });
+            if sent {
+                SEND_RESULT_SENT
+            } else {
+                SEND_RESULT_WAIT
+            }
+        }
         FUTURE_STATUS_ERROR => {
             this.send_exception(unpack_exception(value));
             this.close();
             SEND_RESULT_FINISHED
         }
         _ => safe_unreachable!(),
+    };
+
+    // A send that has to wait for room hasn't happened yet; it'll be retried.
+    if result != SEND_RESULT_WAIT {
+        trace_event!(Send, block as *const ChannelBlock<_> as usize);
     }
+    result
+}
+
+// C++ calls this to destroy the sender of a one-shot coroutine (future).
+//
+// SAFETY: This is a low-level function called by our C++ code.
+#[doc(hidden)]
+pub unsafe extern "C" fn sender_future_drop<Item>(_: CxxAsyncOneshotSender<Item>) {
+    // Destructor automatically runs.
 }
 
-// C++ calls this to destroy a sender.
+// C++ calls this to destroy the sender of a multi-shot coroutine (stream).
 //
 // SAFETY: This is a low-level function called by our C++ code.
 #[doc(hidden)]
-pub unsafe extern "C" fn sender_drop<Item>(_: CxxAsyncSender<Item>) {
+pub unsafe extern "C" fn sender_stream_drop<Item>(_: CxxAsyncSender<Item>) {
     // Destructor automatically runs.
 }
 
@@ -829,25 +1091,77 @@ pub unsafe extern "C" fn future_poll<Fut, Out>(
 where
     Fut: Future<Output = CxxAsyncResult<Out>>,
 {
-    let waker = Waker::from_raw(RawWaker::new(
-        waker_data as *const (),
-        &CXXASYNC_WAKER_VTABLE,
-    ));
+    trace_event!(Poll, trace::handle_id(&*this));
+    poll_from_cpp(waker_data, move |context| match this.poll(context) {
+        Poll::Ready(Ok(value)) => {
+            ptr::write(result as *mut Out, value);
+            FUTURE_STATUS_COMPLETE
+        }
+        Poll::Ready(Err(error)) => {
+            let error = error.what().to_owned();
+            ptr::write(result as *mut String, error);
+            FUTURE_STATUS_ERROR
+        }
+        Poll::Pending => FUTURE_STATUS_PENDING,
+    })
+}
+
+// C++ calls this to poll the next item out of a wrapped Rust stream.
+//
+// If the stream produced an item, this writes it to `result` and returns `FUTURE_STATUS_RUNNING`.
+// If it produced an error, this writes the message to `result` and returns `FUTURE_STATUS_ERROR`.
+// If the stream is finished, this returns `FUTURE_STATUS_COMPLETE`.
+//
+// SAFETY:
+// * This is a low-level function called by our C++ code.
+// * `Pin<&mut Stream>` is marked `#[repr(transparent)]`, so it's FFI-safe.
+// * We catch all panics inside `poll_next` so that they don't unwind into C++.
+#[doc(hidden)]
+pub unsafe extern "C" fn stream_poll<Stm, Item>(
+    this: Pin<&mut Stm>,
+    result: *mut u8,
+    waker_data: *const u8,
+) -> u32
+where
+    Stm: Stream<Item = CxxAsyncResult<Item>>,
+{
+    trace_event!(Poll, trace::handle_id(&*this));
+    poll_from_cpp(waker_data, move |context| match this.poll_next(context) {
+        Poll::Ready(Some(Ok(value))) => {
+            ptr::write(result as *mut Item, value);
+            FUTURE_STATUS_RUNNING
+        }
+        Poll::Ready(Some(Err(error))) => {
+            let error = error.what().to_owned();
+            ptr::write(result as *mut String, error);
+            FUTURE_STATUS_ERROR
+        }
+        Poll::Ready(None) => FUTURE_STATUS_COMPLETE,
+        Poll::Pending => FUTURE_STATUS_PENDING,
+    })
+}
+
+// Runs `poll` with a waker that wakes up the given suspended C++ coroutine, aborting the process
+// if it panics.
+//
+// If `waker_data` is null, `poll` gets a waker that does nothing instead. C++ does this when it
+// polls eagerly before deciding whether to suspend at all.
+unsafe fn poll_from_cpp<F>(waker_data: *const u8, poll: F) -> u32
+where
+    F: FnOnce(&mut Context) -> u32,
+{
+    let waker = if waker_data.is_null() {
+        noop_waker()
+    } else {
+        Waker::from_raw(RawWaker::new(
+            waker_data as *const (),
+            &CXXASYNC_WAKER_VTABLE,
+        ))
+    };
 
     let result = panic::catch_unwind(AssertUnwindSafe(move || {
         let mut context = Context::from_waker(&waker);
-        match this.poll(&mut context) {
-            Poll::Ready(Ok(value)) => {
-                ptr::write(result as *mut Out, value);
-                FUTURE_STATUS_COMPLETE
-            }
-            Poll::Ready(Err(error)) => {
-                let error = error.what().to_owned();
-                ptr::write(result as *mut String, error);
-                FUTURE_STATUS_ERROR
-            }
-            Poll::Pending => FUTURE_STATUS_PENDING,
-        }
+        poll(&mut context)
     }));
 
     match result {
@@ -869,6 +1183,7 @@ where
 // * This is a low-level function called by our C++ code.
 #[doc(hidden)]
 pub unsafe extern "C" fn future_drop<Fut>(future: *mut Fut) {
+    trace_event!(Drop, trace::handle_id(future));
     ptr::drop_in_place(future);
 }
 
@@ -907,6 +1222,7 @@ unsafe fn rust_suspended_coroutine_drop(address: *const ()) {
 // they should import the `futures` crate directly.
 #[doc(hidden)]
 pub mod private {
-    pub use futures::future::BoxFuture;
-    pub use futures::stream::BoxStream;
+    pub use crate::boxed::CxxAsyncBoxFuture;
+    pub use crate::boxed::CxxAsyncBoxStream;
+    pub use crate::CxxAsyncNextReceiver;
 }
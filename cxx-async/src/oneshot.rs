@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ *
+ * This source code is licensed under both the MIT license found in the
+ * LICENSE-MIT file in the root directory of this source tree and the Apache
+ * License, Version 2.0 found in the LICENSE-APACHE file in the root directory
+ * of this source tree.
+ */
+
+// cxx-async/src/oneshot.rs
+//
+// A lock-free channel that carries the single result of a C++ coroutine over to the Rust future
+// that wraps it.
+//
+// One-shot coroutines are by far the common case, and they only ever have one value and one waiter,
+// so they don't need the generality (or the mutex) of `SpscChannel`. Sending costs one atomic store
+// plus the two read-modify-writes in `AtomicWaker::wake()`.
+
+use crate::CxxAsyncResult;
+use futures::task::AtomicWaker;
+use std::cell::UnsafeCell;
+use std::sync::atomic::AtomicU8;
+use std::sync::atomic::Ordering;
+use std::task::Context;
+use std::task::Poll;
+
+// Nothing has been sent yet.
+const STATE_EMPTY: u8 = 0;
+// The sending end has stored a value that the receiving end hasn't taken yet.
+const STATE_FULL: u8 = 1;
+// The receiving end has taken the value.
+const STATE_TAKEN: u8 = 2;
+
+// The shared state of a one-shot channel. This lives in the channel block of the C++ coroutine
+// that it belongs to, which both the sending end and the receiving end hold references to.
+pub(crate) struct Oneshot<T> {
+    // One of the `STATE_` constants above.
+    state: AtomicU8,
+    // The task waiting on the value, if any.
+    waker: AtomicWaker,
+    // The value, once sent.
+    //
+    // The sending end has exclusive access to this while the state is `STATE_EMPTY`, and the
+    // receiving end has exclusive access to it afterward.
+    value: UnsafeCell<Option<CxxAsyncResult<T>>>,
+}
+
+unsafe impl<T> Send for Oneshot<T> where T: Send {}
+unsafe impl<T> Sync for Oneshot<T> where T: Send {}
+
+impl<T> Oneshot<T> {
+    // Creates a new, empty one-shot channel.
+    pub(crate) fn new() -> Oneshot<T> {
+        Oneshot {
+            state: AtomicU8::new(STATE_EMPTY),
+            waker: AtomicWaker::new(),
+            value: UnsafeCell::new(None),
+        }
+    }
+
+    // Sends the result and wakes up the receiving end. Only the sending end may call this, and only
+    // once.
+    pub(crate) fn send(&self, value: CxxAsyncResult<T>) {
+        safe_debug_assert!(self.state.load(Ordering::Relaxed) == STATE_EMPTY);
+        unsafe {
+            *self.value.get() = Some(value);
+        }
+        self.state.store(STATE_FULL, Ordering::Release);
+        self.waker.wake();
+    }
+
+    // Attempts to receive the result. Returns `Poll::Pending` and registers the current task to be
+    // woken up if the result hasn't been sent yet.
+    pub(crate) fn recv(&self, cx: &Context) -> Poll<CxxAsyncResult<T>> {
+        if let Some(value) = self.try_recv() {
+            return Poll::Ready(value);
+        }
+
+        // Check again after registering, in case the value was sent in between.
+        self.waker.register(cx.waker());
+        match self.try_recv() {
+            Some(value) => Poll::Ready(value),
+            None => Poll::Pending,
+        }
+    }
+
+    fn try_recv(&self) -> Option<CxxAsyncResult<T>> {
+        match self.state.load(Ordering::Acquire) {
+            STATE_EMPTY => None,
+            STATE_FULL => {
+                self.state.store(STATE_TAKEN, Ordering::Relaxed);
+                unsafe { (*self.value.get()).take() }
+            }
+            _ => {
+                // This should never happen, because a future should never be polled again after
+                // returning `Ready`.
+                safe_panic!("Attempted to poll a completed future!")
+            }
+        }
+    }
+
+    // Wakes up the receiving end, if it's waiting, without sending anything.
+    pub(crate) fn wake(&self) {
+        self.waker.wake();
+    }
+
+    // Returns true if the sending end has sent its result.
+    pub(crate) fn is_complete(&self) -> bool {
+        self.state.load(Ordering::Acquire) != STATE_EMPTY
+    }
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ *
+ * This source code is licensed under both the MIT license found in the
+ * LICENSE-MIT file in the root directory of this source tree and the Apache
+ * License, Version 2.0 found in the LICENSE-APACHE file in the root directory
+ * of this source tree.
+ */
+
+// cxx-async/src/trace.rs
+//
+// Per-future lifecycle tracing, enabled by the `tracing` feature.
+//
+// Rust reports the points in a bridged future's life that it sees (creation, polls, sends, and
+// drops) to the `tracing` crate. C++ reports the ones that it sees (wakeups and resumptions) to a
+// callback; see `rust::async::Tracing` in `cxx_async.h`. Both sides identify a future by the
+// address of the state behind its handle and stamp events with the same monotonic clock, so the
+// two streams can be merged to see how long a future spent queued versus running.
+
+use tracing::Level;
+
+extern "C" {
+    fn cxxasync_trace_now() -> u64;
+    fn cxxasync_trace_set_callback(callback: Option<extern "C" fn(&CxxTraceEvent)>);
+}
+
+// The points in a future's life that are traced. This must match `TraceEventKind` in
+// `cxx_async.h`.
+#[derive(Clone, Copy)]
+#[repr(u32)]
+pub(crate) enum TraceEventKind {
+    Create = 0,
+    Poll = 1,
+    Wake = 2,
+    Resume = 3,
+    Send = 4,
+    Drop = 5,
+}
+
+impl TraceEventKind {
+    fn from_raw(kind: u32) -> Option<TraceEventKind> {
+        match kind {
+            0 => Some(TraceEventKind::Create),
+            1 => Some(TraceEventKind::Poll),
+            2 => Some(TraceEventKind::Wake),
+            3 => Some(TraceEventKind::Resume),
+            4 => Some(TraceEventKind::Send),
+            5 => Some(TraceEventKind::Drop),
+            _ => None,
+        }
+    }
+
+    fn name(self) -> &'static str {
+        match self {
+            TraceEventKind::Create => "create",
+            TraceEventKind::Poll => "poll",
+            TraceEventKind::Wake => "wake",
+            TraceEventKind::Resume => "resume",
+            TraceEventKind::Send => "send",
+            TraceEventKind::Drop => "drop",
+        }
+    }
+}
+
+// An event reported by C++. This must match `TraceEvent` in `cxx_async.h`.
+#[repr(C)]
+struct CxxTraceEvent {
+    kind: u32,
+    future_id: u64,
+    timestamp_ns: u64,
+}
+
+// Returns the ID of a bridged future or stream, given a pointer to its handle. The handles that
+// the `bridge` macro defines are transparent wrappers around a type-erased box, whose first word
+// is the address of the state behind it: the channel block for a C++ coroutine, or the boxed
+// future for a Rust one.
+pub(crate) unsafe fn handle_id<T>(handle: *const T) -> u64 {
+    *(handle as *const usize) as u64
+}
+
+// Reports an event that happened on the Rust side. Use the `trace_event!` macro instead of calling
+// this directly, so that nothing is left behind when the feature is off.
+pub(crate) fn emit(kind: TraceEventKind, future_id: u64) {
+    tracing::event!(
+        target: "cxx_async",
+        Level::TRACE,
+        future_id,
+        timestamp_ns = unsafe { cxxasync_trace_now() },
+        side = "rust",
+        "{}",
+        kind.name()
+    );
+}
+
+extern "C" fn emit_cpp_event(event: &CxxTraceEvent) {
+    let kind = match TraceEventKind::from_raw(event.kind) {
+        Some(kind) => kind,
+        None => return,
+    };
+    tracing::event!(
+        target: "cxx_async",
+        Level::TRACE,
+        future_id = event.future_id,
+        timestamp_ns = event.timestamp_ns,
+        side = "cpp",
+        "{}",
+        kind.name()
+    );
+}
+
+/// Sends the trace events that C++ reports (wakeups and resumptions) to the `tracing` crate as
+/// well, so that every event in a future's life shows up in one place.
+///
+/// This replaces any callback that C++ code has installed with `rust::async::Tracing`.
+pub fn forward_cpp_trace_events() {
+    unsafe { cxxasync_trace_set_callback(Some(emit_cpp_event)) }
+}
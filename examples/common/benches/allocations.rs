@@ -0,0 +1,235 @@
+// cxx-async/examples/common/benches/allocations.rs
+//
+// Counts the allocations that each bridged operation makes, instead of timing it. Rust allocations
+// are counted by a global allocator installed here, and C++ allocations by the replacement
+// `operator new` in `common/src/counting_new.cpp`, which the build scripts link in when the
+// `count-allocations` feature is on. Each operation is checked against per-operation limits on
+// both heaps, and the benchmark exits with a failure status if any of them is exceeded, so that
+// allocation regressions on the hot paths show up as failures rather than as slightly slower
+// numbers.
+
+use crate::harness::{Backend, READY_FUTURES_PER_ITER};
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::process;
+use std::sync::atomic::{AtomicU64, Ordering};
+
+// How many times each operation runs. One extra run comes first and isn't counted, so that
+// one-time setup like thread-local pools and lazily created statics doesn't count against it.
+const RUNS: u32 = 1000;
+
+static RUST_ALLOCATIONS: AtomicU64 = AtomicU64::new(0);
+static RUST_ALLOCATED_BYTES: AtomicU64 = AtomicU64::new(0);
+
+struct CountingAllocator;
+
+impl CountingAllocator {
+    fn count(size: usize) {
+        RUST_ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        RUST_ALLOCATED_BYTES.fetch_add(size as u64, Ordering::Relaxed);
+    }
+}
+
+unsafe impl GlobalAlloc for CountingAllocator {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        CountingAllocator::count(layout.size());
+        System.alloc(layout)
+    }
+
+    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+        CountingAllocator::count(layout.size());
+        System.alloc_zeroed(layout)
+    }
+
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout)
+    }
+
+    // A reallocation may well move the block, so it counts as a fresh allocation.
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        CountingAllocator::count(new_size);
+        System.realloc(ptr, layout, new_size)
+    }
+}
+
+#[global_allocator]
+static ALLOCATOR: CountingAllocator = CountingAllocator;
+
+extern "C" {
+    fn cxx_async_example_cpp_allocations() -> u64;
+    fn cxx_async_example_cpp_allocated_bytes() -> u64;
+}
+
+// The most that one operation may allocate on each heap, averaged over all the runs.
+#[derive(Clone, Copy)]
+pub struct Limit {
+    pub rust_allocations: f64,
+    pub rust_bytes: f64,
+    pub cpp_allocations: f64,
+    pub cpp_bytes: f64,
+}
+
+// The limits for the operations that every backend supports.
+pub struct Limits {
+    // Per call from Rust to a C++ coroutine that finishes without suspending.
+    pub rust_calls_cpp: Limit,
+    // Per `co_await` of a Rust future that's already finished.
+    pub co_await: Limit,
+    // Per item yielded by a C++ stream.
+    pub co_yield: Limit,
+}
+
+// Running totals for both heaps.
+#[derive(Clone, Copy)]
+struct Counts {
+    rust_allocations: u64,
+    rust_bytes: u64,
+    cpp_allocations: u64,
+    cpp_bytes: u64,
+}
+
+impl Counts {
+    fn now() -> Counts {
+        unsafe {
+            Counts {
+                rust_allocations: RUST_ALLOCATIONS.load(Ordering::SeqCst),
+                rust_bytes: RUST_ALLOCATED_BYTES.load(Ordering::SeqCst),
+                cpp_allocations: cxx_async_example_cpp_allocations(),
+                cpp_bytes: cxx_async_example_cpp_allocated_bytes(),
+            }
+        }
+    }
+
+    fn since(self, earlier: Counts) -> Counts {
+        Counts {
+            rust_allocations: self.rust_allocations - earlier.rust_allocations,
+            rust_bytes: self.rust_bytes - earlier.rust_bytes,
+            cpp_allocations: self.cpp_allocations - earlier.cpp_allocations,
+            cpp_bytes: self.cpp_bytes - earlier.cpp_bytes,
+        }
+    }
+}
+
+// Measures operations and remembers which of them went over their limits.
+pub struct Checker {
+    name: &'static str,
+    exceeded: Vec<String>,
+}
+
+impl Checker {
+    pub fn new(name: &'static str) -> Checker {
+        Checker {
+            name,
+            exceeded: vec![],
+        }
+    }
+
+    // Checks the operations that every backend supports.
+    pub fn check_backend<B>(&mut self, backend: &B, limits: &Limits)
+    where
+        B: Backend,
+    {
+        self.check(
+            "rust_calls_cpp",
+            &limits.rust_calls_cpp,
+            || {},
+            || {
+                backend.rust_awaits_ready_cpp();
+                1
+            },
+        );
+        // The coroutine that does the awaiting costs something too, so take that out.
+        self.check(
+            "co_await",
+            &limits.co_await,
+            || backend.cpp_awaits_ready_rust(0),
+            || {
+                backend.cpp_awaits_ready_rust(READY_FUTURES_PER_ITER);
+                READY_FUTURES_PER_ITER as u64
+            },
+        );
+        self.check(
+            "co_yield",
+            &limits.co_yield,
+            || {},
+            || backend.fizzbuzz() as u64,
+        );
+    }
+
+    // Runs `run`, which returns how many operations it performed, and checks the allocations it
+    // made per operation against `limit`. Whatever `overhead` allocates is subtracted first, so
+    // it should do everything that `run` does except for the operations themselves.
+    pub fn check<O, F>(&mut self, what: &str, limit: &Limit, mut overhead: O, mut run: F)
+    where
+        O: FnMut(),
+        F: FnMut() -> u64,
+    {
+        overhead();
+        run();
+
+        let before = Counts::now();
+        for _ in 0..RUNS {
+            overhead();
+        }
+        let overhead_counts = Counts::now().since(before);
+
+        let before = Counts::now();
+        let mut operations = 0;
+        for _ in 0..RUNS {
+            operations += run();
+        }
+        let counts = Counts::now().since(before);
+
+        let per_operation =
+            |count: u64, overhead: u64| (count as f64 - overhead as f64) / operations as f64;
+        let measured = Limit {
+            rust_allocations: per_operation(
+                counts.rust_allocations,
+                overhead_counts.rust_allocations,
+            ),
+            rust_bytes: per_operation(counts.rust_bytes, overhead_counts.rust_bytes),
+            cpp_allocations: per_operation(counts.cpp_allocations, overhead_counts.cpp_allocations),
+            cpp_bytes: per_operation(counts.cpp_bytes, overhead_counts.cpp_bytes),
+        };
+        println!(
+            "{}/{}: {:.2} Rust allocations ({:.1} bytes), {:.2} C++ allocations ({:.1} bytes)",
+            self.name,
+            what,
+            measured.rust_allocations,
+            measured.rust_bytes,
+            measured.cpp_allocations,
+            measured.cpp_bytes,
+        );
+
+        for (heap, measured, limit) in [
+            (
+                "Rust allocations",
+                measured.rust_allocations,
+                limit.rust_allocations,
+            ),
+            ("Rust bytes", measured.rust_bytes, limit.rust_bytes),
+            (
+                "C++ allocations",
+                measured.cpp_allocations,
+                limit.cpp_allocations,
+            ),
+            ("C++ bytes", measured.cpp_bytes, limit.cpp_bytes),
+        ] {
+            // Leave a little room for rounding, since limits like 17 allocations per 15 items
+            // aren't exact in floating point.
+            if measured > limit + 1e-9 {
+                self.exceeded.push(format!(
+                    "{}/{} {} ({:.2} > {})",
+                    self.name, what, heap, measured, limit
+                ));
+            }
+        }
+    }
+
+    // Exits with a failure status if any operation went over its limits.
+    pub fn finish(self) {
+        if !self.exceeded.is_empty() {
+            eprintln!("over the allocation limits: {}", self.exceeded.join(", "));
+            process::exit(1);
+        }
+    }
+}
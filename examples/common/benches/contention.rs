@@ -0,0 +1,110 @@
+// cxx-async/examples/common/benches/contention.rs
+//
+// Runs thousands of bridged futures and streams at once on thread pools of increasing size, to see
+// where wakeups across the language boundary stop scaling. At each size, the Rust pool and the
+// backend's C++ pool get the same number of threads. This reports throughput and completion latency
+// percentiles, where the round-trip benchmarks only report means.
+
+use crate::harness::Backend;
+use futures::executor::{self, ThreadPool};
+use futures::future;
+use futures::task::SpawnExt;
+use std::future::Future;
+use std::time::{Duration, Instant};
+
+const THREAD_COUNTS: [u32; 7] = [1, 2, 4, 8, 16, 32, 64];
+
+// How many futures or streams are in flight at once in each run.
+const FUTURES_PER_RUN: u32 = 4096;
+const STREAMS_PER_RUN: u32 = 512;
+
+// The outcome of one run.
+struct Run {
+    elapsed: Duration,
+    // How many futures finished or stream items arrived over the whole run.
+    operations: usize,
+    // How long each future or stream took to finish, from the moment it started.
+    latencies: Vec<Duration>,
+}
+
+pub fn run_contention<B>(name: &str, backend: B)
+where
+    B: Backend + Copy + Send + Sync + 'static,
+{
+    println!(
+        "{:<36} {:>14} {:>12} {:>12} {:>12}",
+        "benchmark", "ops/s", "p50 (us)", "p99 (us)", "p999 (us)"
+    );
+
+    for &threads in &THREAD_COUNTS {
+        backend.set_contention_threads(threads);
+        let pool = ThreadPool::builder()
+            .pool_size(threads as usize)
+            .create()
+            .unwrap();
+
+        // Rust awaiting C++ coroutines that the C++ pool finishes.
+        let run = spawn_all(&pool, FUTURES_PER_RUN, move || async move {
+            backend.contended_future().await;
+            1
+        });
+        report(name, "rust_awaits_cpp", threads, run);
+
+        // Rust draining C++ streams that the C++ pool fills.
+        let run = spawn_all(&pool, STREAMS_PER_RUN, move || backend.contended_stream());
+        report(name, "rust_drains_cpp_streams", threads, run);
+
+        // C++ awaiting Rust futures that the Rust pool finishes.
+        let start = Instant::now();
+        let latencies = backend.cpp_awaits_contended_rust(&pool, FUTURES_PER_RUN);
+        let run = Run {
+            elapsed: start.elapsed(),
+            operations: latencies.len(),
+            latencies: latencies.into_iter().map(Duration::from_nanos).collect(),
+        };
+        report(name, "cpp_awaits_rust", threads, run);
+    }
+}
+
+// Spawns `tasks` futures made by `task` onto `pool` all at once, and waits for all of them. Each
+// future resolves to how many operations it performed.
+fn spawn_all<F, Fut>(pool: &ThreadPool, tasks: u32, task: F) -> Run
+where
+    F: Fn() -> Fut + Copy + Send + 'static,
+    Fut: Future<Output = usize> + Send + 'static,
+{
+    let start = Instant::now();
+    let handles: Vec<_> = (0..tasks)
+        .map(|_| {
+            pool.spawn_with_handle(async move {
+                let start = Instant::now();
+                let operations = task().await;
+                (operations, start.elapsed())
+            })
+            .unwrap()
+        })
+        .collect();
+    let results = executor::block_on(future::join_all(handles));
+
+    Run {
+        elapsed: start.elapsed(),
+        operations: results.iter().map(|&(operations, _)| operations).sum(),
+        latencies: results.into_iter().map(|(_, latency)| latency).collect(),
+    }
+}
+
+fn report(name: &str, what: &str, threads: u32, mut run: Run) {
+    run.latencies.sort_unstable();
+    let percentile = |fraction: f64| {
+        let index = ((run.latencies.len() - 1) as f64 * fraction).round() as usize;
+        run.latencies[index].as_secs_f64() * 1_000_000.0
+    };
+    println!(
+        "{:<36} {:>14.0} {:>12.1} {:>12.1} {:>12.1}",
+        format!("{}/{}/{}", name, what, threads),
+        run.operations as f64 / run.elapsed.as_secs_f64(),
+        percentile(0.5),
+        percentile(0.99),
+        percentile(0.999),
+    );
+}
@@ -0,0 +1,259 @@
+// cxx-async/examples/common/benches/harness.rs
+//
+// Benchmarks shared between the examples, so that every backend is measured the same way. Each
+// example's bench target implements `Backend` on top of its own bridge and hands it to
+// `bench_backend()`.
+//
+// This is a plain timing loop rather than a benchmarking framework, so that the benchmarks don't
+// pull any dependencies into the workspace. It still reports how much the timings spread, and can
+// save a run as a named baseline and compare later runs against it:
+//
+//      cargo bench --bench round_trip -- --save-baseline before
+//      cargo bench --bench round_trip -- --baseline before
+
+use futures::executor::ThreadPool;
+use futures::future::BoxFuture;
+use std::collections::HashMap;
+use std::env;
+use std::fs;
+use std::hint;
+use std::path::PathBuf;
+use std::time::{Duration, Instant};
+
+// How many ready Rust futures C++ awaits per iteration. Awaiting a batch of them inside one
+// blocking wait keeps the cost of the wait itself out of the per-future numbers.
+pub const READY_FUTURES_PER_ITER: u32 = 64;
+
+// The examples' ping-pong chains stop once they reach index 4, so a chain starting at
+// `PING_PONG_END - depth` crosses the language boundary `depth` times in each direction.
+const PING_PONG_END: i32 = 5;
+
+// How long each benchmark runs before measuring starts, and how long it's measured for.
+const WARM_UP_TIME: Duration = Duration::from_millis(500);
+const MEASUREMENT_TIME: Duration = Duration::from_secs(3);
+
+// How many iterations run between looks at the clock, so that reading it stays out of the numbers.
+const ITERATIONS_PER_BATCH: u64 = 16;
+
+pub trait Backend {
+    // Blocks on a C++ coroutine that finishes without ever suspending.
+    fn rust_awaits_ready_cpp(&self);
+    // Has C++ await `count` Rust futures, one after another, that are already finished.
+    fn cpp_awaits_ready_rust(&self, count: u32);
+    // Blocks on a ping-pong chain between Rust and C++ starting at index `start`.
+    fn ping_pong(&self, start: i32) -> String;
+    // Drains a FizzBuzz stream produced by C++ and returns how many items it yielded.
+    fn fizzbuzz(&self) -> usize;
+
+    // Replaces the C++ thread pool that the contended operations below finish on.
+    fn set_contention_threads(&self, threads: u32);
+    // Calls a C++ coroutine that moves onto the C++ pool and finishes there.
+    fn contended_future(&self) -> BoxFuture<'static, ()>;
+    // Drains a C++ stream that moves onto the C++ pool and yields from there, and resolves to how
+    // many items it yielded.
+    fn contended_stream(&self) -> BoxFuture<'static, usize>;
+    // Has `tasks` coroutines on the C++ pool each await a Rust future that finishes on `pool`.
+    // Returns how long each of them waited, in nanoseconds.
+    fn cpp_awaits_contended_rust(&self, pool: &ThreadPool, tasks: u32) -> Vec<u64>;
+}
+
+pub fn bench_backend<B>(name: &str, backend: &B)
+where
+    B: Backend,
+{
+    let mut baselines = Baselines::from_args();
+    println!(
+        "{:<36} {:>14} {:>10} {:>16} {:>9}",
+        "benchmark", "ns/iter", "±", "elements/s", "change"
+    );
+
+    bench(
+        &mut baselines,
+        &format!("{}/ready/rust_awaits_cpp", name),
+        1,
+        || backend.rust_awaits_ready_cpp(),
+    );
+    bench(
+        &mut baselines,
+        &format!("{}/ready/cpp_awaits_rust", name),
+        READY_FUTURES_PER_ITER as u64,
+        || backend.cpp_awaits_ready_rust(READY_FUTURES_PER_ITER),
+    );
+
+    for depth in 1..=PING_PONG_END {
+        bench(
+            &mut baselines,
+            &format!("{}/ping_pong/{}", name, depth),
+            depth as u64,
+            || {
+                hint::black_box(backend.ping_pong(PING_PONG_END - depth));
+            },
+        );
+    }
+
+    bench(
+        &mut baselines,
+        &format!("{}/stream/fizzbuzz", name),
+        backend.fizzbuzz() as u64,
+        || {
+            hint::black_box(backend.fizzbuzz());
+        },
+    );
+
+    baselines.save();
+}
+
+// The typical time per iteration of a benchmark, in nanoseconds: the median over all batches, and
+// the median distance of a batch from that.
+#[derive(Clone, Copy)]
+struct Measurement {
+    median: f64,
+    spread: f64,
+}
+
+// The baseline that this run is compared against, if any, and the one it's saved as, if any. Each
+// baseline is a file of `benchmark median spread` lines in `target/<profile>/bench-baselines`,
+// next to the benchmark binaries.
+struct Baselines {
+    compare_to: HashMap<String, Measurement>,
+    save_to: Option<PathBuf>,
+    measured: Vec<(String, Measurement)>,
+}
+
+impl Baselines {
+    fn from_args() -> Baselines {
+        let mut baselines = Baselines {
+            compare_to: HashMap::new(),
+            save_to: None,
+            measured: vec![],
+        };
+        // Cargo passes other flags, such as `--bench`, which we ignore.
+        let mut args = env::args().skip(1);
+        while let Some(arg) = args.next() {
+            match &*arg {
+                "--baseline" => {
+                    let path = baseline_path(&args.next().expect("`--baseline` needs a name"));
+                    let contents = fs::read_to_string(&path)
+                        .unwrap_or_else(|err| panic!("can't read {}: {}", path.display(), err));
+                    for line in contents.lines() {
+                        let fields: Vec<&str> = line.split(' ').collect();
+                        if let [name, median, spread] = fields[..] {
+                            let measurement = Measurement {
+                                median: median.parse().unwrap(),
+                                spread: spread.parse().unwrap(),
+                            };
+                            baselines.compare_to.insert(name.to_owned(), measurement);
+                        }
+                    }
+                }
+                "--save-baseline" => {
+                    let name = args.next().expect("`--save-baseline` needs a name");
+                    baselines.save_to = Some(baseline_path(&name));
+                }
+                _ => {}
+            }
+        }
+        baselines
+    }
+
+    // Describes how `measurement` differs from the baseline's measurement of `name`. A change no
+    // bigger than the two spreads put together is reported as noise.
+    fn compare(&self, name: &str, measurement: Measurement) -> String {
+        let baseline = match self.compare_to.get(name) {
+            None => return "".to_owned(),
+            Some(baseline) => baseline,
+        };
+        let change = (measurement.median - baseline.median) / baseline.median;
+        let noise = (measurement.spread + baseline.spread) / baseline.median;
+        let verdict = if change.abs() <= noise {
+            "(noise)"
+        } else if change > 0.0 {
+            "regressed"
+        } else {
+            "improved"
+        };
+        format!("{:>+8.1}% {}", change * 100.0, verdict)
+    }
+
+    fn save(&self) {
+        let path = match self.save_to {
+            None => return,
+            Some(ref path) => path,
+        };
+        let contents: String = self
+            .measured
+            .iter()
+            .map(|(name, measurement)| {
+                format!("{} {} {}\n", name, measurement.median, measurement.spread)
+            })
+            .collect();
+        fs::create_dir_all(path.parent().unwrap()).unwrap();
+        fs::write(path, contents)
+            .unwrap_or_else(|err| panic!("can't write {}: {}", path.display(), err));
+        println!("saved baseline {}", path.display());
+    }
+}
+
+fn baseline_path(name: &str) -> PathBuf {
+    // The benchmark binary lives in `target/<profile>/deps`.
+    let exe = env::current_exe().unwrap();
+    exe.parent()
+        .and_then(|deps| deps.parent())
+        .unwrap()
+        .join("bench-baselines")
+        .join(name)
+}
+
+fn median(values: &mut [f64]) -> f64 {
+    values.sort_by(|a, b| a.partial_cmp(b).unwrap());
+    let mid = values.len() / 2;
+    if values.len() % 2 == 0 {
+        (values[mid - 1] + values[mid]) / 2.0
+    } else {
+        values[mid]
+    }
+}
+
+// Runs `run` repeatedly, first to warm up and then for real, and reports the typical time per call
+// and how much it varies. Each call processes `elements` elements, which gives the throughput.
+fn bench<F>(baselines: &mut Baselines, name: &str, elements: u64, mut run: F)
+where
+    F: FnMut(),
+{
+    let start = Instant::now();
+    while start.elapsed() < WARM_UP_TIME {
+        run();
+    }
+
+    // The time per iteration of each batch.
+    let mut samples = vec![];
+    let start = Instant::now();
+    while start.elapsed() < MEASUREMENT_TIME {
+        let batch_start = Instant::now();
+        for _ in 0..ITERATIONS_PER_BATCH {
+            run();
+        }
+        let batch_elapsed = batch_start.elapsed().as_nanos() as f64;
+        samples.push(batch_elapsed / ITERATIONS_PER_BATCH as f64);
+    }
+
+    let center = median(&mut samples);
+    let mut deviations: Vec<f64> = samples
+        .iter()
+        .map(|sample| (sample - center).abs())
+        .collect();
+    let measurement = Measurement {
+        median: center,
+        spread: median(&mut deviations),
+    };
+
+    println!(
+        "{:<36} {:>14.1} {:>10.1} {:>16.0} {}",
+        name,
+        measurement.median,
+        measurement.spread,
+        elements as f64 * 1_000_000_000.0 / measurement.median,
+        baselines.compare(name, measurement),
+    );
+    baselines.measured.push((name.to_owned(), measurement));
+}
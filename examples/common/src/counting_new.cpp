@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) Meta Platforms, Inc. and affiliates.
+ *
+ * This source code is licensed under both the MIT license found in the
+ * LICENSE-MIT file in the root directory of this source tree and the Apache
+ * License, Version 2.0 found in the LICENSE-APACHE file in the root directory
+ * of this source tree.
+ */
+
+// cxx-async/examples/common/src/counting_new.cpp
+//
+// Replaces the global `operator new` and `operator delete` with versions that
+// count allocations, so that the allocation benchmarks can see the C++ heap as
+// well as the Rust one. The build scripts only compile this in when the
+// `count-allocations` feature is on.
+//
+// The aligned and nothrow forms are left alone. The standard library builds
+// the nothrow forms on top of these, and nothing in the bridge allocates with
+// extended alignment.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<uint64_t> g_allocations{0};
+static std::atomic<uint64_t> g_allocated_bytes{0};
+
+static void* counted_alloc(std::size_t size) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  g_allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+  // `malloc(0)` may return null, but `operator new` must not.
+  void* ptr = std::malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void* operator new(std::size_t size) {
+  return counted_alloc(size);
+}
+
+void* operator new[](std::size_t size) {
+  return counted_alloc(size);
+}
+
+void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+  std::free(ptr);
+}
+
+extern "C" uint64_t cxx_async_example_cpp_allocations() {
+  return g_allocations.load();
+}
+
+extern "C" uint64_t cxx_async_example_cpp_allocated_bytes() {
+  return g_allocated_bytes.load();
+}
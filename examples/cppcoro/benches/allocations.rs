@@ -0,0 +1,86 @@
+// cxx-async/examples/cppcoro/benches/allocations.rs
+//
+//! Counts the allocations that round trips between Rust and `cppcoro` coroutines make, and fails
+//! if any of them goes over its limit. Run with
+//! `cargo bench --features count-allocations --bench allocations`.
+
+#[path = "../../common/benches/allocations.rs"]
+mod allocations;
+mod backend;
+#[allow(dead_code)]
+#[path = "../../common/benches/harness.rs"]
+mod harness;
+
+use allocations::{Checker, Limit, Limits};
+use cxx_async_example_cppcoro::ffi;
+use futures::executor;
+use harness::READY_FUTURES_PER_ITER;
+
+// The Rust numbers are what 64-bit builds measure. C++ coroutine frames vary in size between
+// compilers, so the C++ byte limits leave some room.
+const LIMITS: Limits = Limits {
+    // The channel block on the Rust side and the coroutine frame on the C++ side.
+    rust_calls_cpp: Limit {
+        rust_allocations: 1.0,
+        rust_bytes: 136.0,
+        cpp_allocations: 1.0,
+        cpp_bytes: 160.0,
+    },
+    // `rust_ready()` boxes its future. `RustFutureVoid` is polled eagerly, so C++ never needs a
+    // receiver for it.
+    co_await: Limit {
+        rust_allocations: 1.0,
+        rust_bytes: 3.0,
+        cpp_allocations: 0.0,
+        cpp_bytes: 0.0,
+    },
+    // Per 15 items: the channel block, room for 4 items, and each item's string on the Rust side;
+    // the coroutine frame on the C++ side, plus a waker every time the coroutine finds the buffer
+    // full, which it does 11 times.
+    co_yield: Limit {
+        rust_allocations: 17.0 / 15.0,
+        rust_bytes: 307.0 / 15.0,
+        cpp_allocations: 12.0 / 15.0,
+        cpp_bytes: 96.0,
+    },
+};
+
+// The channel block and the string on the Rust side. The frame comes from the frame pool.
+const POOLED_RUST_CALLS_CPP: Limit = Limit {
+    rust_allocations: 2.0,
+    rust_bytes: 147.0,
+    cpp_allocations: 0.0,
+    cpp_bytes: 0.0,
+};
+
+// `rust_ready_f64()` boxes its future. The waker lives in the awaiter.
+const INLINE_WAKER_CO_AWAIT: Limit = Limit {
+    rust_allocations: 1.0,
+    rust_bytes: 40.0,
+    cpp_allocations: 0.0,
+    cpp_bytes: 0.0,
+};
+
+fn main() {
+    let mut checker = Checker::new("cppcoro");
+    checker.check_backend(&backend::Cppcoro, &LIMITS);
+    checker.check(
+        "rust_calls_pooled_cpp",
+        &POOLED_RUST_CALLS_CPP,
+        || {},
+        || {
+            executor::block_on(ffi::cppcoro_get_namespaced_string()).unwrap();
+            1
+        },
+    );
+    checker.check(
+        "co_await_inline_waker",
+        &INLINE_WAKER_CO_AWAIT,
+        || ffi::cppcoro_call_rust_ready_f64(0),
+        || {
+            ffi::cppcoro_call_rust_ready_f64(READY_FUTURES_PER_ITER);
+            READY_FUTURES_PER_ITER as u64
+        },
+    );
+    checker.finish();
+}
@@ -0,0 +1,46 @@
+// cxx-async/examples/cppcoro/benches/backend/mod.rs
+//
+// The `cppcoro` side of the shared benchmarks.
+
+use crate::harness::Backend;
+use cxx_async_example_cppcoro::{ffi, ContentionPool};
+use futures::executor::{self, ThreadPool};
+use futures::future::BoxFuture;
+use futures::{FutureExt, StreamExt};
+
+#[derive(Clone, Copy)]
+pub struct Cppcoro;
+
+impl Backend for Cppcoro {
+    fn rust_awaits_ready_cpp(&self) {
+        executor::block_on(ffi::cppcoro_ready()).unwrap()
+    }
+
+    fn cpp_awaits_ready_rust(&self, count: u32) {
+        ffi::cppcoro_call_rust_ready(count)
+    }
+
+    fn ping_pong(&self, start: i32) -> String {
+        executor::block_on(ffi::cppcoro_ping_pong(start)).unwrap()
+    }
+
+    fn fizzbuzz(&self) -> usize {
+        executor::block_on(ffi::cppcoro_fizzbuzz().count())
+    }
+
+    fn set_contention_threads(&self, threads: u32) {
+        ffi::cppcoro_set_contention_threads(threads)
+    }
+
+    fn contended_future(&self) -> BoxFuture<'static, ()> {
+        ffi::cppcoro_contended_future().map(Result::unwrap).boxed()
+    }
+
+    fn contended_stream(&self) -> BoxFuture<'static, usize> {
+        ffi::cppcoro_contended_stream().count().boxed()
+    }
+
+    fn cpp_awaits_contended_rust(&self, pool: &ThreadPool, tasks: u32) -> Vec<u64> {
+        ffi::cppcoro_await_contended_rust(&ContentionPool(pool.clone()), tasks)
+    }
+}
@@ -0,0 +1,15 @@
+// cxx-async/examples/cppcoro/benches/contention.rs
+//
+//! Measures how wakeups between Rust and `cppcoro` scale as both sides get more threads. Run with
+//! `cargo bench --bench contention`.
+
+mod backend;
+#[path = "../../common/benches/contention.rs"]
+mod contention;
+#[allow(dead_code)]
+#[path = "../../common/benches/harness.rs"]
+mod harness;
+
+fn main() {
+    contention::run_contention("cppcoro", backend::Cppcoro);
+}
@@ -0,0 +1,12 @@
+// cxx-async/examples/cppcoro/benches/round_trip.rs
+//
+//! Measures round trips between Rust and `cppcoro` coroutines.
+
+mod backend;
+#[allow(dead_code)]
+#[path = "../../common/benches/harness.rs"]
+mod harness;
+
+fn main() {
+    harness::bench_backend("cppcoro", &backend::Cppcoro);
+}
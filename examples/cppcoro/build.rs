@@ -1,6 +1,7 @@
 // cxx-async/examples/cppcoro/build.rs
 
 use pkg_config::Config;
+use std::env;
 
 fn main() {
     let cppcoro = Config::new().probe("cppcoro").unwrap();
@@ -8,13 +9,26 @@ fn main() {
     println!("cargo:rerun-if-changed=build.rs");
     println!("cargo:rerun-if-changed=include/cppcoro_example.h");
     println!("cargo:rerun-if-changed=src/cppcoro_example.cpp");
+    println!("cargo:rerun-if-changed=../common/src/counting_new.cpp");
 
-    cxx_build::bridge("src/main.rs")
+    let mut build = cxx_build::bridge("src/lib.rs");
+    build
         .file("src/cppcoro_example.cpp")
         .flag_if_supported("-Wall")
         .include("include")
         .include("../common/include")
         .include("../../cxx-async/include")
-        .includes(&cppcoro.include_paths)
-        .compile("cppcoro_example");
+        .includes(&cppcoro.include_paths);
+
+    // Match the layout that `cxx-async` was built with. See `rust::async::Tracing`.
+    if env::var_os("DEP_CXX_ASYNC_TRACING").is_some() {
+        build.define("CXXASYNC_TRACING", None);
+    }
+
+    // Count allocations on the C++ heap for the `allocations` benchmark.
+    if env::var_os("CARGO_FEATURE_COUNT_ALLOCATIONS").is_some() {
+        build.file("../common/src/counting_new.cpp");
+    }
+
+    build.compile("cppcoro_example");
 }
@@ -21,6 +21,9 @@ CXXASYNC_DEFINE_FUTURE(rust::String, RustFutureString);
 CXXASYNC_DEFINE_FUTURE(rust::String, foo, bar, RustFutureStringNamespaced);
 CXXASYNC_DEFINE_STREAM(rust::String, RustStreamString);
 
+// Defined on the Rust side.
+struct ContentionPool;
+
 class MyException : public std::exception {
   const char* m_message;
 
@@ -50,25 +53,69 @@ struct TryCatch<T, Custom> {
   }
 };
 
+// Some of the Rust `f64` futures in this example, like `rust_not_product()`,
+// are finished by the time they're first polled, so we can await them without
+// allocating. The dot products finish on a thread pool, which keeps a clone of
+// the waker, so awaiting them allocates when Rust makes the clone instead.
+template <>
+struct InlineWaker<RustFutureF64, Custom> : std::true_type {};
+
+// `cppcoro_get_namespaced_string()` finishes as soon as it starts, so its
+// frames are a good fit for the frame pool.
+template <>
+struct PooledFrames<foo::bar::RustFutureStringNamespaced, Custom>
+    : std::true_type {};
+
+// `rust_hello()` is always finished by the time we await it, so there's no
+// point in suspending for it.
+template <>
+struct EagerPoll<RustFutureVoid, Custom> : std::true_type {};
+
 } // namespace behavior
 } // namespace async
 } // namespace rust
 
 RustFutureF64 cppcoro_dot_product();
 void cppcoro_call_rust_hello();
+uint64_t cppcoro_eager_poll_hits();
 double cppcoro_call_rust_dot_product();
 double cppcoro_schedule_rust_dot_product();
+double cppcoro_call_rust_dot_products_together();
+rust::String cppcoro_call_rust_not_product_together();
+double cppcoro_race_rust_dot_product();
+double cppcoro_race_rust_dot_products();
+bool cppcoro_race_no_rust_futures();
 foo::bar::RustFutureStringNamespaced cppcoro_get_namespaced_string();
+uint64_t cppcoro_frame_pool_hits();
 RustFutureF64 cppcoro_not_product();
 rust::String cppcoro_call_rust_not_product();
 RustFutureString cppcoro_ping_pong(int i);
+RustFutureString cppcoro_deep_ping_pong(int i);
 RustFutureVoid cppcoro_complete();
+RustFutureVoid cppcoro_ready();
+void cppcoro_call_rust_ready(uint32_t count);
+void cppcoro_call_rust_ready_f64(uint32_t count);
+void cppcoro_set_contention_threads(uint32_t threads);
+RustFutureVoid cppcoro_contended_future();
+RustStreamString cppcoro_contended_stream();
+rust::Vec<uint64_t> cppcoro_await_contended_rust(
+    const ContentionPool& pool,
+    uint32_t tasks);
 void cppcoro_send_to_dropped_future_go();
 RustFutureF64 cppcoro_send_to_dropped_future();
 RustStreamString cppcoro_fizzbuzz();
 RustStreamString cppcoro_indirect_fizzbuzz();
+RustStreamString cppcoro_batched_fizzbuzz();
+RustStreamString cppcoro_counted_fizzbuzz();
+uint32_t cppcoro_counted_fizzbuzz_yields();
 RustStreamString cppcoro_not_fizzbuzz();
+rust::String cppcoro_call_rust_fizzbuzz();
+rust::String cppcoro_call_rust_not_fizzbuzz();
 RustFutureVoid cppcoro_drop_coroutine_wait();
 RustFutureVoid cppcoro_drop_coroutine_signal();
+RustFutureVoid cppcoro_cancel_coroutine_wait();
+void cppcoro_cancel_coroutine_check();
+RustFutureVoid cppcoro_abandon_rust_future();
+RustFutureF64 cppcoro_await_escaping_waker();
 
 #endif // CXX_ASYNC_CPPCORO_EXAMPLE_H
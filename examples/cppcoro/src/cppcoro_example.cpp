@@ -13,13 +13,18 @@
 
 #include "cppcoro_example.h"
 #include <cppcoro/async_latch.hpp>
+#include <cppcoro/cancellation_registration.hpp>
+#include <cppcoro/cancellation_token.hpp>
 #include <cppcoro/fmap.hpp>
 #include <cppcoro/schedule_on.hpp>
 #include <cppcoro/static_thread_pool.hpp>
 #include <cppcoro/sync_wait.hpp>
 #include <cppcoro/task.hpp>
 #include <cppcoro/when_all.hpp>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
 #include <cstdlib>
 #include <exception>
 #include <functional>
@@ -32,8 +37,10 @@
 #include <thread>
 #include <tuple>
 #include <type_traits>
+#include <utility>
+#include <variant>
 #include <vector>
-#include "cxx-async-example-cppcoro/src/main.rs.h"
+#include "cxx-async-example-cppcoro/src/lib.rs.h"
 #include "example.h"
 #include "rust/cxx.h"
 #include "rust/cxx_async.h"
@@ -85,19 +92,105 @@ foo::bar::RustFutureStringNamespaced cppcoro_get_namespaced_string() {
   co_return rust::String("hello world");
 }
 
+uint64_t cppcoro_frame_pool_hits() {
+  return rust::async::FramePool::stats().hits;
+}
+
 void cppcoro_call_rust_hello() {
-  return cppcoro::sync_wait(rust_hello());
+  return rust::async::sync_wait(rust_hello());
+}
+
+uint64_t cppcoro_eager_poll_hits() {
+  return rust::async::EagerPollCounter::stats().hits;
 }
 
 double cppcoro_call_rust_dot_product() {
-  return cppcoro::sync_wait(rust_dot_product());
+  return rust::async::sync_wait(rust_dot_product());
 }
 
 double cppcoro_schedule_rust_dot_product() {
-  return cppcoro::sync_wait(
+  return rust::async::sync_wait(
       cppcoro::schedule_on(g_thread_pool, rust_dot_product()));
 }
 
+// Fans out to several Rust futures at once and returns their common result.
+static cppcoro::task<double> rust_dot_products_together() {
+  std::vector<RustFutureF64> futures;
+  for (size_t i = 0; i < 4; i++) {
+    futures.push_back(rust_dot_product());
+  }
+  std::vector<double> products =
+      co_await rust::async::when_all(std::move(futures));
+  auto [hello, product] =
+      co_await rust::async::when_all(rust_hello(), rust_dot_product());
+  for (double other : products) {
+    if (other != product) {
+      throw std::runtime_error("dot products differ");
+    }
+  }
+  co_return product;
+}
+
+double cppcoro_call_rust_dot_products_together() {
+  return rust::async::sync_wait(rust_dot_products_together());
+}
+
+rust::String cppcoro_call_rust_not_product_together() {
+  try {
+    rust::async::sync_wait(
+        rust::async::when_all(rust_dot_product(), rust_not_product()));
+    std::terminate();
+  } catch (const std::exception& error) {
+    return rust::String(error.what());
+  }
+}
+
+// Races a Rust future that never finishes against one that does. The loser is
+// dropped as soon as the winner is known.
+static cppcoro::task<double> race_rust_dot_product() {
+  std::variant<std::monostate, double> result = co_await rust::async::when_any(
+      rust_pending_until_dropped(), rust_dot_product());
+  if (result.index() != 1) {
+    throw std::runtime_error("the wrong future won");
+  }
+  co_return std::get<1>(result);
+}
+
+double cppcoro_race_rust_dot_product() {
+  return rust::async::sync_wait(race_rust_dot_product());
+}
+
+// Like `race_rust_dot_product()`, but races a vector, and checks that the
+// loser was dropped while the race is still alive.
+static cppcoro::task<double> race_rust_dot_products() {
+  std::vector<RustFutureF64> futures;
+  futures.push_back(rust_losing_dot_product());
+  futures.push_back(rust_dot_product());
+  auto race = rust::async::when_any(std::move(futures));
+  std::pair<size_t, double> result = co_await race;
+  if (result.first != 1) {
+    throw std::runtime_error("the wrong future won");
+  }
+  if (!rust_losing_dot_product_dropped()) {
+    throw std::runtime_error("the loser outlived the race");
+  }
+  co_return result.second;
+}
+
+double cppcoro_race_rust_dot_products() {
+  return rust::async::sync_wait(race_rust_dot_products());
+}
+
+// Returns true if racing no futures at all throws, as it should.
+bool cppcoro_race_no_rust_futures() {
+  try {
+    rust::async::when_any(std::vector<RustFutureF64>());
+  } catch (const std::invalid_argument&) {
+    return true;
+  }
+  return false;
+}
+
 RustFutureF64 cppcoro_not_product() {
   if (true)
     throw MyException("kaboom");
@@ -107,7 +200,7 @@ RustFutureF64 cppcoro_not_product() {
 rust::String cppcoro_call_rust_not_product() {
   try {
     RustFutureF64 oneshot_receiver = rust_not_product();
-    cppcoro::sync_wait(std::move(oneshot_receiver));
+    rust::async::sync_wait(std::move(oneshot_receiver));
     std::terminate();
   } catch (const std::exception& error) {
     return rust::String(error.what());
@@ -119,11 +212,89 @@ RustFutureString cppcoro_ping_pong(int i) {
   co_return std::move(string) + "pong ";
 }
 
+RustFutureString cppcoro_deep_ping_pong(int i) {
+  std::string string(co_await rust_cppcoro_deep_ping_pong(i));
+  co_return std::move(string) + "pong ";
+}
+
 RustFutureVoid cppcoro_complete() {
   co_await dot_product(); // Discard the result.
   co_return;
 }
 
+RustFutureVoid cppcoro_ready() {
+  co_return;
+}
+
+static cppcoro::task<void> await_rust_ready(uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    co_await rust_ready();
+  }
+}
+
+void cppcoro_call_rust_ready(uint32_t count) {
+  rust::async::sync_wait(await_rust_ready(count));
+}
+
+static cppcoro::task<double> await_rust_ready_f64(uint32_t count) {
+  double sum = 0.0;
+  for (uint32_t i = 0; i < count; i++) {
+    sum += co_await rust_ready_f64();
+  }
+  co_return sum;
+}
+
+void cppcoro_call_rust_ready_f64(uint32_t count) {
+  rust::async::sync_wait(await_rust_ready_f64(count));
+}
+
+// The pool that the contended coroutines below run on. Like `g_thread_pool`,
+// the last one is leaked.
+static cppcoro::static_thread_pool* g_contention_pool;
+
+void cppcoro_set_contention_threads(uint32_t threads) {
+  delete g_contention_pool;
+  g_contention_pool = new cppcoro::static_thread_pool(threads);
+}
+
+RustFutureVoid cppcoro_contended_future() {
+  co_await g_contention_pool->schedule();
+}
+
+RustStreamString cppcoro_contended_stream() {
+  co_await g_contention_pool->schedule();
+  for (int i = 0; i < 16; i++) {
+    co_yield rust::String(std::to_string(i));
+  }
+}
+
+// Returns how long the Rust future took to wake us up, in nanoseconds.
+static cppcoro::task<uint64_t> await_contended_rust(
+    const ContentionPool& pool) {
+  co_await g_contention_pool->schedule();
+  auto start = std::chrono::steady_clock::now();
+  co_await rust_contended_future(pool);
+  co_return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+rust::Vec<uint64_t> cppcoro_await_contended_rust(
+    const ContentionPool& pool,
+    uint32_t tasks) {
+  std::vector<cppcoro::task<uint64_t>> awaiting;
+  for (uint32_t i = 0; i < tasks; i++) {
+    awaiting.push_back(await_contended_rust(pool));
+  }
+
+  rust::Vec<uint64_t> latencies;
+  for (uint64_t latency :
+       rust::async::sync_wait(cppcoro::when_all(std::move(awaiting)))) {
+    latencies.push_back(latency);
+  }
+  return latencies;
+}
+
 // Intentionally leak this to avoid annoying data race issues on thread
 // destruction.
 static Sem* g_dropped_future_sem;
@@ -174,12 +345,70 @@ RustStreamString cppcoro_indirect_fizzbuzz() {
   co_return;
 }
 
+// Yields FizzBuzz in chunks, each of which crosses over to Rust in one go. The
+// chunks are bigger than the stream's buffer, which a batch is allowed to
+// overfill.
+RustStreamString cppcoro_batched_fizzbuzz() {
+  std::vector<rust::String> chunk;
+  for (int i = 1; i <= 15; i++) {
+    chunk.push_back(co_await fizzbuzz_inner(i));
+    if (chunk.size() == 6 || i == 15) {
+      co_yield rust::async::batch(std::move(chunk));
+      chunk.clear();
+    }
+  }
+  co_return;
+}
+
+// How many values `cppcoro_counted_fizzbuzz()` has started to yield, including
+// one that it may be suspended on.
+static std::atomic<uint32_t> g_counted_fizzbuzz_yields;
+
+RustStreamString cppcoro_counted_fizzbuzz() {
+  g_counted_fizzbuzz_yields = 0;
+  for (int i = 1; i <= 15; i++) {
+    rust::String value = co_await fizzbuzz_inner(i);
+    g_counted_fizzbuzz_yields++;
+    co_yield std::move(value);
+  }
+  co_return;
+}
+
+uint32_t cppcoro_counted_fizzbuzz_yields() {
+  return g_counted_fizzbuzz_yields;
+}
+
 RustStreamString cppcoro_not_fizzbuzz() {
   for (int i = 1; i <= 10; i++)
     co_yield co_await fizzbuzz_inner(i);
   throw MyException("kablam");
 }
 
+// Consumes a Rust stream one item at a time, joining the items with commas. If
+// the stream returns an error, the error message is appended after a colon.
+static cppcoro::task<rust::String> join_rust_stream(RustStreamString stream) {
+  std::string result;
+  try {
+    while (auto item = co_await stream.next()) {
+      if (!result.empty())
+        result += ", ";
+      result += std::string(*item);
+    }
+  } catch (const std::exception& error) {
+    result += ": ";
+    result += error.what();
+  }
+  co_return rust::String(result);
+}
+
+rust::String cppcoro_call_rust_fizzbuzz() {
+  return rust::async::sync_wait(join_rust_stream(rust_fizzbuzz()));
+}
+
+rust::String cppcoro_call_rust_not_fizzbuzz() {
+  return rust::async::sync_wait(join_rust_stream(rust_not_fizzbuzz()));
+}
+
 struct DestructorTest {
   cppcoro::async_latch m_latch;
   Sem m_sem;
@@ -216,3 +445,45 @@ RustFutureVoid cppcoro_drop_coroutine_signal() {
   g_destructor_test.m_sem.wait();
   co_return;
 }
+
+struct CancellationTest {
+  cppcoro::async_latch m_latch;
+  Sem m_sem;
+
+  CancellationTest() : m_latch(1), m_sem() {}
+};
+
+static CancellationTest g_cancellation_test;
+
+// Ensure that dropping a future cancels the coroutine behind it. The future
+// that this function returns is dropped right away, and then
+// `cppcoro_cancel_coroutine_check()` waits for the coroutine to notice.
+RustFutureVoid cppcoro_cancel_coroutine_wait() {
+  cppcoro::cancellation_token token =
+      co_await rust::async::cancellation_token();
+  cppcoro::cancellation_registration registration(
+      std::move(token), [] { g_cancellation_test.m_latch.count_down(); });
+  // This makes the coroutine hang until the future is dropped.
+  co_await g_cancellation_test.m_latch;
+  g_cancellation_test.m_sem.signal();
+  co_return;
+}
+
+void cppcoro_cancel_coroutine_check() {
+  g_cancellation_test.m_sem.wait();
+}
+
+// Awaits a Rust future that drops its waker without ever finishing. That leaves
+// nothing that could resume this coroutine, so it's destroyed while it's still
+// suspended, which must drop the Rust future right away.
+RustFutureVoid cppcoro_abandon_rust_future() {
+  co_await rust_pending_until_dropped();
+  co_return;
+}
+
+// Awaits a Rust future that keeps clones of its waker, which outlive this
+// coroutine. `RustFutureF64` has an inline waker, so they can't point into
+// the coroutine frame.
+RustFutureF64 cppcoro_await_escaping_waker() {
+  co_return co_await rust_escaping_waker();
+}
@@ -0,0 +1,322 @@
+// cxx-async/examples/cppcoro/src/lib.rs
+//
+//! The bridge between the `cppcoro` example's Rust and C++ halves, and the Rust functions that C++
+//! calls. The example binary, its tests, and the benchmarks all use this.
+
+use crate::ffi::StringNamespaced;
+use async_recursion::async_recursion;
+use cxx_async::CxxAsyncException;
+use futures::executor::ThreadPool;
+use futures::task::SpawnExt;
+use futures::{future, join, stream, Stream, StreamExt};
+use once_cell::sync::Lazy;
+use std::future::Future;
+use std::ops::Range;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::sync::Mutex;
+use std::task::{Poll, Waker};
+
+#[cxx::bridge]
+pub mod ffi {
+    #[derive(Debug, PartialEq)]
+    struct StringNamespaced {
+        namespaced_string: String,
+    }
+
+    extern "Rust" {
+        type ContentionPool;
+
+        fn rust_hello() -> RustFutureVoid;
+        fn rust_ready() -> RustFutureVoid;
+        fn rust_ready_f64() -> RustFutureF64;
+        fn rust_contended_future(pool: &ContentionPool) -> RustFutureVoid;
+        fn rust_dot_product() -> RustFutureF64;
+        fn rust_not_product() -> RustFutureF64;
+        fn rust_cppcoro_ping_pong(i: i32) -> RustFutureString;
+        fn rust_cppcoro_deep_ping_pong(i: i32) -> RustFutureString;
+        fn rust_fizzbuzz() -> RustStreamString;
+        fn rust_not_fizzbuzz() -> RustStreamString;
+        fn rust_pending_until_dropped() -> RustFutureVoid;
+        fn rust_losing_dot_product() -> RustFutureF64;
+        fn rust_losing_dot_product_dropped() -> bool;
+        fn rust_escaping_waker() -> RustFutureF64;
+    }
+
+    unsafe extern "C++" {
+        include!("cppcoro_example.h");
+
+        type RustFutureVoid = crate::RustFutureVoid;
+        type RustFutureF64 = crate::RustFutureF64;
+        type RustFutureString = crate::RustFutureString;
+        #[namespace = foo::bar]
+        type RustFutureStringNamespaced = crate::RustFutureStringNamespaced;
+        type RustStreamString = crate::RustStreamString;
+
+        fn cppcoro_dot_product() -> RustFutureF64;
+        fn cppcoro_call_rust_hello();
+        fn cppcoro_eager_poll_hits() -> u64;
+        fn cppcoro_call_rust_dot_product() -> f64;
+        fn cppcoro_schedule_rust_dot_product() -> f64;
+        fn cppcoro_call_rust_dot_products_together() -> f64;
+        fn cppcoro_call_rust_not_product_together() -> String;
+        fn cppcoro_race_rust_dot_product() -> f64;
+        fn cppcoro_race_rust_dot_products() -> f64;
+        fn cppcoro_race_no_rust_futures() -> bool;
+        fn cppcoro_get_namespaced_string() -> RustFutureStringNamespaced;
+        fn cppcoro_frame_pool_hits() -> u64;
+        fn cppcoro_not_product() -> RustFutureF64;
+        fn cppcoro_call_rust_not_product() -> String;
+        fn cppcoro_ping_pong(i: i32) -> RustFutureString;
+        fn cppcoro_deep_ping_pong(i: i32) -> RustFutureString;
+        fn cppcoro_complete() -> RustFutureVoid;
+        fn cppcoro_ready() -> RustFutureVoid;
+        fn cppcoro_call_rust_ready(count: u32);
+        fn cppcoro_call_rust_ready_f64(count: u32);
+        fn cppcoro_set_contention_threads(threads: u32);
+        fn cppcoro_contended_future() -> RustFutureVoid;
+        fn cppcoro_contended_stream() -> RustStreamString;
+        fn cppcoro_await_contended_rust(pool: &ContentionPool, tasks: u32) -> Vec<u64>;
+        fn cppcoro_send_to_dropped_future_go();
+        fn cppcoro_send_to_dropped_future() -> RustFutureF64;
+        fn cppcoro_fizzbuzz() -> RustStreamString;
+        fn cppcoro_indirect_fizzbuzz() -> RustStreamString;
+        fn cppcoro_batched_fizzbuzz() -> RustStreamString;
+        fn cppcoro_counted_fizzbuzz() -> RustStreamString;
+        fn cppcoro_counted_fizzbuzz_yields() -> u32;
+        fn cppcoro_not_fizzbuzz() -> RustStreamString;
+        fn cppcoro_call_rust_fizzbuzz() -> String;
+        fn cppcoro_call_rust_not_fizzbuzz() -> String;
+        fn cppcoro_drop_coroutine_wait() -> RustFutureVoid;
+        fn cppcoro_drop_coroutine_signal() -> RustFutureVoid;
+        fn cppcoro_cancel_coroutine_wait() -> RustFutureVoid;
+        fn cppcoro_cancel_coroutine_check();
+        fn cppcoro_abandon_rust_future() -> RustFutureVoid;
+        fn cppcoro_await_escaping_waker() -> RustFutureF64;
+    }
+}
+
+fn fizzbuzz(i: i32) -> String {
+    match (i % 3, i % 5) {
+        (0, 0) => "FizzBuzz".to_owned(),
+        (0, _) => "Fizz".to_owned(),
+        (_, 0) => "Buzz".to_owned(),
+        _ => i.to_string(),
+    }
+}
+
+fn rust_fizzbuzz() -> RustStreamString {
+    RustStreamString::infallible(stream::iter(1..=15).map(fizzbuzz))
+}
+
+fn rust_not_fizzbuzz() -> RustStreamString {
+    RustStreamString::fallible(stream::iter(1..=11).map(|i| {
+        if i <= 10 {
+            Ok(fizzbuzz(i))
+        } else {
+            Err(CxxAsyncException::new("kapow".to_owned().into_boxed_str()))
+        }
+    }))
+}
+
+#[cxx_async::bridge]
+unsafe impl Future for RustFutureVoid {
+    type Output = ();
+}
+#[cxx_async::bridge]
+unsafe impl Future for RustFutureF64 {
+    type Output = f64;
+}
+#[cxx_async::bridge]
+unsafe impl Future for RustFutureString {
+    type Output = String;
+}
+#[cxx_async::bridge(namespace = foo::bar)]
+unsafe impl Future for RustFutureStringNamespaced {
+    type Output = StringNamespaced;
+}
+#[cxx_async::bridge(capacity = 4)]
+unsafe impl Stream for RustStreamString {
+    type Item = String;
+}
+
+const VECTOR_LENGTH: usize = 16384;
+const SPLIT_LIMIT: usize = 32;
+
+pub static THREAD_POOL: Lazy<ThreadPool> = Lazy::new(|| ThreadPool::new().unwrap());
+
+static VECTORS: Lazy<(Vec<f64>, Vec<f64>)> = Lazy::new(|| {
+    let mut rand = Xorshift::new();
+    let (mut vector_a, mut vector_b) = (vec![], vec![]);
+    for _ in 0..VECTOR_LENGTH {
+        vector_a.push(rand.next() as f64);
+        vector_b.push(rand.next() as f64);
+    }
+    (vector_a, vector_b)
+});
+
+// Simple PRNG that can be easily duplicated on the Rust and C++ sides to ensure identical output.
+struct Xorshift {
+    state: u32,
+}
+
+impl Xorshift {
+    fn new() -> Xorshift {
+        // Random, but constant, seed.
+        Xorshift { state: 0x243f6a88 }
+    }
+
+    fn next(&mut self) -> u32 {
+        let mut x = self.state;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        self.state = x;
+        x
+    }
+}
+
+fn rust_hello() -> RustFutureVoid {
+    RustFutureVoid::infallible(async { println!("hello world") })
+}
+
+// Finished before anyone polls it, so awaiting it measures nothing but the bridge itself.
+fn rust_ready() -> RustFutureVoid {
+    RustFutureVoid::infallible(future::ready(()))
+}
+
+// Like `rust_ready()`, but C++ awaits `RustFutureF64` with an inline waker instead of polling it
+// eagerly.
+fn rust_ready_f64() -> RustFutureF64 {
+    RustFutureF64::infallible(future::ready(1.0))
+}
+
+// A Rust thread pool that C++ can hand back to `rust_contended_future()`.
+pub struct ContentionPool(pub ThreadPool);
+
+// Finishes on one of `pool`'s threads, so that whoever awaits it is woken from there.
+fn rust_contended_future(pool: &ContentionPool) -> RustFutureVoid {
+    RustFutureVoid::infallible(pool.0.spawn_with_handle(async {}).unwrap())
+}
+
+#[async_recursion]
+async fn dot_product(range: Range<usize>) -> f64 {
+    let len = range.end - range.start;
+    if len > SPLIT_LIMIT {
+        let mid = (range.start + range.end) / 2;
+        let (first, second) = join!(
+            THREAD_POOL
+                .spawn_with_handle(dot_product(range.start..mid))
+                .unwrap(),
+            dot_product(mid..range.end)
+        );
+        return first + second;
+    }
+
+    let (ref a, ref b) = *VECTORS;
+    range.clone().map(|index| a[index] * b[index]).sum()
+}
+
+fn rust_dot_product() -> RustFutureF64 {
+    RustFutureF64::infallible(dot_product(0..VECTOR_LENGTH))
+}
+
+fn rust_not_product() -> RustFutureF64 {
+    RustFutureF64::fallible(async {
+        Err(CxxAsyncException::new("kapow".to_owned().into_boxed_str()))
+    })
+}
+
+fn rust_cppcoro_ping_pong(i: i32) -> RustFutureString {
+    RustFutureString::infallible(async move {
+        format!(
+            "{}ping ",
+            if i < 4 {
+                ffi::cppcoro_ping_pong(i + 1).await.unwrap()
+            } else {
+                "".to_owned()
+            }
+        )
+    })
+}
+
+// How many times `rust_cppcoro_deep_ping_pong()` calls back into C++ before the innermost future
+// waits to be woken.
+pub const DEEP_PING_PONG_DEPTH: i32 = 1000;
+
+// The waker of the innermost future of the deep ping-pong chain, once it's waiting.
+pub static DEEP_PING_PONG_WAKER: Lazy<Mutex<Option<Waker>>> = Lazy::new(|| Mutex::new(None));
+pub static DEEP_PING_PONG_READY: AtomicBool = AtomicBool::new(false);
+
+// Like `rust_cppcoro_ping_pong()`, but the chain is much deeper, and its innermost future doesn't
+// finish until it's woken.
+fn rust_cppcoro_deep_ping_pong(i: i32) -> RustFutureString {
+    RustFutureString::infallible(async move {
+        let rest = if i < DEEP_PING_PONG_DEPTH {
+            ffi::cppcoro_deep_ping_pong(i + 1).await.unwrap()
+        } else {
+            future::poll_fn(|context| {
+                if DEEP_PING_PONG_READY.load(Ordering::SeqCst) {
+                    return Poll::Ready(());
+                }
+                *DEEP_PING_PONG_WAKER.lock().unwrap() = Some(context.waker().clone());
+                Poll::Pending
+            })
+            .await;
+            "".to_owned()
+        };
+        format!("{}ping ", rest)
+    })
+}
+
+// Set when the future returned by `rust_pending_until_dropped()` is dropped.
+pub static PENDING_FUTURE_DROPPED: AtomicBool = AtomicBool::new(false);
+
+struct SetOnDrop(&'static AtomicBool);
+
+impl Drop for SetOnDrop {
+    fn drop(&mut self) {
+        self.0.store(true, Ordering::SeqCst);
+    }
+}
+
+// A future that never finishes and never holds onto its waker. A C++ coroutine that awaits nothing
+// but this can never be woken, so it's destroyed while still waiting on it.
+fn rust_pending_until_dropped() -> RustFutureVoid {
+    let guard = SetOnDrop(&PENDING_FUTURE_DROPPED);
+    RustFutureVoid::infallible(async move {
+        let _guard = guard;
+        future::pending::<()>().await
+    })
+}
+
+// Set when the future returned by `rust_losing_dot_product()` is dropped.
+pub static LOSING_FUTURE_DROPPED: AtomicBool = AtomicBool::new(false);
+
+// Like `rust_pending_until_dropped()`, but with the same type as `rust_dot_product()`, so that the
+// two can race in a vector.
+fn rust_losing_dot_product() -> RustFutureF64 {
+    let guard = SetOnDrop(&LOSING_FUTURE_DROPPED);
+    RustFutureF64::infallible(async move {
+        let _guard = guard;
+        future::pending::<f64>().await
+    })
+}
+
+fn rust_losing_dot_product_dropped() -> bool {
+    LOSING_FUTURE_DROPPED.load(Ordering::SeqCst)
+}
+
+// The wakers that `rust_escaping_waker()` has kept.
+pub static ESCAPED_WAKERS: Lazy<Mutex<Vec<Waker>>> = Lazy::new(|| Mutex::new(vec![]));
+pub static ESCAPING_WAKER_READY: AtomicBool = AtomicBool::new(false);
+
+// A future that keeps a clone of its waker every time it's polled, until it's told to finish.
+fn rust_escaping_waker() -> RustFutureF64 {
+    RustFutureF64::infallible(future::poll_fn(|context| {
+        if ESCAPING_WAKER_READY.load(Ordering::SeqCst) {
+            return Poll::Ready(1.0);
+        }
+        ESCAPED_WAKERS.lock().unwrap().push(context.waker().clone());
+        Poll::Pending
+    }))
+}
@@ -1,162 +1,28 @@
 // cxx-async/examples/cppcoro/src/main.rs
 //
-//! Demonstrates how to use `cxx-async` with `cppcoro`.
-
-use crate::ffi::StringNamespaced;
-use async_recursion::async_recursion;
-use cxx_async::CxxAsyncException;
-use futures::executor::{self, ThreadPool};
+// Demonstrates how to use `cxx-async` with `cppcoro`. The bridge itself is in `lib.rs`.
+
+#[cfg(all(test, feature = "latency-histograms"))]
+use cxx_async::LatencyKind;
+#[cfg(test)]
+use cxx_async_example_cppcoro::ffi::StringNamespaced;
+use cxx_async_example_cppcoro::{ffi, THREAD_POOL};
+#[cfg(test)]
+use cxx_async_example_cppcoro::{
+    ContentionPool, DEEP_PING_PONG_DEPTH, DEEP_PING_PONG_READY, DEEP_PING_PONG_WAKER,
+    ESCAPED_WAKERS, ESCAPING_WAKER_READY, LOSING_FUTURE_DROPPED, PENDING_FUTURE_DROPPED,
+};
+use futures::executor;
+#[cfg(test)]
+use futures::executor::ThreadPool;
+#[cfg(test)]
+use futures::future;
 use futures::task::SpawnExt;
-use futures::{join, Stream};
-use futures::{StreamExt, TryStreamExt};
-use once_cell::sync::Lazy;
-use std::future::Future;
-use std::ops::Range;
-
-#[cxx::bridge]
-mod ffi {
-    #[derive(Debug, PartialEq)]
-    struct StringNamespaced {
-        namespaced_string: String,
-    }
-
-    extern "Rust" {
-        fn rust_hello() -> RustFutureVoid;
-        fn rust_dot_product() -> RustFutureF64;
-        fn rust_not_product() -> RustFutureF64;
-        fn rust_cppcoro_ping_pong(i: i32) -> RustFutureString;
-    }
-
-    unsafe extern "C++" {
-        include!("cppcoro_example.h");
-
-        type RustFutureVoid = crate::RustFutureVoid;
-        type RustFutureF64 = crate::RustFutureF64;
-        type RustFutureString = crate::RustFutureString;
-        #[namespace = foo::bar]
-        type RustFutureStringNamespaced = crate::RustFutureStringNamespaced;
-        type RustStreamString = crate::RustStreamString;
-
-        fn cppcoro_dot_product() -> RustFutureF64;
-        fn cppcoro_call_rust_hello();
-        fn cppcoro_call_rust_dot_product() -> f64;
-        fn cppcoro_schedule_rust_dot_product() -> f64;
-        fn cppcoro_get_namespaced_string() -> RustFutureStringNamespaced;
-        fn cppcoro_not_product() -> RustFutureF64;
-        fn cppcoro_call_rust_not_product() -> String;
-        fn cppcoro_ping_pong(i: i32) -> RustFutureString;
-        fn cppcoro_complete() -> RustFutureVoid;
-        fn cppcoro_send_to_dropped_future_go();
-        fn cppcoro_send_to_dropped_future() -> RustFutureF64;
-        fn cppcoro_fizzbuzz() -> RustStreamString;
-        fn cppcoro_indirect_fizzbuzz() -> RustStreamString;
-        fn cppcoro_not_fizzbuzz() -> RustStreamString;
-        fn cppcoro_drop_coroutine_wait() -> RustFutureVoid;
-        fn cppcoro_drop_coroutine_signal() -> RustFutureVoid;
-    }
-}
-
-#[cxx_async::bridge]
-unsafe impl Future for RustFutureVoid {
-    type Output = ();
-}
-#[cxx_async::bridge]
-unsafe impl Future for RustFutureF64 {
-    type Output = f64;
-}
-#[cxx_async::bridge]
-unsafe impl Future for RustFutureString {
-    type Output = String;
-}
-#[cxx_async::bridge(namespace = foo::bar)]
-unsafe impl Future for RustFutureStringNamespaced {
-    type Output = StringNamespaced;
-}
-#[cxx_async::bridge]
-unsafe impl Stream for RustStreamString {
-    type Item = String;
-}
-
-const VECTOR_LENGTH: usize = 16384;
-const SPLIT_LIMIT: usize = 32;
-
-static THREAD_POOL: Lazy<ThreadPool> = Lazy::new(|| ThreadPool::new().unwrap());
-
-static VECTORS: Lazy<(Vec<f64>, Vec<f64>)> = Lazy::new(|| {
-    let mut rand = Xorshift::new();
-    let (mut vector_a, mut vector_b) = (vec![], vec![]);
-    for _ in 0..VECTOR_LENGTH {
-        vector_a.push(rand.next() as f64);
-        vector_b.push(rand.next() as f64);
-    }
-    (vector_a, vector_b)
-});
-
-// Simple PRNG that can be easily duplicated on the Rust and C++ sides to ensure identical output.
-struct Xorshift {
-    state: u32,
-}
-
-impl Xorshift {
-    fn new() -> Xorshift {
-        // Random, but constant, seed.
-        Xorshift { state: 0x243f6a88 }
-    }
-
-    fn next(&mut self) -> u32 {
-        let mut x = self.state;
-        x ^= x << 13;
-        x ^= x >> 17;
-        x ^= x << 5;
-        self.state = x;
-        x
-    }
-}
-
-fn rust_hello() -> RustFutureVoid {
-    RustFutureVoid::infallible(async { println!("hello world") })
-}
-
-#[async_recursion]
-async fn dot_product(range: Range<usize>) -> f64 {
-    let len = range.end - range.start;
-    if len > SPLIT_LIMIT {
-        let mid = (range.start + range.end) / 2;
-        let (first, second) = join!(
-            THREAD_POOL
-                .spawn_with_handle(dot_product(range.start..mid))
-                .unwrap(),
-            dot_product(mid..range.end)
-        );
-        return first + second;
-    }
-
-    let (ref a, ref b) = *VECTORS;
-    range.clone().map(|index| a[index] * b[index]).sum()
-}
-
-fn rust_dot_product() -> RustFutureF64 {
-    RustFutureF64::infallible(dot_product(0..VECTOR_LENGTH))
-}
-
-fn rust_not_product() -> RustFutureF64 {
-    RustFutureF64::fallible(async {
-        Err(CxxAsyncException::new("kapow".to_owned().into_boxed_str()))
-    })
-}
-
-fn rust_cppcoro_ping_pong(i: i32) -> RustFutureString {
-    RustFutureString::infallible(async move {
-        format!(
-            "{}ping ",
-            if i < 4 {
-                ffi::cppcoro_ping_pong(i + 1).await.unwrap()
-            } else {
-                "".to_owned()
-            }
-        )
-    })
-}
+use futures::StreamExt;
+#[cfg(test)]
+use futures::TryStreamExt;
+#[cfg(test)]
+use std::{mem, sync::atomic::Ordering, thread};
 
 // Tests Rust calling C++ synchronously.
 #[test]
@@ -173,6 +39,16 @@ fn test_rust_calling_cpp_synchronously() {
     );
 }
 
+// Tests that coroutines that opt into frame pooling reuse their frames.
+#[test]
+fn test_rust_calling_cpp_with_pooled_frames() {
+    let hits = ffi::cppcoro_frame_pool_hits();
+    for _ in 0..2 {
+        executor::block_on(ffi::cppcoro_get_namespaced_string()).unwrap();
+    }
+    assert!(ffi::cppcoro_frame_pool_hits() > hits);
+}
+
 // Tests Rust calling C++ on a scheduler.
 #[test]
 fn test_rust_calling_cpp_on_scheduler() {
@@ -187,6 +63,14 @@ fn test_cpp_calling_void_rust_synchronously() {
     ffi::cppcoro_call_rust_hello();
 }
 
+// Tests C++ eagerly polling a Rust future that's already finished.
+#[test]
+fn test_cpp_calling_rust_eagerly() {
+    let hits = ffi::cppcoro_eager_poll_hits();
+    ffi::cppcoro_call_rust_hello();
+    assert_eq!(ffi::cppcoro_eager_poll_hits(), hits + 1);
+}
+
 // Tests C++ calling async Rust code that returns non-void synchronously.
 #[test]
 fn test_cpp_calling_rust_synchronously() {
@@ -205,6 +89,48 @@ fn test_cpp_calling_rust_on_scheduler() {
     );
 }
 
+// Tests that resuming C++ coroutines woken up by Rust records how long they waited.
+#[cfg(feature = "latency-histograms")]
+#[test]
+fn test_wake_to_resume_latency() {
+    let before = cxx_async::latency_histogram(LatencyKind::WakeToResume);
+    ffi::cppcoro_schedule_rust_dot_product();
+    let after = cxx_async::latency_histogram(LatencyKind::WakeToResume);
+    assert!(after.count() > before.count());
+    assert!(after.value_at_quantile(1.0) <= after.max());
+}
+
+// Tests C++ awaiting several Rust futures at once.
+#[test]
+fn test_cpp_calling_rust_together() {
+    assert_eq!(
+        ffi::cppcoro_call_rust_dot_products_together(),
+        75719554055754070000000.0
+    );
+    assert_eq!(ffi::cppcoro_call_rust_not_product_together(), "kapow");
+}
+
+// Tests C++ racing Rust futures against one another.
+#[test]
+fn test_cpp_racing_rust_futures() {
+    assert_eq!(
+        ffi::cppcoro_race_rust_dot_product(),
+        75719554055754070000000.0
+    );
+}
+
+// Tests C++ racing a vector of Rust futures. The loser must be dropped as soon as the winner is
+// known, which the C++ side checks while it still holds the race.
+#[test]
+fn test_cpp_racing_rust_futures_in_vector() {
+    assert_eq!(
+        ffi::cppcoro_race_rust_dot_products(),
+        75719554055754070000000.0
+    );
+    assert!(LOSING_FUTURE_DROPPED.load(Ordering::SeqCst));
+    assert!(ffi::cppcoro_race_no_rust_futures());
+}
+
 // Tests Rust calling async C++ code throwing exceptions.
 #[test]
 fn test_cpp_async_functions_throwing_exceptions() {
@@ -227,12 +153,64 @@ fn test_ping_pong() {
     assert_eq!(result, "ping pong ping pong ping pong ping pong ping pong ");
 }
 
+// Tests that a deep ping-pong chain unwinds in constant stack space once its innermost future is
+// woken. Building the chain nests a poll per level, so it's built on a thread with a big stack, but
+// the waker fires on a thread whose stack is much too small to resume one coroutine per level
+// recursively.
+#[test]
+fn test_deep_ping_pong() {
+    let caller = thread::Builder::new()
+        .stack_size(256 << 20)
+        .spawn(|| executor::block_on(ffi::cppcoro_deep_ping_pong(0)).unwrap())
+        .unwrap();
+    let waker = loop {
+        if let Some(waker) = DEEP_PING_PONG_WAKER.lock().unwrap().take() {
+            break waker;
+        }
+        thread::yield_now();
+    };
+    DEEP_PING_PONG_READY.store(true, Ordering::SeqCst);
+    thread::Builder::new()
+        .stack_size(128 << 10)
+        .spawn(move || waker.wake())
+        .unwrap()
+        .join()
+        .unwrap();
+    let result = caller.join().unwrap();
+    assert_eq!(
+        result,
+        "ping pong ".repeat(DEEP_PING_PONG_DEPTH as usize + 1)
+    );
+}
+
 // Test returning void.
 #[test]
 fn test_complete() {
     executor::block_on(ffi::cppcoro_complete()).unwrap();
 }
 
+// Tests awaiting futures that are already finished, in both directions.
+#[test]
+fn test_ready() {
+    executor::block_on(ffi::cppcoro_ready()).unwrap();
+    ffi::cppcoro_call_rust_ready(4);
+    ffi::cppcoro_call_rust_ready_f64(4);
+}
+
+// Tests futures and streams that finish on other threads, many at once, in both directions.
+#[test]
+fn test_contention() {
+    ffi::cppcoro_set_contention_threads(2);
+    let futures: Vec<_> = (0..16).map(|_| ffi::cppcoro_contended_future()).collect();
+    executor::block_on(future::try_join_all(futures)).unwrap();
+    assert_eq!(
+        executor::block_on(ffi::cppcoro_contended_stream().count()),
+        16
+    );
+    let pool = ContentionPool(ThreadPool::builder().pool_size(2).create().unwrap());
+    assert_eq!(ffi::cppcoro_await_contended_rust(&pool, 16).len(), 16);
+}
+
 // Test dropping futures.
 #[test]
 fn test_dropping_futures() {
@@ -268,6 +246,40 @@ fn test_indirect_fizzbuzz() {
     );
 }
 
+// Test Rust calling C++ streams that yield items in batches.
+#[test]
+fn test_batched_fizzbuzz() {
+    let vector = executor::block_on(
+        ffi::cppcoro_batched_fizzbuzz()
+            .map(|result| result.unwrap())
+            .collect::<Vec<String>>(),
+    );
+    assert_eq!(
+        vector.join(", "),
+        "1, 2, Fizz, 4, Buzz, Fizz, 7, 8, Fizz, Buzz, 11, Fizz, 13, 14, FizzBuzz"
+    );
+}
+
+// Test that a C++ stream runs ahead of Rust until it has filled the stream's buffer, and only then
+// suspends.
+#[test]
+fn test_stream_runs_ahead_to_capacity() {
+    let stream = ffi::cppcoro_counted_fizzbuzz();
+    // `RustStreamString` has a capacity of 4, so four values are buffered before anything polls
+    // the stream, and the coroutine is suspended trying to yield the fifth.
+    assert_eq!(ffi::cppcoro_counted_fizzbuzz_yields(), 5);
+    let vector = executor::block_on(
+        stream
+            .map(|result| result.unwrap())
+            .collect::<Vec<String>>(),
+    );
+    assert_eq!(
+        vector.join(", "),
+        "1, 2, Fizz, 4, Buzz, Fizz, 7, 8, Fizz, Buzz, 11, Fizz, 13, 14, FizzBuzz"
+    );
+    assert_eq!(ffi::cppcoro_counted_fizzbuzz_yields(), 15);
+}
+
 #[test]
 fn test_streams_throwing_exceptions() {
     let mut vector = executor::block_on(
@@ -283,6 +295,24 @@ fn test_streams_throwing_exceptions() {
     );
 }
 
+// Test C++ calling Rust streams.
+#[test]
+fn test_cpp_calling_rust_streams() {
+    assert_eq!(
+        ffi::cppcoro_call_rust_fizzbuzz(),
+        "1, 2, Fizz, 4, Buzz, Fizz, 7, 8, Fizz, Buzz, 11, Fizz, 13, 14, FizzBuzz"
+    );
+}
+
+// Test C++ calling Rust streams that return errors partway through.
+#[test]
+fn test_rust_streams_returning_errors() {
+    assert_eq!(
+        ffi::cppcoro_call_rust_not_fizzbuzz(),
+        "1, 2, Fizz, 4, Buzz, Fizz, 7, 8, Fizz, Buzz: kapow"
+    );
+}
+
 #[test]
 fn test_dropping_coroutines() {
     // Make sure that coroutines get parented to the reaper so that destructors are called.
@@ -290,6 +320,35 @@ fn test_dropping_coroutines() {
     drop(executor::block_on(ffi::cppcoro_drop_coroutine_signal()));
 }
 
+#[test]
+fn test_cancelling_coroutines() {
+    // Make sure that dropping a future cancels the coroutine behind it.
+    drop(ffi::cppcoro_cancel_coroutine_wait());
+    ffi::cppcoro_cancel_coroutine_check();
+}
+
+#[test]
+fn test_destroying_coroutines_awaiting_rust() {
+    // Make sure that the Rust future is dropped as soon as the C++ coroutine awaiting it is
+    // destroyed, not whenever a stray waker happens to fire.
+    let _ = ffi::cppcoro_abandon_rust_future();
+    assert!(PENDING_FUTURE_DROPPED.load(Ordering::SeqCst));
+}
+
+#[test]
+fn test_inline_waker_escaping() {
+    // Make sure that a clone of an inline waker can wake the coroutine, and can outlive it.
+    let future = ffi::cppcoro_await_escaping_waker();
+    let wakers = mem::take(&mut *ESCAPED_WAKERS.lock().unwrap());
+    assert_eq!(wakers.len(), 1);
+    ESCAPING_WAKER_READY.store(true, Ordering::SeqCst);
+    wakers[0].wake_by_ref();
+    assert_eq!(executor::block_on(future).unwrap(), 1.0);
+    for waker in wakers {
+        waker.wake();
+    }
+}
+
 fn main() {
     // Test Rust calling C++ async functions, both synchronously and via a scheduler.
     let future = ffi::cppcoro_dot_product();
@@ -306,6 +365,8 @@ fn main() {
     ffi::cppcoro_call_rust_hello();
     println!("{}", ffi::cppcoro_call_rust_dot_product());
     println!("{}", ffi::cppcoro_schedule_rust_dot_product());
+    println!("{}", ffi::cppcoro_call_rust_dot_products_together());
+    println!("{}", ffi::cppcoro_race_rust_dot_product());
 
     // Test exceptions being thrown by C++ async functions.
     let future = ffi::cppcoro_not_product();
@@ -342,6 +403,12 @@ fn main() {
             .collect::<Vec<String>>(),
     );
     println!("{}", vector.join(", "));
+    let vector = executor::block_on(
+        ffi::cppcoro_batched_fizzbuzz()
+            .map(|result| result.unwrap())
+            .collect::<Vec<String>>(),
+    );
+    println!("{}", vector.join(", "));
 
     // Test Rust calling C++ streams that throw exceptions partway through.
     let vector = executor::block_on(
@@ -351,7 +418,18 @@ fn main() {
     );
     println!("{}", vector.join(", "));
 
+    // Test C++ calling Rust streams.
+    println!("{}", ffi::cppcoro_call_rust_fizzbuzz());
+    println!("{}", ffi::cppcoro_call_rust_not_fizzbuzz());
+
     // Test that destructors are called when dropping a future.
     let _ = ffi::cppcoro_drop_coroutine_wait();
     drop(executor::block_on(ffi::cppcoro_drop_coroutine_signal()));
+
+    // Test cancelling coroutines by dropping their futures.
+    drop(ffi::cppcoro_cancel_coroutine_wait());
+    ffi::cppcoro_cancel_coroutine_check();
+
+    // Test destroying a coroutine that's waiting on a Rust future.
+    let _ = ffi::cppcoro_abandon_rust_future();
 }
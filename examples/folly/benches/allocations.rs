@@ -0,0 +1,50 @@
+// cxx-async/examples/folly/benches/allocations.rs
+//
+//! Counts the allocations that round trips between Rust and Folly coroutines make, and fails if
+//! any of them goes over its limit. Run with
+//! `cargo bench --features count-allocations --bench allocations`.
+
+#[path = "../../common/benches/allocations.rs"]
+mod allocations;
+mod backend;
+#[allow(dead_code)]
+#[path = "../../common/benches/harness.rs"]
+mod harness;
+
+use allocations::{Checker, Limit, Limits};
+
+// The Rust numbers are what 64-bit builds measure. C++ coroutine frames vary in size between
+// compilers, so the C++ byte limits leave some room.
+const LIMITS: Limits = Limits {
+    // The channel block on the Rust side and the coroutine frame on the C++ side.
+    rust_calls_cpp: Limit {
+        rust_allocations: 1.0,
+        rust_bytes: 136.0,
+        cpp_allocations: 1.0,
+        cpp_bytes: 160.0,
+    },
+    // `rust_ready()` boxes its future. On the C++ side, the receiver that holds the waker, the
+    // coroutine that `co_viaIfAsync()` wraps every `co_await` in, and the continuation that that
+    // schedules on the `blocking_wait()` executor.
+    co_await: Limit {
+        rust_allocations: 1.0,
+        rust_bytes: 3.0,
+        cpp_allocations: 3.0,
+        cpp_bytes: 512.0,
+    },
+    // Per 15 items: the channel block, room for 1 item, and each item's string on the Rust side;
+    // the coroutine frame on the C++ side, plus a waker every time the coroutine finds the buffer
+    // full, which it does 14 times.
+    co_yield: Limit {
+        rust_allocations: 17.0 / 15.0,
+        rust_bytes: 235.0 / 15.0,
+        cpp_allocations: 1.0,
+        cpp_bytes: 112.0,
+    },
+};
+
+fn main() {
+    let mut checker = Checker::new("folly");
+    checker.check_backend(&backend::Folly, &LIMITS);
+    checker.finish();
+}
@@ -0,0 +1,46 @@
+// cxx-async/examples/folly/benches/backend/mod.rs
+//
+// The Folly side of the shared benchmarks.
+
+use crate::harness::Backend;
+use cxx_async_example_folly::{ffi, ContentionPool};
+use futures::executor::{self, ThreadPool};
+use futures::future::BoxFuture;
+use futures::{FutureExt, StreamExt};
+
+#[derive(Clone, Copy)]
+pub struct Folly;
+
+impl Backend for Folly {
+    fn rust_awaits_ready_cpp(&self) {
+        executor::block_on(ffi::folly_ready()).unwrap()
+    }
+
+    fn cpp_awaits_ready_rust(&self, count: u32) {
+        ffi::folly_call_rust_ready(count)
+    }
+
+    fn ping_pong(&self, start: i32) -> String {
+        executor::block_on(ffi::folly_ping_pong(start)).unwrap()
+    }
+
+    fn fizzbuzz(&self) -> usize {
+        executor::block_on(ffi::folly_fizzbuzz().count())
+    }
+
+    fn set_contention_threads(&self, threads: u32) {
+        ffi::folly_set_contention_threads(threads)
+    }
+
+    fn contended_future(&self) -> BoxFuture<'static, ()> {
+        ffi::folly_contended_future().map(Result::unwrap).boxed()
+    }
+
+    fn contended_stream(&self) -> BoxFuture<'static, usize> {
+        ffi::folly_contended_stream().count().boxed()
+    }
+
+    fn cpp_awaits_contended_rust(&self, pool: &ThreadPool, tasks: u32) -> Vec<u64> {
+        ffi::folly_await_contended_rust(&ContentionPool(pool.clone()), tasks)
+    }
+}
@@ -1,14 +1,17 @@
 // cxx-async/examples/folly/build.rs
 
+use std::env;
+
 fn main() {
     let folly = find_folly::probe_folly().expect("Couldn't find the Folly library!");
 
     println!("cargo:rerun-if-changed=build.rs");
     println!("cargo:rerun-if-changed=include/folly_example.h");
     println!("cargo:rerun-if-changed=src/folly_example.cpp");
+    println!("cargo:rerun-if-changed=../common/src/counting_new.cpp");
     println!("cargo:rustc-link-lib=atomic");
 
-    let mut build = cxx_build::bridge("src/main.rs");
+    let mut build = cxx_build::bridge("src/lib.rs");
     build
         .file("src/folly_example.cpp")
         .include("include")
@@ -21,5 +24,15 @@ fn main() {
         build.flag(other_cflag);
     }
 
+    // Match the layout that `cxx-async` was built with. See `rust::async::Tracing`.
+    if env::var_os("DEP_CXX_ASYNC_TRACING").is_some() {
+        build.define("CXXASYNC_TRACING", None);
+    }
+
+    // Count allocations on the C++ heap for the `allocations` benchmark.
+    if env::var_os("CARGO_FEATURE_COUNT_ALLOCATIONS").is_some() {
+        build.file("../common/src/counting_new.cpp");
+    }
+
     build.compile("folly_example");
 }
@@ -24,6 +24,9 @@ CXXASYNC_DEFINE_FUTURE(rust::String, RustFutureString);
 CXXASYNC_DEFINE_FUTURE(::rust::String, foo, rust, bar, RustFutureStringNamespaced);
 CXXASYNC_DEFINE_STREAM(rust::String, RustStreamString);
 
+// Defined on the Rust side.
+struct ContentionPool;
+
 class MyException : public std::exception {
   const char* m_message;
 
@@ -69,12 +72,24 @@ RustFutureF64 folly_not_product();
 rust::String folly_call_rust_not_product();
 RustFutureString folly_ping_pong(int i);
 RustFutureVoid folly_complete();
+RustFutureVoid folly_ready();
+void folly_call_rust_ready(uint32_t count);
+void folly_set_contention_threads(uint32_t threads);
+RustFutureVoid folly_contended_future();
+RustStreamString folly_contended_stream();
+rust::Vec<uint64_t> folly_await_contended_rust(
+    const ContentionPool& pool,
+    uint32_t tasks);
 void folly_send_to_dropped_future_go();
 RustFutureF64 folly_send_to_dropped_future();
 RustStreamString folly_fizzbuzz();
 RustStreamString folly_indirect_fizzbuzz();
 RustStreamString folly_not_fizzbuzz();
+rust::String folly_call_rust_fizzbuzz();
+rust::String folly_call_rust_not_fizzbuzz();
 RustFutureVoid folly_drop_coroutine_wait();
 RustFutureVoid folly_drop_coroutine_signal();
+RustFutureVoid folly_cancel_coroutine_wait();
+void folly_cancel_coroutine_check();
 
 #endif // CXX_ASYNC_FOLLY_EXAMPLE_H
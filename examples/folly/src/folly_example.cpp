@@ -21,6 +21,8 @@
 #include <folly/Unit.h>
 #include <folly/executors/CPUThreadPoolExecutor.h>
 #include <folly/experimental/coro/BlockingWait.h>
+#include <folly/experimental/coro/Collect.h>
+#include <folly/experimental/coro/Sleep.h>
 #include <folly/experimental/coro/Task.h>
 #include <folly/experimental/coro/ViaIfAsync.h>
 #include <folly/experimental/coro/WithAsyncStack.h>
@@ -30,6 +32,8 @@
 #include <folly/futures/Promise-inl.h>
 #include <folly/synchronization/Baton.h>
 #include <folly/tracing/AsyncStack-inl.h>
+#include <chrono>
+#include <cstdint>
 #include <cstdlib>
 #include <exception>
 #include <functional>
@@ -41,7 +45,7 @@
 #include <type_traits>
 #include <utility>
 #include <vector>
-#include "cxx-async-example-folly/src/main.rs.h"
+#include "cxx-async-example-folly/src/lib.rs.h"
 #include "example.h"
 #include "rust/cxx.h"
 #include "rust/cxx_async.h"
@@ -150,17 +154,17 @@ foo::rust::bar::RustFutureStringNamespaced folly_get_namespaced_string() {
 
 void folly_call_rust_hello() {
   RustFutureVoid future = rust_hello();
-  return folly::coro::blockingWait(std::move(future));
+  return rust::async::blocking_wait(std::move(future));
 }
 
 double folly_call_rust_dot_product() {
   RustFutureF64 future = rust_dot_product();
-  return folly::coro::blockingWait(std::move(future));
+  return rust::async::blocking_wait(std::move(future));
 }
 
 double folly_schedule_rust_dot_product() {
   RustFutureF64 future = rust_dot_product();
-  return folly::coro::blockingWait(std::move(future));
+  return rust::async::blocking_wait(std::move(future));
 }
 
 RustFutureF64 folly_not_product() {
@@ -170,7 +174,7 @@ RustFutureF64 folly_not_product() {
 rust::String folly_call_rust_not_product() {
   try {
     RustFutureF64 oneshot_receiver = rust_not_product();
-    folly::coro::blockingWait(std::move(oneshot_receiver));
+    rust::async::blocking_wait(std::move(oneshot_receiver));
     std::terminate();
   } catch (const std::exception& error) {
     return rust::String(error.what());
@@ -186,6 +190,73 @@ RustFutureVoid folly_complete() {
   co_return;
 }
 
+RustFutureVoid folly_ready() {
+  co_return;
+}
+
+static folly::coro::Task<void> await_rust_ready(uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    co_await rust_ready();
+  }
+}
+
+void folly_call_rust_ready(uint32_t count) {
+  rust::async::blocking_wait(await_rust_ready(count));
+}
+
+// The pool that the contended coroutines below run on. Like `g_thread_pool`,
+// the last one is leaked.
+static folly::CPUThreadPoolExecutor* g_contention_pool;
+
+void folly_set_contention_threads(uint32_t threads) {
+  delete g_contention_pool;
+  g_contention_pool = new folly::CPUThreadPoolExecutor(threads);
+}
+
+static folly::coro::Task<void> hop_to_contention_pool() {
+  co_return;
+}
+
+RustFutureVoid folly_contended_future() {
+  co_await hop_to_contention_pool().scheduleOn(
+      folly::getKeepAliveToken(g_contention_pool));
+}
+
+RustStreamString folly_contended_stream() {
+  co_await hop_to_contention_pool().scheduleOn(
+      folly::getKeepAliveToken(g_contention_pool));
+  for (int i = 0; i < 16; i++) {
+    co_yield rust::String(std::to_string(i));
+  }
+}
+
+// Returns how long the Rust future took to wake us up, in nanoseconds.
+static folly::coro::Task<uint64_t> await_contended_rust(
+    const ContentionPool& pool) {
+  auto start = std::chrono::steady_clock::now();
+  co_await rust_contended_future(pool);
+  co_return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+rust::Vec<uint64_t> folly_await_contended_rust(
+    const ContentionPool& pool,
+    uint32_t tasks) {
+  std::vector<folly::coro::TaskWithExecutor<uint64_t>> awaiting;
+  for (uint32_t i = 0; i < tasks; i++) {
+    awaiting.push_back(await_contended_rust(pool).scheduleOn(
+        folly::getKeepAliveToken(g_contention_pool)));
+  }
+
+  rust::Vec<uint64_t> latencies;
+  for (uint64_t latency : rust::async::blocking_wait(
+           folly::coro::collectAllRange(std::move(awaiting)))) {
+    latencies.push_back(latency);
+  }
+  return latencies;
+}
+
 // Intentionally leak this to avoid annoying data race issues on thread
 // destruction.
 static Sem* g_dropped_future_sem;
@@ -241,6 +312,31 @@ RustStreamString folly_not_fizzbuzz() {
   throw MyException("kablam");
 }
 
+// Consumes a Rust stream one item at a time, joining the items with commas. If
+// the stream returns an error, the error message is appended after a colon.
+static folly::coro::Task<rust::String> join_rust_stream(RustStreamString stream) {
+  std::string result;
+  try {
+    while (auto item = co_await stream.next()) {
+      if (!result.empty())
+        result += ", ";
+      result += std::string(*item);
+    }
+  } catch (const std::exception& error) {
+    result += ": ";
+    result += error.what();
+  }
+  co_return rust::String(result);
+}
+
+rust::String folly_call_rust_fizzbuzz() {
+  return rust::async::blocking_wait(join_rust_stream(rust_fizzbuzz()));
+}
+
+rust::String folly_call_rust_not_fizzbuzz() {
+  return rust::async::blocking_wait(join_rust_stream(rust_not_fizzbuzz()));
+}
+
 struct DestructorTest {
   folly::futures::Barrier m_barrier;
   folly::Baton<> m_baton;
@@ -277,3 +373,27 @@ RustFutureVoid folly_drop_coroutine_signal() {
   g_destructor_test.m_baton.wait();
   co_return;
 }
+
+static folly::Baton<> g_cancellation_test_baton;
+
+// Ensure that dropping a future cancels the coroutine behind it, including the
+// Folly operations that it's waiting on. The future that this function returns
+// is dropped right away, and then `folly_cancel_coroutine_check()` waits for
+// the coroutine to notice.
+RustFutureVoid folly_cancel_coroutine_wait() {
+  folly::CancellationToken token = co_await rust::async::cancellation_token();
+  try {
+    // The cancellation token is passed along to this automatically.
+    co_await folly::coro::sleep(std::chrono::hours(24));
+  } catch (const std::exception&) {
+    // Expected to be `folly::OperationCancelled`.
+  }
+  if (token.isCancellationRequested()) {
+    g_cancellation_test_baton.post();
+  }
+  co_return;
+}
+
+void folly_cancel_coroutine_check() {
+  g_cancellation_test_baton.wait();
+}
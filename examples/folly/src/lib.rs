@@ -0,0 +1,210 @@
+// cxx-async/examples/folly/src/lib.rs
+//
+//! The bridge between the Folly example's Rust and C++ halves, and the Rust functions that C++
+//! calls. The example binary, its tests, and the benchmarks all use this.
+
+use crate::ffi::StringNamespaced;
+use async_recursion::async_recursion;
+use cxx_async::CxxAsyncException;
+use futures::executor::ThreadPool;
+use futures::task::SpawnExt;
+use futures::{future, join, stream, Stream, StreamExt};
+use once_cell::sync::Lazy;
+use std::future::Future;
+use std::ops::Range;
+
+#[cxx::bridge]
+pub mod ffi {
+    #[derive(Debug, PartialEq)]
+    struct StringNamespaced {
+        namespaced_string: String,
+    }
+
+    extern "Rust" {
+        type ContentionPool;
+
+        fn rust_hello() -> RustFutureVoid;
+        fn rust_ready() -> RustFutureVoid;
+        fn rust_contended_future(pool: &ContentionPool) -> RustFutureVoid;
+        fn rust_dot_product() -> RustFutureF64;
+        fn rust_not_product() -> RustFutureF64;
+        fn rust_folly_ping_pong(i: i32) -> RustFutureString;
+        fn rust_fizzbuzz() -> RustStreamString;
+        fn rust_not_fizzbuzz() -> RustStreamString;
+    }
+
+    unsafe extern "C++" {
+        include!("folly_example.h");
+
+        type RustFutureVoid = crate::RustFutureVoid;
+        type RustFutureF64 = crate::RustFutureF64;
+        type RustFutureString = crate::RustFutureString;
+        #[namespace = foo::rust::bar]
+        type RustFutureStringNamespaced = crate::RustFutureStringNamespaced;
+        type RustStreamString = crate::RustStreamString;
+
+        fn folly_dot_product_coro() -> RustFutureF64;
+        fn folly_dot_product_futures() -> RustFutureF64;
+        fn folly_get_namespaced_string() -> RustFutureStringNamespaced;
+        fn folly_call_rust_hello();
+        fn folly_call_rust_dot_product() -> f64;
+        fn folly_schedule_rust_dot_product() -> f64;
+        fn folly_not_product() -> RustFutureF64;
+        fn folly_call_rust_not_product() -> String;
+        fn folly_ping_pong(i: i32) -> RustFutureString;
+        fn folly_complete() -> RustFutureVoid;
+        fn folly_ready() -> RustFutureVoid;
+        fn folly_call_rust_ready(count: u32);
+        fn folly_set_contention_threads(threads: u32);
+        fn folly_contended_future() -> RustFutureVoid;
+        fn folly_contended_stream() -> RustStreamString;
+        fn folly_await_contended_rust(pool: &ContentionPool, tasks: u32) -> Vec<u64>;
+        fn folly_send_to_dropped_future_go();
+        fn folly_send_to_dropped_future() -> RustFutureF64;
+        fn folly_fizzbuzz() -> RustStreamString;
+        fn folly_indirect_fizzbuzz() -> RustStreamString;
+        fn folly_not_fizzbuzz() -> RustStreamString;
+        fn folly_call_rust_fizzbuzz() -> String;
+        fn folly_call_rust_not_fizzbuzz() -> String;
+        fn folly_drop_coroutine_wait() -> RustFutureVoid;
+        fn folly_drop_coroutine_signal() -> RustFutureVoid;
+        fn folly_cancel_coroutine_wait() -> RustFutureVoid;
+        fn folly_cancel_coroutine_check();
+    }
+}
+
+fn fizzbuzz(i: i32) -> String {
+    match (i % 3, i % 5) {
+        (0, 0) => "FizzBuzz".to_owned(),
+        (0, _) => "Fizz".to_owned(),
+        (_, 0) => "Buzz".to_owned(),
+        _ => i.to_string(),
+    }
+}
+
+fn rust_fizzbuzz() -> RustStreamString {
+    RustStreamString::infallible(stream::iter(1..=15).map(fizzbuzz))
+}
+
+fn rust_not_fizzbuzz() -> RustStreamString {
+    RustStreamString::fallible(stream::iter(1..=11).map(|i| {
+        if i <= 10 {
+            Ok(fizzbuzz(i))
+        } else {
+            Err(CxxAsyncException::new("kapow".to_owned().into_boxed_str()))
+        }
+    }))
+}
+
+#[cxx_async::bridge]
+unsafe impl Future for RustFutureVoid {
+    type Output = ();
+}
+#[cxx_async::bridge]
+unsafe impl Future for RustFutureF64 {
+    type Output = f64;
+}
+#[cxx_async::bridge]
+unsafe impl Future for RustFutureString {
+    type Output = String;
+}
+#[cxx_async::bridge(namespace = foo::rust::bar)]
+unsafe impl Future for RustFutureStringNamespaced {
+    type Output = StringNamespaced;
+}
+#[cxx_async::bridge]
+unsafe impl Stream for RustStreamString {
+    type Item = String;
+}
+
+const VECTOR_LENGTH: usize = 16384;
+const SPLIT_LIMIT: usize = 32;
+
+pub static THREAD_POOL: Lazy<ThreadPool> = Lazy::new(|| ThreadPool::new().unwrap());
+
+static VECTORS: Lazy<(Vec<f64>, Vec<f64>)> = Lazy::new(|| {
+    let mut rand = Xorshift::new();
+    let (mut vector_a, mut vector_b) = (vec![], vec![]);
+    for _ in 0..VECTOR_LENGTH {
+        vector_a.push(rand.next() as f64);
+        vector_b.push(rand.next() as f64);
+    }
+    (vector_a, vector_b)
+});
+
+struct Xorshift {
+    state: u32,
+}
+
+impl Xorshift {
+    fn new() -> Xorshift {
+        Xorshift { state: 0x243f6a88 }
+    }
+
+    fn next(&mut self) -> u32 {
+        let mut x = self.state;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        self.state = x;
+        x
+    }
+}
+
+fn rust_hello() -> RustFutureVoid {
+    RustFutureVoid::infallible(async { println!("hello world") })
+}
+
+// Finished before anyone polls it, so awaiting it measures nothing but the bridge itself.
+fn rust_ready() -> RustFutureVoid {
+    RustFutureVoid::infallible(future::ready(()))
+}
+
+// A Rust thread pool that C++ can hand back to `rust_contended_future()`.
+pub struct ContentionPool(pub ThreadPool);
+
+// Finishes on one of `pool`'s threads, so that whoever awaits it is woken from there.
+fn rust_contended_future(pool: &ContentionPool) -> RustFutureVoid {
+    RustFutureVoid::infallible(pool.0.spawn_with_handle(async {}).unwrap())
+}
+
+#[async_recursion]
+async fn dot_product(range: Range<usize>) -> f64 {
+    let len = range.end - range.start;
+    if len > SPLIT_LIMIT {
+        let mid = (range.start + range.end) / 2;
+        let (first, second) = join!(
+            THREAD_POOL
+                .spawn_with_handle(dot_product(range.start..mid))
+                .unwrap(),
+            dot_product(mid..range.end)
+        );
+        return first + second;
+    }
+
+    let (ref a, ref b) = *VECTORS;
+    range.clone().map(|index| a[index] * b[index]).sum()
+}
+
+fn rust_dot_product() -> RustFutureF64 {
+    RustFutureF64::infallible(dot_product(0..VECTOR_LENGTH))
+}
+
+fn rust_not_product() -> RustFutureF64 {
+    RustFutureF64::fallible(async {
+        Err(CxxAsyncException::new("kapow".to_owned().into_boxed_str()))
+    })
+}
+
+fn rust_folly_ping_pong(i: i32) -> RustFutureString {
+    RustFutureString::infallible(async move {
+        format!(
+            "{}ping ",
+            if i < 4 {
+                ffi::folly_ping_pong(i + 1).await.unwrap()
+            } else {
+                "".to_owned()
+            }
+        )
+    })
+}
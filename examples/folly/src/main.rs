@@ -1,161 +1,21 @@
 // cxx-async/examples/folly/src/main.rs
 //
-//! Demonstrates how to use Folly with `cxx_async`.
-
-use crate::ffi::StringNamespaced;
-use async_recursion::async_recursion;
-use cxx_async::CxxAsyncException;
-use futures::executor::{self, ThreadPool};
+// Demonstrates how to use Folly with `cxx_async`. The bridge itself is in `lib.rs`.
+
+#[cfg(all(test, feature = "latency-histograms"))]
+use cxx_async::LatencyKind;
+#[cfg(test)]
+use cxx_async_example_folly::ContentionPool;
+use cxx_async_example_folly::{ffi, THREAD_POOL};
+use futures::executor;
+#[cfg(test)]
+use futures::executor::ThreadPool;
+#[cfg(test)]
+use futures::future;
 use futures::task::SpawnExt;
-use futures::{join, Stream};
-use futures::{StreamExt, TryStreamExt};
-use once_cell::sync::Lazy;
-use std::future::Future;
-use std::ops::Range;
-
-#[cxx::bridge]
-mod ffi {
-    #[derive(Debug, PartialEq)]
-    struct StringNamespaced {
-        namespaced_string: String,
-    }
-
-    extern "Rust" {
-        fn rust_hello() -> RustFutureVoid;
-        fn rust_dot_product() -> RustFutureF64;
-        fn rust_not_product() -> RustFutureF64;
-        fn rust_folly_ping_pong(i: i32) -> RustFutureString;
-    }
-
-    unsafe extern "C++" {
-        include!("folly_example.h");
-
-        type RustFutureVoid = crate::RustFutureVoid;
-        type RustFutureF64 = crate::RustFutureF64;
-        type RustFutureString = crate::RustFutureString;
-        #[namespace = foo::rust::bar]
-        type RustFutureStringNamespaced = crate::RustFutureStringNamespaced;
-        type RustStreamString = crate::RustStreamString;
-
-        fn folly_dot_product_coro() -> RustFutureF64;
-        fn folly_dot_product_futures() -> RustFutureF64;
-        fn folly_get_namespaced_string() -> RustFutureStringNamespaced;
-        fn folly_call_rust_hello();
-        fn folly_call_rust_dot_product() -> f64;
-        fn folly_schedule_rust_dot_product() -> f64;
-        fn folly_not_product() -> RustFutureF64;
-        fn folly_call_rust_not_product() -> String;
-        fn folly_ping_pong(i: i32) -> RustFutureString;
-        fn folly_complete() -> RustFutureVoid;
-        fn folly_send_to_dropped_future_go();
-        fn folly_send_to_dropped_future() -> RustFutureF64;
-        fn folly_fizzbuzz() -> RustStreamString;
-        fn folly_indirect_fizzbuzz() -> RustStreamString;
-        fn folly_not_fizzbuzz() -> RustStreamString;
-        fn folly_drop_coroutine_wait() -> RustFutureVoid;
-        fn folly_drop_coroutine_signal() -> RustFutureVoid;
-    }
-}
-
-#[cxx_async::bridge]
-unsafe impl Future for RustFutureVoid {
-    type Output = ();
-}
-#[cxx_async::bridge]
-unsafe impl Future for RustFutureF64 {
-    type Output = f64;
-}
-#[cxx_async::bridge]
-unsafe impl Future for RustFutureString {
-    type Output = String;
-}
-#[cxx_async::bridge(namespace = foo::rust::bar)]
-unsafe impl Future for RustFutureStringNamespaced {
-    type Output = StringNamespaced;
-}
-#[cxx_async::bridge]
-unsafe impl Stream for RustStreamString {
-    type Item = String;
-}
-
-const VECTOR_LENGTH: usize = 16384;
-const SPLIT_LIMIT: usize = 32;
-
-static THREAD_POOL: Lazy<ThreadPool> = Lazy::new(|| ThreadPool::new().unwrap());
-
-static VECTORS: Lazy<(Vec<f64>, Vec<f64>)> = Lazy::new(|| {
-    let mut rand = Xorshift::new();
-    let (mut vector_a, mut vector_b) = (vec![], vec![]);
-    for _ in 0..VECTOR_LENGTH {
-        vector_a.push(rand.next() as f64);
-        vector_b.push(rand.next() as f64);
-    }
-    (vector_a, vector_b)
-});
-
-struct Xorshift {
-    state: u32,
-}
-
-impl Xorshift {
-    fn new() -> Xorshift {
-        Xorshift { state: 0x243f6a88 }
-    }
-
-    fn next(&mut self) -> u32 {
-        let mut x = self.state;
-        x ^= x << 13;
-        x ^= x >> 17;
-        x ^= x << 5;
-        self.state = x;
-        x
-    }
-}
-
-fn rust_hello() -> RustFutureVoid {
-    RustFutureVoid::infallible(async { println!("hello world") })
-}
-
-#[async_recursion]
-async fn dot_product(range: Range<usize>) -> f64 {
-    let len = range.end - range.start;
-    if len > SPLIT_LIMIT {
-        let mid = (range.start + range.end) / 2;
-        let (first, second) = join!(
-            THREAD_POOL
-                .spawn_with_handle(dot_product(range.start..mid))
-                .unwrap(),
-            dot_product(mid..range.end)
-        );
-        return first + second;
-    }
-
-    let (ref a, ref b) = *VECTORS;
-    range.clone().map(|index| a[index] * b[index]).sum()
-}
-
-fn rust_dot_product() -> RustFutureF64 {
-    RustFutureF64::infallible(dot_product(0..VECTOR_LENGTH))
-}
-
-fn rust_not_product() -> RustFutureF64 {
-    RustFutureF64::fallible(async {
-        Err(CxxAsyncException::new("kapow".to_owned().into_boxed_str()))
-    })
-}
-
-fn rust_folly_ping_pong(i: i32) -> RustFutureString {
-    RustFutureString::infallible(async move {
-        format!(
-            "{}ping ",
-            if i < 4 {
-                ffi::folly_ping_pong(i + 1).await.unwrap()
-            } else {
-                "".to_owned()
-            }
-        )
-    })
-}
+use futures::StreamExt;
+#[cfg(test)]
+use futures::TryStreamExt;
 
 // Tests Rust calling C++ synchronously using the coroutine API.
 #[test]
@@ -181,6 +41,18 @@ fn test_rust_calling_cpp_synchronously_futures() {
     );
 }
 
+// Tests that running the continuations that Folly submits to an execlet records how long they
+// waited.
+#[cfg(feature = "latency-histograms")]
+#[test]
+fn test_execlet_latency() {
+    let before = cxx_async::latency_histogram(LatencyKind::ExecletSubmitToRun);
+    executor::block_on(ffi::folly_dot_product_coro()).unwrap();
+    let after = cxx_async::latency_histogram(LatencyKind::ExecletSubmitToRun);
+    assert!(after.count() > before.count());
+    assert!(after.value_at_quantile(1.0) <= after.max());
+}
+
 // Tests Rust calling C++ on a scheduler.
 #[test]
 fn test_rust_calling_cpp_on_scheduler() {
@@ -244,6 +116,27 @@ fn test_complete() {
     executor::block_on(ffi::folly_complete()).unwrap();
 }
 
+// Tests awaiting futures that are already finished, in both directions.
+#[test]
+fn test_ready() {
+    executor::block_on(ffi::folly_ready()).unwrap();
+    ffi::folly_call_rust_ready(4);
+}
+
+// Tests futures and streams that finish on other threads, many at once, in both directions.
+#[test]
+fn test_contention() {
+    ffi::folly_set_contention_threads(2);
+    let futures: Vec<_> = (0..16).map(|_| ffi::folly_contended_future()).collect();
+    executor::block_on(future::try_join_all(futures)).unwrap();
+    assert_eq!(
+        executor::block_on(ffi::folly_contended_stream().count()),
+        16
+    );
+    let pool = ContentionPool(ThreadPool::builder().pool_size(2).create().unwrap());
+    assert_eq!(ffi::folly_await_contended_rust(&pool, 16).len(), 16);
+}
+
 // Test dropping futures.
 #[test]
 fn test_dropping_futures() {
@@ -294,6 +187,24 @@ fn test_streams_throwing_exceptions() {
     );
 }
 
+// Test C++ calling Rust streams.
+#[test]
+fn test_cpp_calling_rust_streams() {
+    assert_eq!(
+        ffi::folly_call_rust_fizzbuzz(),
+        "1, 2, Fizz, 4, Buzz, Fizz, 7, 8, Fizz, Buzz, 11, Fizz, 13, 14, FizzBuzz"
+    );
+}
+
+// Test C++ calling Rust streams that return errors partway through.
+#[test]
+fn test_rust_streams_returning_errors() {
+    assert_eq!(
+        ffi::folly_call_rust_not_fizzbuzz(),
+        "1, 2, Fizz, 4, Buzz, Fizz, 7, 8, Fizz, Buzz: kapow"
+    );
+}
+
 #[test]
 fn test_dropping_coroutines() {
     // Make sure that coroutines get parented to the reaper so that destructors are called.
@@ -301,6 +212,13 @@ fn test_dropping_coroutines() {
     drop(executor::block_on(ffi::folly_drop_coroutine_signal()));
 }
 
+#[test]
+fn test_cancelling_coroutines() {
+    // Make sure that dropping a future cancels the coroutine behind it.
+    drop(ffi::folly_cancel_coroutine_wait());
+    ffi::folly_cancel_coroutine_check();
+}
+
 fn main() {
     // Test Rust calling C++ async functions, both synchronously and via a scheduler.
     for fun in &[ffi::folly_dot_product_coro, ffi::folly_dot_product_futures] {
@@ -364,7 +282,15 @@ fn main() {
     );
     println!("{}", vector.join(", "));
 
+    // Test C++ calling Rust streams.
+    println!("{}", ffi::folly_call_rust_fizzbuzz());
+    println!("{}", ffi::folly_call_rust_not_fizzbuzz());
+
     // Test that destructors are called when dropping a future.
     let _ = ffi::folly_drop_coroutine_wait();
     drop(executor::block_on(ffi::folly_drop_coroutine_signal()));
+
+    // Test cancelling coroutines by dropping their futures.
+    drop(ffi::folly_cancel_coroutine_wait());
+    ffi::folly_cancel_coroutine_check();
 }
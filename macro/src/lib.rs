@@ -24,6 +24,7 @@ use syn::Ident;
 use syn::ImplItem;
 use syn::ItemImpl;
 use syn::Lit;
+use syn::LitInt;
 use syn::LitStr;
 use syn::Path;
 use syn::Result as SynResult;
@@ -104,12 +105,13 @@ fn bridge_future(pieces: AstPieces) -> TokenStream {
         trait_path,
         vtable_glue_ident,
         vtable_glue_link_name,
+        capacity: _,
     } = pieces;
     (quote! {
         /// A future shared between Rust and C++.
         #[repr(transparent)]
         pub struct #future {
-            future: ::cxx_async::private::BoxFuture<'static, ::cxx_async::CxxAsyncResult<#output>>,
+            future: ::cxx_async::private::CxxAsyncBoxFuture<#output>,
         }
 
         impl #future {
@@ -120,8 +122,7 @@ fn bridge_future(pieces: AstPieces) -> TokenStream {
             //    method.
             // 3. The struct isn't `repr(packed)`. We define the struct and don't have this
             //    attribute.
-            ::cxx_async::unsafe_pinned!(future: ::cxx_async::private::BoxFuture<'static,
-                ::cxx_async::CxxAsyncResult<#output>>);
+            ::cxx_async::unsafe_pinned!(future: ::cxx_async::private::CxxAsyncBoxFuture<#output>);
 
             #[doc(hidden)]
             fn assert_field_is_unpin() {
@@ -142,7 +143,7 @@ fn bridge_future(pieces: AstPieces) -> TokenStream {
             fn fallible<Fut>(future: Fut) -> Self where Fut: ::std::future::Future<Output =
                     ::cxx_async::CxxAsyncResult<#output>> + Send + 'static {
                 #future {
-                    future: Box::pin(future),
+                    future: ::cxx_async::private::CxxAsyncBoxFuture::new(future),
                 }
             }
         }
@@ -156,12 +157,11 @@ fn bridge_future(pieces: AstPieces) -> TokenStream {
             }
         }
 
-        // Define how to wrap concrete receivers in the future type we're defining.
-        impl ::std::convert::From<::cxx_async::CxxAsyncReceiver<#output>> for #future {
-            fn from(receiver: ::cxx_async::CxxAsyncReceiver<#output>) -> Self {
-                Self {
-                    future: Box::pin(receiver),
-                }
+        // Define how to wrap the receivers that `future_channel` creates in the future type we're
+        // defining.
+        impl ::std::convert::From<::cxx_async::private::CxxAsyncBoxFuture<#output>> for #future {
+            fn from(future: ::cxx_async::private::CxxAsyncBoxFuture<#output>) -> Self {
+                Self { future }
             }
         }
 
@@ -193,7 +193,7 @@ fn bridge_future(pieces: AstPieces) -> TokenStream {
             static VTABLE: ::cxx_async::CxxAsyncVtable = ::cxx_async::CxxAsyncVtable {
                 channel: ::cxx_async::future_channel::<#future, #output> as *mut u8,
                 sender_send: ::cxx_async::sender_future_send::<#output> as *mut u8,
-                sender_drop: ::cxx_async::sender_drop::<#output> as *mut u8,
+                sender_drop: ::cxx_async::sender_future_drop::<#output> as *mut u8,
                 future_poll: ::cxx_async::future_poll::<#future, #output> as *mut u8,
                 future_drop: ::cxx_async::future_drop::<#future> as *mut u8,
             };
@@ -238,6 +238,17 @@ fn bridge_future(pieces: AstPieces) -> TokenStream {
 /// }
 /// ```
 ///
+/// By default, a C++ coroutine that yields a value suspends until Rust has consumed it. To let the
+/// coroutine run further ahead, add a `capacity = ...` attribute giving the number of values to
+/// buffer. Both attributes can be combined, separated by a comma:
+///
+/// ```ignore
+/// #[cxx_async::bridge_stream(namespace = mycompany::myproject, capacity = 16)]
+/// unsafe impl Stream for RustStreamStringNamespaced {
+///     type Item = String;
+/// }
+/// ```
+///
 /// ## Safety
 ///
 /// It's the programmer's responsibility to ensure that the specified `Item` type correctly
@@ -256,12 +267,14 @@ fn bridge_stream(pieces: AstPieces) -> TokenStream {
         trait_path,
         vtable_glue_ident,
         vtable_glue_link_name,
+        capacity,
     } = pieces;
     (quote! {
         /// A multi-shot stream shared between Rust and C++.
-        #[repr(transparent)]
+        #[repr(C)]
         pub struct #stream {
-            stream: ::cxx_async::private::BoxStream<'static, ::cxx_async::CxxAsyncResult<#item>>,
+            stream: ::cxx_async::private::CxxAsyncBoxStream<#item>,
+            next_receiver: ::cxx_async::private::CxxAsyncNextReceiver,
         }
 
         impl #stream {
@@ -272,8 +285,7 @@ fn bridge_stream(pieces: AstPieces) -> TokenStream {
             //    method.
             // 3. The struct isn't `repr(packed)`. We define the struct and don't have this
             //    attribute.
-            ::cxx_async::unsafe_pinned!(stream: ::cxx_async::private::BoxStream<'static,
-                ::cxx_async::CxxAsyncResult<#item>>);
+            ::cxx_async::unsafe_pinned!(stream: ::cxx_async::private::CxxAsyncBoxStream<#item>);
 
             #[doc(hidden)]
             fn assert_field_is_unpin() {
@@ -294,7 +306,8 @@ fn bridge_stream(pieces: AstPieces) -> TokenStream {
             fn fallible<Stm>(stream: Stm) -> Self where Stm: #trait_path<Item =
                     ::cxx_async::CxxAsyncResult<#item>> + Send + 'static {
                 #stream {
-                    stream: Box::pin(stream),
+                    stream: ::cxx_async::private::CxxAsyncBoxStream::new(stream),
+                    next_receiver: Default::default(),
                 }
             }
         }
@@ -308,12 +321,11 @@ fn bridge_stream(pieces: AstPieces) -> TokenStream {
             }
         }
 
-        // Define how to wrap concrete receivers in the stream type we're defining.
-        impl ::std::convert::From<::cxx_async::CxxAsyncReceiver<#item>> for #stream {
-            fn from(receiver: ::cxx_async::CxxAsyncReceiver<#item>) -> Self {
-                Self {
-                    stream: Box::pin(receiver),
-                }
+        // Define how to wrap the receivers that `stream_channel` creates in the stream type we're
+        // defining.
+        impl ::std::convert::From<::cxx_async::private::CxxAsyncBoxStream<#item>> for #stream {
+            fn from(stream: ::cxx_async::private::CxxAsyncBoxStream<#item>) -> Self {
+                Self { stream, next_receiver: Default::default() }
             }
         }
 
@@ -342,12 +354,11 @@ fn bridge_stream(pieces: AstPieces) -> TokenStream {
         #[allow(non_snake_case)]
         #[export_name = #vtable_glue_link_name]
         pub unsafe extern "C" fn #vtable_glue_ident() -> *const ::cxx_async::CxxAsyncVtable {
-            // TODO(pcwalton): Support C++ calling Rust Streams.
             static VTABLE: ::cxx_async::CxxAsyncVtable = ::cxx_async::CxxAsyncVtable {
-                channel: ::cxx_async::stream_channel::<#stream, #item> as *mut u8,
+                channel: ::cxx_async::stream_channel::<#stream, #item, #capacity> as *mut u8,
                 sender_send: ::cxx_async::sender_stream_send::<#item> as *mut u8,
-                sender_drop: ::cxx_async::sender_drop::<#item> as *mut u8,
-                future_poll: ::std::ptr::null_mut(),
+                sender_drop: ::cxx_async::sender_stream_drop::<#item> as *mut u8,
+                future_poll: ::cxx_async::stream_poll::<#stream, #item> as *mut u8,
                 future_drop: ::cxx_async::future_drop::<#stream> as *mut u8,
             };
             return &VTABLE;
@@ -380,14 +391,21 @@ struct AstPieces {
     vtable_glue_ident: Ident,
     // The external C++ link name of the future/stream vtable.
     vtable_glue_link_name: String,
+    // The number of values that a stream buffers before the C++ coroutine producing them has to
+    // wait. Always 1 for futures.
+    capacity: usize,
 }
 
 impl AstPieces {
     // Parses the macro arguments and returns the pieces, returning a `syn::Error` on error.
     fn from_token_streams(attribute: TokenStream, item: TokenStream) -> SynResult<AstPieces> {
-        let namespace: NamespaceAttribute = syn::parse(attribute).map_err(|error| {
-            SynError::new(error.span(), "expected possible namespace attribute")
+        let attributes: BridgeAttributes = syn::parse(attribute).map_err(|error| {
+            SynError::new(
+                error.span(),
+                "expected possible `namespace` and `capacity` attributes",
+            )
         })?;
+        let namespace = attributes.namespace;
 
         let impl_item: ItemImpl = syn::parse(item).map_err(|error| {
             SynError::new(
@@ -504,6 +522,26 @@ impl AstPieces {
             }
         };
 
+        let capacity = match (&bridge_trait, attributes.capacity) {
+            (_, None) => 1,
+            (BridgeTrait::Future, Some(capacity)) => {
+                return Err(SynError::new(
+                    capacity.span(),
+                    "`capacity` is only supported for streams",
+                ));
+            }
+            (BridgeTrait::Stream, Some(capacity)) => {
+                let value: usize = capacity.base10_parse()?;
+                if value == 0 {
+                    return Err(SynError::new(
+                        capacity.span(),
+                        "`capacity` must be at least 1",
+                    ));
+                }
+                value
+            }
+        };
+
         let future = match *impl_item.self_ty {
             Type::Path(TypePath { qself: None, path }) => {
                 path.get_ident().cloned().ok_or_else(|| {
@@ -525,7 +563,6 @@ impl AstPieces {
             &format!(
                 "{}{}",
                 namespace
-                    .0
                     .iter()
                     .fold(String::new(), |acc, piece| acc + piece + "::"),
                 future
@@ -537,7 +574,6 @@ impl AstPieces {
             &format!(
                 "cxxasync_{}{}_vtable",
                 namespace
-                    .0
                     .iter()
                     .fold(String::new(), |acc, piece| acc + piece + "_"),
                 future
@@ -547,7 +583,6 @@ impl AstPieces {
         let vtable_glue_link_name = format!(
             "cxxasync_{}{}_vtable",
             namespace
-                .0
                 .iter()
                 .fold(String::new(), |acc, piece| acc + piece + "$"),
             future
@@ -561,6 +596,7 @@ impl AstPieces {
             trait_path,
             vtable_glue_ident,
             vtable_glue_link_name,
+            capacity,
         })
     }
 }
@@ -568,23 +604,46 @@ impl AstPieces {
 mod keywords {
     use syn::custom_keyword;
     custom_keyword!(namespace);
+    custom_keyword!(capacity);
 }
 
-struct NamespaceAttribute(Vec<String>);
+// The comma-separated, optional arguments to the `#[bridge]` attribute.
+struct BridgeAttributes {
+    // The C++ namespace that the type lives in, from `namespace = ...`.
+    namespace: Vec<String>,
+    // The stream buffer size, from `capacity = ...`.
+    capacity: Option<LitInt>,
+}
 
-impl Parse for NamespaceAttribute {
+impl Parse for BridgeAttributes {
     fn parse(input: ParseStream) -> ParseResult<Self> {
-        if input.is_empty() {
-            return Ok(NamespaceAttribute(vec![]));
+        let mut attributes = BridgeAttributes {
+            namespace: vec![],
+            capacity: None,
+        };
+        while !input.is_empty() {
+            let lookahead = input.lookahead1();
+            if lookahead.peek(keywords::namespace) {
+                input.parse::<keywords::namespace>()?;
+                input.parse::<Token![=]>()?;
+                let path = input.call(Path::parse_mod_style)?;
+                attributes.namespace = path
+                    .segments
+                    .iter()
+                    .map(|segment| segment.ident.to_string())
+                    .collect();
+            } else if lookahead.peek(keywords::capacity) {
+                input.parse::<keywords::capacity>()?;
+                input.parse::<Token![=]>()?;
+                attributes.capacity = Some(input.parse()?);
+            } else {
+                return Err(lookahead.error());
+            }
+
+            if !input.is_empty() {
+                input.parse::<Token![,]>()?;
+            }
         }
-        input.parse::<keywords::namespace>()?;
-        input.parse::<Token![=]>()?;
-        let path = input.call(Path::parse_mod_style)?;
-        Ok(NamespaceAttribute(
-            path.segments
-                .iter()
-                .map(|segment| segment.ident.to_string())
-                .collect(),
-        ))
+        Ok(attributes)
     }
 }